@@ -0,0 +1,65 @@
+# Client for the locate daemon (src/located), which holds the loaded
+# bigmatcher in its own process and locates images sent over a Unix socket.
+# Each request opens a connection, sends a header and the encoded image, and
+# reads back a fixed size response; the layouts must match located.cpp.
+#
+# Usage: python locate_client.py <socket-path> <image> [<budget-ms> [<lat> <lng> <radius-m>]]
+import socket
+import struct
+import sys
+
+REQUEST = struct.Struct('<4sIiIddd')    # magic, version, budgetMs, length, hintLat, hintLng, hintRadius
+RESPONSE = struct.Struct('<4siiiddd')   # magic, status, located, degraded, lat, lng, elapsedMs
+VERSION = 2
+
+# Names of the LocateStatus values, in enum order (see locateStatusName)
+STATUS_NAMES = ['ok', 'unreadable', 'blurry', 'untextured', 'low_contrast', 'timeout',
+                'no_viewpoints', 'sv_unreadable', 'no_match', 'overloaded']
+
+class LocateClient(object):
+    def __init__(self, path, timeout=10.0):
+        self.path = path
+        self.timeout = timeout
+
+    # Locate the encoded image within budget_ms (0 = unlimited). hint is an
+    # optional (lat, lng, radius in metres) narrowing a regional bigmatcher to
+    # the regions around it. Returns a dict with located, status, lat, lng,
+    # degraded and elapsedMs; raises socket.error if the daemon can't be
+    # reached or hangs up.
+    def locate(self, image_bytes, budget_ms=0, hint=None):
+        hint_lat, hint_lng, hint_radius = hint if hint is not None else (0.0, 0.0, 0.0)
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.settimeout(self.timeout)
+        try:
+            s.connect(self.path)
+            s.sendall(REQUEST.pack(b'SVLQ', VERSION, budget_ms, len(image_bytes), hint_lat, hint_lng, hint_radius))
+            s.sendall(image_bytes)
+            data = b''
+            while len(data) < RESPONSE.size:
+                chunk = s.recv(RESPONSE.size - len(data))
+                if not chunk:
+                    raise socket.error('locate daemon closed the connection')
+                data += chunk
+        finally:
+            s.close()
+
+        magic, status, located, degraded, lat, lng, elapsed = RESPONSE.unpack(data)
+        if magic != b'SVLR':
+            raise socket.error('bad response from locate daemon')
+        return {
+            'located': located != 0,
+            'status': STATUS_NAMES[status] if 0 <= status < len(STATUS_NAMES) else 'unknown',
+            'lat': lat,
+            'lng': lng,
+            'degraded': degraded != 0,
+            'elapsedMs': elapsed,
+        }
+
+
+if __name__ == '__main__':
+    client = LocateClient(sys.argv[1])
+    with open(sys.argv[2], 'rb') as f:
+        image = f.read()
+    budget = int(sys.argv[3]) if len(sys.argv) > 3 else 0
+    hint = tuple(float(x) for x in sys.argv[4:7]) if len(sys.argv) > 6 else None
+    print(client.locate(image, budget, hint))
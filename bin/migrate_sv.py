@@ -0,0 +1,15 @@
+# Migrates the SV images listed in the filenames file from individual .jpg
+# files into the packed image archive read by the locator. Images already in
+# the archive are skipped, so the migration can be re-run if interrupted.
+# Once it has finished, the .jpg files are no longer needed by the locator.
+#
+# Usage: python migrate_sv.py [<sv-folder> [<filenames-file> [<archive>]]]
+import sys
+import feature_saver
+
+folder = sys.argv[1] if len(sys.argv) > 1 else 'sv/'
+filenames = sys.argv[2] if len(sys.argv) > 2 else folder + 'filenames.txt'
+archive = sys.argv[3] if len(sys.argv) > 3 else folder + 'images.sva'
+
+f_saver = feature_saver.FeatureSaver()
+f_saver.archiveImages(folder, filenames, archive)
@@ -1,7 +1,11 @@
 import os
+import io
+import tempfile
+import threading
 import feature_saver
 import data_generator
 import locator
+import locate_client
 
 from flask import Flask
 from flask import request, send_file, jsonify
@@ -79,6 +83,16 @@ app.config['SV_FILENAMES'] = 'filenames.txt'
 app.config['SV_QUERY'] = 'query.jpg'
 app.config['SV_DATA'] = 'data.csv'
 app.config['SV_LOCATIONS_FILENAME'] = 'locations.txt'
+app.config['SV_ARCHIVE'] = 'images.sva'        # all SV images in one file, see migrate_sv.py
+app.config['BIGMATCHER_DEDUP_DISTANCE'] = 0.15    # merge cross-view descriptors closer than this (0 = off)
+app.config['BIGMATCHER_REGION_SIZE'] = 0    # degrees per regional index loaded on demand (0 = one global index)
+app.config['LOCATOR_REGION_BUDGET_MB'] = 2048    # memory kept for resident regional indexes
+app.config['LOCATE_HINT_RADIUS_M'] = 2000    # search this far around a client's lat/lng hint
+app.config['LOCATE_BUDGET_MS'] = 8000    # keep below the mobile client's request timeout
+app.config['LOCATED_SOCKET'] = '/tmp/located.sock'    # locate daemon, used instead of the in-process locator when running
+app.config['LOCATOR_SHARDS'] = []    # sockets of locateshard processes to scatter searches over (empty = search locally)
+app.config['LOCATOR_SHARD_TIMEOUT_MS'] = 1000    # a shard slower than this is left out of the search
+app.config['LOCATOR_SHARD_TOP_K'] = 200    # viewpoints each shard votes for
 
 # TODO: just return the filename (easier)
 # Given a location, fetch the SV images for each heading and pitch,
@@ -134,6 +148,9 @@ def sv():
     print "*** Fetching and processing Street View Images ***"
     # My C++ library to compute and save image features
     f_saver = feature_saver.FeatureSaver()
+    f_saver.setArchive(app.config['SV_FOLDER'] + app.config['SV_ARCHIVE'])
+    # The archive is the only copy kept of each image
+    f_saver.setRemoveArchived(True)
     # Open file for writing filenames
     filenameFile = open(app.config['SV_FOLDER'] + app.config['SV_FILENAMES'], 'w')
     # read args from POST form data
@@ -185,9 +202,14 @@ def sv():
     # My C++ library to compute and save image features
     filenameFile.close()
     f_saver = feature_saver.FeatureSaver()
+    f_saver.setDedupDistance(app.config['BIGMATCHER_DEDUP_DISTANCE'])
+    f_saver.setRegionSize(app.config['BIGMATCHER_REGION_SIZE'])
     print app.config['SV_FOLDER'] + app.config['SV_FILENAMES']
     print app.config['SV_FEATURES_FOLDER']
     f_saver.saveBigTree(app.config['SV_FOLDER'] + app.config['SV_FILENAMES'], app.config['SV_FEATURES_FOLDER'])
+    # pick up the new images; the locate daemon only opens the archive when it starts
+    if l is not None:
+        l.openArchive(app.config['SV_FOLDER'] + app.config['SV_ARCHIVE'])
     return jsonify(success='true')
 
 # produces a csv file detailing number of matches for query image against saved SV data
@@ -248,16 +270,11 @@ def get_place():
 def locate():
     # Get the file
     file = request.files['file']
-    # Path to save query image to sv/query.jpg
-    filepath = os.path.join(app.config['SV_FOLDER'], app.config['SV_QUERY'])
 
     if file:
-        # Ensure filename is safe and save
-        filename = secure_filename(file.filename)
-        file.save(filepath)
-
-        # resize the image (too large causes out-of-memory error)
-        img = Image.open(filepath)
+        # resize the image (too large causes out-of-memory error); it is kept in memory, as
+        # concurrent requests would overwrite each other's image at a fixed path
+        img = Image.open(file)
         if img.size[1] < img.size[0]:
             width = 800
             wpercent = (width/float(img.size[0]))
@@ -268,14 +285,46 @@ def locate():
             width = int((float(img.size[0]) * float(hpercent)))
 
         img = img.resize((width, height), PIL.Image.ANTIALIAS)
-        img.save(filepath)
+        encoded = io.BytesIO()
+        img.convert('RGB').save(encoded, 'JPEG')
+        image = encoded.getvalue()
     else:
         return jsonify(success=False)
 
-    # locate the object in the query image and send response
-    if l.locate(app.config['SV_FOLDER'] + app.config['SV_QUERY'], app.config['SV_FOLDER'], app.config['SV_FOLDER'] + app.config['SV_FILENAMES']):
-        lat=l.getLat()
-        lng=l.getLng()
+    # an approximate location from the client narrows a regional bigmatcher to nearby regions
+    hint = None
+    if 'lat' in request.form and 'lng' in request.form:
+        hint = (float(request.form['lat']), float(request.form['lng']), app.config['LOCATE_HINT_RADIUS_M'])
+
+    # locate the object in the query image within the latency budget, forwarding it to the
+    # locate daemon if one was running when the server started
+    result = None
+    if l is None:
+        try:
+            result = locate_client.LocateClient(app.config['LOCATED_SOCKET']).locate(image, app.config['LOCATE_BUDGET_MS'], hint)
+        except Exception as e:
+            # e.g. a stale socket left by a daemon which crashed
+            print "Locate daemon failed, locating in process: {}".format(e)
+    if result is None:
+        params = locator.LocateParams()
+        params.budgetMs = app.config['LOCATE_BUDGET_MS']
+        if hint is not None:
+            params.hintLat, params.hintLng, params.hintRadius = hint
+        # the Locator reads the query from a file, so each request writes its own
+        fd, filepath = tempfile.mkstemp(suffix='.jpg', dir=app.config['SV_FOLDER'])
+        try:
+            with os.fdopen(fd, 'wb') as f:
+                f.write(image)
+            # the result of this request, rather than the Locator's last which another thread may overwrite
+            result = loadLocator().locateResult(filepath, app.config['SV_FOLDER'], app.config['SV_FOLDER'] + app.config['SV_FILENAMES'], params)
+        finally:
+            os.remove(filepath)
+        result['status'] = str(result['status']).lower()
+
+    # send response
+    if result['located']:
+        lat=result['lat']
+        lng=result['lng']
         print "Looking for places near {},{}".format(lat, lng)
         try:
             places = db.places.find({
@@ -289,18 +338,54 @@ def locate():
                     }
                 }
             })
-            return jsonify(success=True,lat=l.getLat(),lng=l.getLng(),places=json_util.dumps(places))
+            return jsonify(success=True,lat=lat,lng=lng,degraded=result['degraded'],places=json_util.dumps(places))
         except:
             return jsonify(success=False)
     else:
-        return jsonify(success=False)
-
+        return jsonify(success=False,reason=result['status'])
+
+# running statistics of the locator, e.g. how many queries the pre-check rejected
+@app.route('/locate/stats', methods=['GET'])
+def locate_stats():
+    if l is None:
+        return jsonify(success=False,reason='served_by_daemon')
+    return jsonify(l.getStats())
+
+
+# Load the in-process locator, unless it already is. Called when the locate daemon can't be
+# reached, as well as at import.
+l = None
+loadLock = threading.Lock()
+def loadLocator():
+    global l
+    with loadLock:
+        if l is None:
+            print "Loading..."
+            # with shards to scatter the search over, this process only coordinates and holds no bigmatcher
+            loaded = locator.Locator(not app.config['LOCATOR_SHARDS'])
+            loaded.openArchive(app.config['SV_FOLDER'] + app.config['SV_ARCHIVE'])
+            loaded.setRegionBudget(app.config['LOCATOR_REGION_BUDGET_MB'])
+            if app.config['LOCATOR_SHARDS']:
+                loaded.setShards(app.config['LOCATOR_SHARDS'], app.config['LOCATOR_SHARD_TIMEOUT_MS'], app.config['LOCATOR_SHARD_TOP_K'])
+            l = loaded
+            print "Loaded!"
+        return l
+
+# Pre-load the locator at import, so that a pre-fork server (e.g. gunicorn --preload) loads it
+# once in the parent: its workers then share the mapped bigmatcher descriptors and the index
+# rather than each loading a private copy. If the locate daemon is running, it holds the
+# bigmatcher instead and every query is forwarded to it, so nothing is loaded here unless
+# the daemon later turns out to be unreachable.
+if os.path.exists(app.config['LOCATED_SOCKET']):
+    print "Forwarding queries to the locate daemon at {}".format(app.config['LOCATED_SOCKET'])
+else:
+    loadLocator()
+
+# Connect at import too, so the places lookup also works when the app is served by gunicorn.
+# MongoClient connects lazily and is fork-safe, so each worker opens its own connections.
+db = MongoClient(connect=False).identisnap
+print "Connected!"
 
 if __name__ == '__main__':
     app.debug = False
-    print "Loading..."
-    l = locator.Locator()   #pre-load the locator
-    print "Loaded!"
-    db = MongoClient().identisnap
-    print "Connected!"
     app.run(host='0.0.0.0')
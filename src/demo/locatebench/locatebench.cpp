@@ -0,0 +1,237 @@
+/*
+** Program which locates each query image listed in <queries-file> (lines of
+** <image-path>,<lat>,<lng> giving the true location) once per query keypoint
+** budget, reporting the latency and location error of each run followed by a
+** summary per budget. A budget of 0 keeps every keypoint and is always run
+** first as the baseline. Finally every query is located again through
+** Locator::locateBatch to compare its throughput with the baseline's, and
+** then from several concurrent clients under a range of request coalescing
+** windows to measure the latency/throughput trade-off of coalescing. Last,
+** every query is located twice with the viewpoint cache on and then twice
+** with the result cache on, to time repeated queries.
+**
+** Must be run from the folder containing the stored bigmatcher. SV images are
+** read from <sv-folder>/images.sva when it exists.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <omp.h>
+#include "/root/server/src/lib/locator.hpp"
+
+using namespace cv;
+
+void DIE(const char* message)
+{
+  printf("%s\n", message);
+  exit(1);
+}
+
+struct Query {
+  std::string path;
+  double lat;
+  double lng;
+};
+
+// Great-circle distance in metres between two lat-lngs
+double haversine(double lat1, double lng1, double lat2, double lng2)
+{
+  double dlat = (lat2 - lat1) * M_PI / 180.0;
+  double dlng = (lng2 - lng1) * M_PI / 180.0;
+  double a = sin(dlat/2) * sin(dlat/2) + cos(lat1 * M_PI / 180.0) * cos(lat2 * M_PI / 180.0) * sin(dlng/2) * sin(dlng/2);
+  return 6371000.0 * 2 * atan2(sqrt(a), sqrt(1 - a));
+}
+
+double median(std::vector<double> values)
+{
+  if(values.size() == 0) return 0;
+  std::sort(values.begin(), values.end());
+  return values.at(values.size() / 2);
+}
+
+double mean(std::vector<double> &values)
+{
+  if(values.size() == 0) return 0;
+  double sum = 0;
+  for(int i = 0; i < values.size(); i++) sum += values.at(i);
+  return sum / values.size();
+}
+
+int main( int argc, char** argv )
+{
+  if(argc < 4)
+  {
+    DIE("Missing arguments! Usage:\n\t./locatebench <queries-file> <sv-folder> <filenames-file> [<keypoints-per-megapixel> ...]");
+  }
+  std::string svFolder(argv[2]);
+  svFolder += "/";
+  std::vector<int> budgets(1, 0);
+  for(int i = 4; i < argc; i++)
+  {
+    budgets.push_back(atoi(argv[i]));
+  }
+
+  // Read the queries and their true locations
+  std::ifstream queriesFile(argv[1]);
+  std::string line;
+  std::vector<Query> queries;
+  while(std::getline(queriesFile, line))
+  {
+    Query q;
+    char path[512];
+    if(sscanf(line.c_str(), "%511[^,],%lf,%lf", path, &q.lat, &q.lng) == 3)
+    {
+      q.path = path;
+      queries.push_back(q);
+    }
+  }
+  if(queries.size() == 0)
+  {
+    DIE("No queries to run!");
+  }
+
+  printf("Loading locator...\n");
+  Locator locator;
+  locator.openArchive((svFolder + "images.sva").c_str()); // falls back to the individual images
+  locator.setCache(0, 0); // every run below must go through the pipeline, reading every viewpoint
+  locator.setViewpointCache(0, 0);
+
+  printf("Budget | Query | Located | Degraded | Keypoints | Extract time (ms) | Total time (ms) | Error (m)\n");
+  std::vector<std::string> summaries;
+  double baselineMs = 0;
+  for(int b = 0; b < budgets.size(); b++)
+  {
+    LocateParams params;
+    params.keypointsPerMegapixel = budgets.at(b);
+    params.loadAdaptive = false; // measure the budget itself, not the machine's load
+
+    std::vector<double> totals, extracts, keypoints, errors;
+    int located = 0;
+    for(int i = 0; i < queries.size(); i++)
+    {
+      LocateResult result;
+      bool ok = locator.locate(queries.at(i).path.c_str(), svFolder.c_str(), argv[3], params, result);
+      double error = ok ? haversine(queries.at(i).lat, queries.at(i).lng, result.lat, result.lng) : -1;
+      printf("%d,%s,%d,%d,%d,%.1f,%.1f,%.1f\n", budgets.at(b), queries.at(i).path.c_str(), ok, result.degraded,
+        result.queryKeypoints, result.extractMs, result.elapsedMs, error);
+
+      totals.push_back(result.elapsedMs);
+      extracts.push_back(result.extractMs);
+      keypoints.push_back(result.queryKeypoints);
+      if(ok)
+      {
+        located++;
+        errors.push_back(error);
+      }
+    }
+
+    if(b == 0)
+    {
+      for(int i = 0; i < totals.size(); i++) baselineMs += totals.at(i);
+    }
+
+    char summary[256];
+    snprintf(summary, sizeof(summary), "%d,%.1f%%,%.0f,%.1f,%.1f,%.1f,%.1f", budgets.at(b), 100.0 * located / queries.size(),
+      mean(keypoints), mean(extracts), mean(totals), median(totals), median(errors));
+    summaries.push_back(summary);
+  }
+
+  printf("\nBudget | Located | Mean keypoints | Mean extract time (ms) | Mean total time (ms) | Median total time (ms) | Median error (m)\n");
+  for(int b = 0; b < summaries.size(); b++)
+  {
+    printf("%s\n", summaries.at(b).c_str());
+  }
+
+  // Locate every query again as one batch, pipelined across all cores
+  std::vector<std::string> paths;
+  for(int i = 0; i < queries.size(); i++) paths.push_back(queries.at(i).path);
+  std::vector<std::vector<uchar> > encoded(queries.size());
+  std::vector<LocateResult> results;
+  LocateParams params;
+  params.loadAdaptive = false;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  locator.locateBatch(paths, encoded, svFolder.c_str(), argv[3], params, results);
+  double batchSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  int batchLocated = 0;
+  for(int i = 0; i < results.size(); i++)
+  {
+    if(results.at(i).status == LOCATE_OK) batchLocated++;
+  }
+  printf("\nBatch: %d queries, %d located in %.1fs: %.2f queries/s (one at a time: %.2f queries/s)\n", (int)queries.size(), batchLocated,
+    batchSeconds, queries.size() / batchSeconds, baselineMs > 0 ? queries.size() / (baselineMs / 1000.0) : 0.0);
+
+  // Locate every query again from concurrent clients, coalescing their bigmatcher searches
+  int clients = std::max(2, omp_get_max_threads() / 2);
+  double windows[] = { 0, 1, 2, 5, 10 };
+  printf("\nWindow (ms) | Clients | Queries/s | Mean latency (ms) | 95th percentile latency (ms) | Mean search batch\n");
+  for(int w = 0; w < sizeof(windows) / sizeof(windows[0]); w++)
+  {
+    locator.setCoalescing(windows[w], clients);
+    LocatorStats before = locator.getCounters();
+    std::vector<double> latencies(queries.size(), 0);
+    std::atomic<int> nextQuery(0);
+    std::chrono::steady_clock::time_point clientsStart = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(int c = 0; c < clients; c++)
+    {
+      threads.push_back(std::thread([&]() {
+        for(int i = nextQuery++; i < queries.size(); i = nextQuery++)
+        {
+          LocateResult result;
+          locator.locate(queries.at(i).path.c_str(), svFolder.c_str(), argv[3], params, result);
+          latencies.at(i) = result.elapsedMs;
+        }
+      }));
+    }
+    for(int c = 0; c < threads.size(); c++) threads.at(c).join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - clientsStart).count();
+
+    LocatorStats after = locator.getCounters();
+    long searches = after.searches - before.searches;
+    std::vector<double> sorted(latencies);
+    std::sort(sorted.begin(), sorted.end());
+    printf("%.0f,%d,%.2f,%.1f,%.1f,%.2f\n", windows[w], clients, queries.size() / seconds, mean(latencies),
+      sorted.at((int)(0.95 * (sorted.size() - 1))), searches > 0 ? (double)(after.coalescedQueries - before.coalescedQueries) / searches : 1.0);
+  }
+  locator.setCoalescing(0, 1);
+
+  // Locate every query twice with the viewpoint cache on: the second pass reranks warm viewpoints
+  locator.setViewpointCache(256, 512);
+  std::vector<double> coldMs, warmMs;
+  for(int pass = 0; pass < 2; pass++)
+  {
+    for(int i = 0; i < queries.size(); i++)
+    {
+      LocateResult result;
+      locator.locate(queries.at(i).path.c_str(), svFolder.c_str(), argv[3], params, result);
+      (pass == 0 ? coldMs : warmMs).push_back(result.elapsedMs);
+    }
+  }
+  printf("\nViewpoint cache: mean latency %.1fms with warm viewpoints (cold %.1fms)\n", mean(warmMs), mean(coldMs));
+
+  // And again with the result cache on too: the second pass should be all hits
+  locator.clearCache();
+  locator.setCache(256, 4);
+  std::vector<double> firstMs, repeatMs;
+  int repeatHits = 0;
+  for(int pass = 0; pass < 2; pass++)
+  {
+    for(int i = 0; i < queries.size(); i++)
+    {
+      LocateResult result;
+      locator.locate(queries.at(i).path.c_str(), svFolder.c_str(), argv[3], params, result);
+      (pass == 0 ? firstMs : repeatMs).push_back(result.elapsedMs);
+      if(pass == 1 && result.cached) repeatHits++;
+    }
+  }
+  printf("\nCache: %d of %d repeated queries hit, mean latency %.2fms (first pass %.1fms)\n", repeatHits, (int)queries.size(),
+    mean(repeatMs), mean(firstMs));
+}
@@ -0,0 +1,78 @@
+/*
+** Program which locates the numbered frames <frames-folder>/0001.jpg,
+** 0002.jpg, ... (as produced by images/sequentialise.sh) through a
+** LocateSession, reporting for each frame whether it was a keyframe or
+** tracked, its latency and location, followed by a summary comparing the
+** cost of the session against locating every frame from scratch.
+**
+** Must be run from the folder containing the stored bigmatcher.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include "/root/server/src/lib/locator.hpp"
+
+using namespace cv;
+
+void DIE(const char* message)
+{
+  printf("%s\n", message);
+  exit(1);
+}
+
+int main( int argc, char** argv )
+{
+  if(argc < 4)
+  {
+    DIE("Missing arguments! Usage:\n\t./locatesequence <frames-folder> <sv-folder> <filenames-file> [<keyframe-interval> [<min-tracked-fraction>]]");
+  }
+  std::string framesFolder(argv[1]);
+  std::string svFolder(argv[2]);
+  svFolder += "/";
+  int keyframeInterval = argc > 4 ? atoi(argv[4]) : 30;
+  double minTrackedFraction = argc > 5 ? atof(argv[5]) : 0.5;
+
+  printf("Loading locator...\n");
+  Locator locator;
+  locator.openArchive((svFolder + "images.sva").c_str()); // falls back to the individual images
+  LocateSession session(locator, svFolder.c_str(), argv[3]);
+  session.setTracking(keyframeInterval, minTrackedFraction, 400);
+
+  printf("Frame | Keyframe | Located | Tracked fraction | Time (ms) | Lat | Lng\n");
+  double keyframeMs = 0;
+  double trackedMs = 0;
+  int located = 0;
+  for(int frame = 1; ; frame++)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "/%04d.jpg", frame);
+    std::string path = framesFolder + name;
+    std::ifstream exists(path.c_str());
+    if(!exists.is_open()) break;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool ok = session.track(path.c_str());
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if(session.isKeyframe()) keyframeMs += ms;
+    else trackedMs += ms;
+    if(ok) located++;
+    printf("%d | %s | %s | %.2f | %.1f | %.7f | %.7f\n", frame, session.isKeyframe() ? "yes" : "no", ok ? "yes" : "no",
+      session.getTrackedFraction(), ms, ok ? session.getLat() : 0.0, ok ? session.getLng() : 0.0);
+  }
+
+  int frames = session.getFrames();
+  int keyframes = session.getKeyframes();
+  if(frames == 0)
+  {
+    DIE("No frames to locate!");
+  }
+  printf("\n%d frames, %d located, %d keyframes (%d full bigmatcher searches)\n", frames, located, keyframes, session.getFullSearches());
+  printf("Mean time per keyframe: %.1fms, per tracked frame: %.1fms, per frame: %.1fms\n",
+    keyframes > 0 ? keyframeMs / keyframes : 0.0, frames > keyframes ? trackedMs / (frames - keyframes) : 0.0, (keyframeMs + trackedMs) / frames);
+  printf("Locating every frame from scratch would cost about %.1fms per frame\n", keyframes > 0 ? keyframeMs / keyframes : 0.0);
+  return 0;
+}
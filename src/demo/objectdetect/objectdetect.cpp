@@ -1,6 +1,9 @@
 /*
-** Program which accepts two images and outputs images visualising
-** their matches after different stages of filtering.
+** Program which accepts object images and a query image and outputs images
+** visualising their matches after different stages of filtering. The query
+** is matched against every object image at once and each object is verified
+** independently; the images show the object the most RANSAC inliers agree
+** with.
 */
 
 #include <stdio.h>
@@ -8,15 +11,40 @@
 
 using namespace cv;
 
+// The matches into the training image imgIdx
+std::vector<DMatch> matchesOf(std::vector<DMatch> &matches, int imgIdx)
+{
+  std::vector<DMatch> imageMatches;
+  for(int i = 0; i < matches.size(); i++)
+  {
+    if(matches.at(i).imgIdx == imgIdx) imageMatches.push_back(matches.at(i));
+  }
+  return imageMatches;
+}
+
 int main( int argc, char** argv )
 {
-  char* objectImageName = argv[1];
+  if(argc < 3)
+  {
+    printf("Missing arguments! Usage:\n\t./objectdetect <object-image> <query-image> [<object-image> ...]\n");
+    exit(1);
+  }
   char* queryImageName = argv[2];
 
-  Mat objectImage = imread(objectImageName);
+  std::vector<Mat> objectImages;
+  objectImages.push_back(imread(argv[1]));
+  for(int i = 3; i < argc; i++)
+  {
+    objectImages.push_back(imread(argv[i]));
+  }
   Mat queryImage = imread(queryImageName);
 
-  if(objectImage.data == NULL || queryImage.data == NULL)
+  bool missing = queryImage.data == NULL;
+  for(int i = 0; i < objectImages.size(); i++)
+  {
+    if(objectImages.at(i).data == NULL) missing = true;
+  }
+  if(missing)
   {
     printf("Missing image data!\n");
     exit(1);
@@ -25,11 +53,14 @@ int main( int argc, char** argv )
   Ptr<FeatureDetector> detector;
   createDetector(detector, "SIFT");
 
-  // Get object keypoints and descriptors
-  std::vector<KeyPoint> objectKeypoints;
-  Mat objectDescriptors;
-  getKeypointsAndDescriptors(objectImage, objectKeypoints, objectDescriptors, detector);
-  rootSIFT(objectDescriptors);
+  // Get the keypoints and descriptors of each object
+  std::vector<std::vector<KeyPoint> > objectsKeypoints(objectImages.size());
+  std::vector<Mat> objectsDescriptors(objectImages.size());
+  for(int i = 0; i < objectImages.size(); i++)
+  {
+    getKeypointsAndDescriptors(objectImages.at(i), objectsKeypoints.at(i), objectsDescriptors.at(i), detector);
+    rootSIFT(objectsDescriptors.at(i));
+  }
 
   // Get query keypoints and descriptors
   std::vector<KeyPoint> queryKeypoints;
@@ -37,6 +68,42 @@ int main( int argc, char** argv )
   getKeypointsAndDescriptors(queryImage, queryKeypoints, queryDescriptors, detector);
   rootSIFT(queryDescriptors);
 
+  Ptr<FlannBasedMatcher> matcher = new FlannBasedMatcher();
+  matcher->add(objectsDescriptors);
+  matcher->train();
+
+  // Single matching
+  std::vector<DMatch> singleMatches;
+  matcher->match(queryDescriptors, singleMatches);
+
+  // Knn matching + Lowe filter
+  std::vector<std::vector<DMatch> > knnmatches;
+  std::vector<DMatch> loweMatches;
+  matcher->knnMatch(queryDescriptors, knnmatches, 2);
+  loweFilter(knnmatches, loweMatches);
+
+  // RANSAC filter, verifying each object independently
+  std::vector<DMatch> matches = loweMatches;
+  std::vector<Mat> homographies;
+  std::vector<std::vector<DMatch> > objectMatches;
+  ransacFilter(matches, queryKeypoints, objectsKeypoints, homographies, objectMatches);
+
+  // Show the object the most inliers agree with
+  int best = 0;
+  for(int i = 1; i < objectMatches.size(); i++)
+  {
+    if(objectMatches.at(i).size() > objectMatches.at(best).size()) best = i;
+  }
+  Mat &objectImage = objectImages.at(best);
+  std::vector<KeyPoint> &objectKeypoints = objectsKeypoints.at(best);
+  matches = objectMatches.at(best);
+  Mat homography;
+  if(!matches.empty()) homography = homographies.at(best);
+  if(objectImages.size() > 1)
+  {
+    printf("Object %d has the most inliers (%d)\n", best + 1, (int)matches.size());
+  }
+
   // Write keypoint visualisation images
   Mat objectKeypointsImage;
   drawKeypoints(objectImage, objectKeypoints, objectKeypointsImage);
@@ -45,28 +112,14 @@ int main( int argc, char** argv )
   imwrite("object-keypoints.jpg", objectKeypointsImage);
   imwrite("query-keypoints.jpg", queryKeypointsImage);
 
-  Ptr<FlannBasedMatcher> matcher = new FlannBasedMatcher();
-
-  // Single matching
-  std::vector<DMatch> matches;
   Mat singleMatchesImage;
-  matcher->match(queryDescriptors, objectDescriptors, matches);
-  drawMatches(queryImage, queryKeypoints, objectImage, objectKeypoints, matches, singleMatchesImage);
+  drawMatches(queryImage, queryKeypoints, objectImage, objectKeypoints, matchesOf(singleMatches, best), singleMatchesImage);
   imwrite("single-matches.jpg", singleMatchesImage);
 
-  // Knn matching + Lowe filter
-  std::vector<std::vector<DMatch> > knnmatches;
-  matches.clear();
-  matcher->knnMatch(queryDescriptors, objectDescriptors, knnmatches, 2);
-  loweFilter(knnmatches, matches);
   Mat loweMatchesImage;
-  drawMatches(queryImage, queryKeypoints, objectImage, objectKeypoints, matches, loweMatchesImage);
+  drawMatches(queryImage, queryKeypoints, objectImage, objectKeypoints, matchesOf(loweMatches, best), loweMatchesImage);
   imwrite("lowe-matches.jpg", loweMatchesImage);
 
-  // RANSAC filter
-  Mat homography;
-  ransacFilter(matches, queryKeypoints, objectKeypoints, homography);
-
   // if a homography was successfully computed...
   if(homography.cols != 0 && homography.rows != 0)
   {
@@ -1,6 +1,7 @@
 /*
 ** Read <number> training images from <folder-name>, compute <feature-type>
-** features and store the constructed matcher <matcher-name> to disk
+** features and store the constructed matcher <matcher-name> to disk, along
+** with the keypoints of each image for the Recogniser to verify matches with
 */
 
 // header inclusion
@@ -10,6 +11,7 @@
 #include <iomanip>
 #include "/root/server/src/lib/engine.hpp"
 #include "/root/server/src/lib/saveable_matcher.hpp"
+#include "/root/server/src/lib/feature_pipeline.hpp"
 
 using namespace cv;
 
@@ -33,8 +35,11 @@ int main( int argc, char** argv )
   std::string const extension = ".jpg";
 
   printf("Creating detector...%d\n",number);
-  Ptr<FeatureDetector> detector;
-  createDetector(detector, featureType);
+  Ptr<FeaturePipeline> pipeline = createFeaturePipeline(featureType);
+  if(pipeline.empty())
+  {
+    DIE("Invalid feature type! One of SIFT, ROOTSIFT, SURF or ORB");
+  }
 
   std::vector<std::vector<KeyPoint> > trainingKeypoints;
   std::vector<Mat> trainingDescriptors;
@@ -54,11 +59,8 @@ int main( int argc, char** argv )
 
     // Compute keypoints and descriptors for this image
     std::vector<KeyPoint> imkps;
-    detector->detect(im, imkps);
     Mat imdescs;
-    detector->compute(im, imkps, imdescs);
-
-    if(strcmp(featureType, "ROOTSIFT") == 0) rootSIFT(imdescs);
+    pipeline->extract(im, imkps, imdescs, 0);
 
     trainingKeypoints.push_back(imkps);
     trainingDescriptors.push_back(imdescs);
@@ -66,7 +68,7 @@ int main( int argc, char** argv )
 
   //Create a matcher based on the model data
   printf("Creating matcher '%s'...\n", matcherName);
-  Ptr<SaveableFlannBasedMatcher> matcher = new SaveableFlannBasedMatcher(matcherName);
+  Ptr<SaveableFlannBasedMatcher> matcher = new SaveableFlannBasedMatcher(matcherName, pipeline->descriptorType());
   printf("Adding training descriptors...\n");
   matcher->add(trainingDescriptors);
   printf("Training...\n");
@@ -80,5 +82,18 @@ int main( int argc, char** argv )
   printf("Saving...\n");
   matcher->store();
 
+  //Save the training keypoints too, which the Recogniser verifies its matches against
+  std::string keypointsFilename(matcherName);
+  keypointsFilename += "-keypoints.yml.gz";
+  cv::FileStorage store(keypointsFilename, cv::FileStorage::WRITE);
+  store << "images" << (int)trainingKeypoints.size();
+  for(int i = 0; i < trainingKeypoints.size(); i++)
+  {
+    std::stringstream name;
+    name << "image" << i;
+    write(store, name.str(), trainingKeypoints.at(i));
+  }
+  store.release();
+
   printf("Done!\n");
 }
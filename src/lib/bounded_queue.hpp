@@ -0,0 +1,80 @@
+/*  Thread-safe FIFO queue holding at most `capacity` items, used to connect
+**  the stages of a pipeline so that a fast stage blocks rather than buffering
+**  without limit ahead of a slow one.
+**
+**  Producers push until they are done, then close() the queue; consumers pop
+**  until pop() returns false, i.e. the queue is closed and drained.
+*/
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+template<typename T>
+class BoundedQueue
+{
+public:
+  BoundedQueue(size_t _capacity) : capacity(_capacity), closed(false) {}
+
+  // Block while the queue is full. Returns false (dropping item) if the queue was closed.
+  bool push(const T &item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this]{ return closed || items.size() < capacity; });
+    if(closed) return false;
+    items.push_back(item);
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // As push, but never blocks: returns false (dropping item) if the queue is full or closed.
+  // Used for admission control, where a full queue means the request should be refused.
+  bool tryPush(const T &item)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(closed || items.size() >= capacity) return false;
+    items.push_back(item);
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Number of items currently queued
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.size();
+  }
+
+  // Block while the queue is empty. Returns false once the queue is closed and drained.
+  bool pop(T &item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this]{ return closed || !items.empty(); });
+    if(items.empty()) return false;
+    item = items.front();
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // Wake every waiting thread; remaining items can still be popped
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+protected:
+  size_t capacity;
+  bool closed;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+};
+
+#endif
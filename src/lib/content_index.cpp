@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <fstream>
+#include "content_index.hpp"
+
+// 64-bit FNV-1a over the signature followed by the bytes
+unsigned long long contentHash(const uchar* data, size_t size, const std::string &signature)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  for(size_t i = 0; i < signature.size(); i++)
+  {
+    hash = (hash ^ (uchar)signature[i]) * 1099511628211ULL;
+  }
+  for(size_t i = 0; i < size; i++)
+  {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+unsigned long long contentHash(const std::vector<uchar> &bytes, const std::string &signature)
+{
+  return contentHash(bytes.size() > 0 ? &bytes[0] : NULL, bytes.size(), signature);
+}
+
+// Read the index at path, which later calls to append add to. A missing index is empty.
+bool ContentIndex::load(const std::string &_path)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  path = _path;
+  byHash.clear();
+  byId.clear();
+  std::ifstream in(path.c_str());
+  if(!in.is_open()) return false;
+  std::string line;
+  while(std::getline(in, line))
+  {
+    unsigned long long hash;
+    char id[256];
+    if(sscanf(line.c_str(), "%llx %255[^\r\n]", &hash, id) != 2) continue;
+    byHash[hash] = id;
+    byId[id] = hash;
+  }
+  return true;
+}
+
+// The id most recently stored with the given content, if its features are still that content
+bool ContentIndex::find(unsigned long long hash, std::string &id) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<unsigned long long, std::string>::const_iterator it = byHash.find(hash);
+  if(it == byHash.end()) return false;
+  std::map<std::string, unsigned long long>::const_iterator current = byId.find(it->second);
+  if(current == byId.end() || current->second != hash) return false;
+  id = it->second;
+  return true;
+}
+
+// The content hash of the features stored for id
+bool ContentIndex::hashOf(const std::string &id, unsigned long long &hash) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<std::string, unsigned long long>::const_iterator it = byId.find(id);
+  if(it == byId.end()) return false;
+  hash = it->second;
+  return true;
+}
+
+// Record that the features of id were extracted from content with the given hash
+bool ContentIndex::append(unsigned long long hash, const std::string &id)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  byHash[hash] = id;
+  byId[id] = hash;
+  FILE* fp = fopen(path.c_str(), "a");
+  if(fp == NULL) return false;
+  fprintf(fp, "%016llx %s\n", hash, id.c_str());
+  return fclose(fp) == 0;
+}
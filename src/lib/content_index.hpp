@@ -0,0 +1,44 @@
+/*  Content addressing of ingested SV images. Each image is identified by a
+**  64-bit FNV-1a hash of its encoded bytes and the signature of the feature
+**  pipeline, so an unchanged image that is ingested again (under any
+**  viewpoint id) can reuse its stored features instead of extracting them.
+**
+**  Stored as <features-folder>/content.idx, one "<hash> <id>" line per
+**  stored image, appended as images are stored. A later line for the same id
+**  replaces an earlier one.
+*/
+#ifndef CONTENT_INDEX_HPP
+#define CONTENT_INDEX_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+using namespace cv;
+
+// Identifies the detector, its parameters and the descriptor post-processing used to
+// extract stored features; change it whenever any of them change so nothing is reused
+static const char* FEATURE_SIGNATURE = "SIFT(default)+rootSIFT/features.bin";
+
+unsigned long long contentHash(const uchar* data, size_t size, const std::string &signature);
+unsigned long long contentHash(const std::vector<uchar> &bytes, const std::string &signature);
+
+// Safe to use from several threads at once
+class ContentIndex
+{
+public:
+  bool load(const std::string &path);
+  bool find(unsigned long long hash, std::string &id) const;
+  bool hashOf(const std::string &id, unsigned long long &hash) const;
+  bool append(unsigned long long hash, const std::string &id);
+
+protected:
+  std::string path;
+  std::map<unsigned long long, std::string> byHash;
+  std::map<std::string, unsigned long long> byId;
+  mutable std::mutex mutex;
+};
+
+#endif
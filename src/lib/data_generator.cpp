@@ -4,14 +4,81 @@
 #include <stdio.h>
 #include <cstring>
 #include <fstream>
+#include <sstream>
+#include <chrono>
 #include "data_generator.hpp"
 #include "saveable_matcher.hpp"
 
 using namespace cv;
 using namespace boost::python;
 
+// Name of the packed shard holding every SV image's features, inside the features folder
+static const char* SHARD_FILENAME = "features.shard";
+
 DataGenerator::DataGenerator(){}
 
+// Read the keypoints, descriptors and object corners of an SV image, from the packed shard if
+// there is one (in which case the descriptors are a view into the shard), otherwise from the
+// image's own FileStorage file
+bool readSVFeatures(const FeatureShard *shard, const std::string &featuresFolder, const std::string &svPath,
+  std::vector<KeyPoint> &svKeypoints, Mat &svDescriptors, std::vector<Point2f> &objCorners)
+{
+  if(shard != NULL)
+  {
+    return shard->get(svPath, svKeypoints, svDescriptors, objCorners);
+  }
+  FileStorage file(featuresFolder + "/" + svPath, FileStorage::READ);
+  if(!file.isOpened()) return false;
+  file["keypoints"] >> svKeypoints;
+  file["descriptors"] >> svDescriptors;
+  file["objCorners"] >> objCorners;
+  return true;
+}
+
+// Pack the FileStorage features file of each SV image listed in filenames_filename into
+// a single shard in features_folder, which generate and bigTree then read instead
+void DataGenerator::convertToShard(const char* filenames_filename, const char* features_folder)
+{
+  std::ifstream filenameFile;
+  filenameFile.open(filenames_filename);
+  std::string featuresFolder(features_folder);
+  std::string shardPath = featuresFolder + "/" + SHARD_FILENAME;
+  std::string tmpPath = shardPath + ".tmp";
+
+  // Write to a temporary file, so a failed conversion never replaces a good shard
+  FeatureShardWriter writer;
+  if(!writer.open(tmpPath))
+  {
+    printf("Can't write shard '%s'\n", shardPath.c_str());
+    remove(tmpPath.c_str());
+    return;
+  }
+  std::string svPath;
+  int count = 0;
+  while(std::getline(filenameFile, svPath))
+  {
+    std::vector<KeyPoint> svKeypoints;
+    Mat svDescriptors;
+    std::vector<Point2f> objCorners;
+    if(!readSVFeatures(NULL, featuresFolder, svPath, svKeypoints, svDescriptors, objCorners))
+    {
+      printf("Can't read features of '%s'\n", svPath.c_str());
+      writer.close();
+      remove(tmpPath.c_str());
+      return;
+    }
+    writer.add(svPath, svKeypoints, svDescriptors, objCorners);
+    count++;
+  }
+  if(!writer.close() || rename(tmpPath.c_str(), shardPath.c_str()) != 0)
+  {
+    printf("Can't write shard '%s'\n", shardPath.c_str());
+    remove(tmpPath.c_str());
+    return;
+  }
+  printf("Packed the features of %d SV images into '%s'\n", count, shardPath.c_str());
+}
+
 void DataGenerator::generate(const char* img_filename, const char* filenames_filename, const char* features_folder, const char* out_filename)
 {
   // open the query image
@@ -39,6 +106,10 @@ void DataGenerator::generate(const char* img_filename, const char* filenames_fil
   // Convert query keypoints to RootSIFT
   rootSIFT(queryDescriptors);
 
+  // Read features from the packed shard if it has been created
+  FeatureShard shard;
+  bool packed = shard.open(featuresFolder + "/" + SHARD_FILENAME);
+
   // Open a csv file to write results to and write headings
   FILE * fp;
   fp = fopen(out_filename, "w+");
@@ -52,61 +123,112 @@ void DataGenerator::generate(const char* img_filename, const char* filenames_fil
     svPaths.push_back(imageFilePath);
   }
 
-  Ptr<FlannBasedMatcher> matcher = new FlannBasedMatcher();
-  for(int i = 0; i < svPaths.size(); i++)
-  {
-    std::string full_path = featuresFolder + "/" + svPaths.at(i);
-    std::cout << full_path << std::endl;
+  // Images are matched in parallel, and are handed out one at a time since their descriptor
+  // counts vary widely. Finished rows wait in a reorder buffer until every row before them has
+  // been written, so the csv is streamed in the same order as the filenames file.
+  int total = svPaths.size();
+  std::vector<std::string> rows(total);
+  std::vector<char> finished(total, 0);
+  int nextRow = 0;
+  int processed = 0;
+  int unreadable = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point lastReport = start;
 
-    FileStorage file(full_path, FileStorage::READ);
+  #pragma omp parallel for schedule(dynamic, 1)
+  for(int i = 0; i < total; i++)
+  {
+    std::string row;
     std::vector<KeyPoint> svKeypoints;
     Mat svDescriptors;
     std::vector<Point2f> objCorners;
-    file["keypoints"] >> svKeypoints;
-    file["descriptors"] >> svDescriptors;
-    file["objCorners"] >> objCorners;
-    std::cout << svKeypoints.size() << " " << svDescriptors.rows << "," << svDescriptors.cols << " " << objCorners.size() << std::endl;
-
-    // Knn matching + Lowe filter
-    std::vector<std::vector<DMatch> > knnmatches;
-    std::vector<DMatch> matches;
-    matches.clear();
-    matcher->knnMatch(svDescriptors, queryDescriptors, knnmatches, 2);
-    loweFilter(knnmatches, matches);
+    bool readable = readSVFeatures(packed ? &shard : NULL, featuresFolder, svPaths.at(i), svKeypoints, svDescriptors, objCorners);
+    if(readable)
+    {
+      row = matchRow(svPaths.at(i), svKeypoints, svDescriptors, objCorners, queryKeypoints, queryDescriptors);
+    }
 
-    if(matches.size() > 4) {
-      // RANSAC filter
-      Mat homography;
-      ransacFilter(matches, svKeypoints, queryKeypoints, homography);
+    #pragma omp critical(csv_rows)
+    {
+      if(!readable)
+      {
+        printf("Can't read features of '%s'\n", svPaths.at(i).c_str());
+        unreadable++;
+      }
+      rows.at(i).swap(row);
+      finished.at(i) = 1;
+      while(nextRow < total && finished.at(nextRow))
+      {
+        fputs(rows.at(nextRow).c_str(), fp);
+        std::string().swap(rows.at(nextRow));
+        nextRow++;
+      }
 
-      // if a homography was successfully computed...
-      if(homography.cols != 0 && homography.rows != 0)
+      // Report progress at most once a second rather than per image
+      processed++;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if(now - lastReport >= std::chrono::seconds(1) || processed == total)
       {
-        double area = calcProjectedAreaRatio(objCorners, homography);
-        // do not count these matches if projected area too small, (likely
-        // mapping to single point => erroneous matching)
-        if(area < 0.0005)
-        {
-          std::cout << area << " < " << "0.0005" << std::endl;
-          matches.clear();
-        }
+        double seconds = std::chrono::duration<double>(now - start).count();
+        printf("Matched %d/%d images: %.2f images/s\n", processed, total, seconds > 0 ? processed / seconds : 0);
+        lastReport = now;
       }
     }
-
-    // Parse latitude, longitude and heading from image filename
-    std::string svPath = svPaths.at(i);
-    char lat[13];
-    char lng[13];
-    char heading[3];
-    sscanf(svPath.c_str(),"%[^','],%[^','],%[^'.']", lat, lng, heading);
-    std::cout << "Image " << i << " has " << matches.size() << " matches" << std::endl;
-    fprintf(fp, "%s,%s,%s,%lu\n", lat, lng, heading, matches.size());
   }
 
+  if(unreadable > 0) printf("%d images had unreadable features\n", unreadable);
   fclose(fp);
 }
 
+// Match the query against one SV image: kNN, Lowe and RANSAC filters and the projected
+// area check. Returns the image's csv row, or an empty string for an unparseable filename.
+std::string DataGenerator::matchRow(const std::string &svPath, std::vector<KeyPoint> &svKeypoints, Mat &svDescriptors,
+  std::vector<Point2f> &objCorners, std::vector<KeyPoint> &queryKeypoints, Mat &queryDescriptors)
+{
+  // Each call builds its own index, so matchers are not shared between threads
+  Ptr<FlannBasedMatcher> matcher = new FlannBasedMatcher();
+
+  // Knn matching + Lowe filter
+  std::vector<std::vector<DMatch> > knnmatches;
+  std::vector<DMatch> matches;
+  matches.clear();
+  matcher->knnMatch(svDescriptors, queryDescriptors, knnmatches, 2);
+  loweFilter(knnmatches, matches);
 
+  if(matches.size() > 4) {
+    // RANSAC filter
+    Mat homography;
+    ransacFilter(matches, svKeypoints, queryKeypoints, homography);
+
+    // if a homography was successfully computed...
+    if(homography.cols != 0 && homography.rows != 0)
+    {
+      double area = calcProjectedAreaRatio(objCorners, homography);
+      // do not count these matches if projected area too small, (likely
+      // mapping to single point => erroneous matching)
+      if(area < 0.0005)
+      {
+        matches.clear();
+      }
+    }
+  }
+
+  // Parse latitude, longitude and heading from image filename, keeping each field as written
+  std::vector<std::string> fields = splitString(svPath.c_str(), ',');
+  if(fields.size() < 3)
+  {
+    printf("Skipping '%s': filename is not lat,lng,heading\n", svPath.c_str());
+    return std::string();
+  }
+  std::string heading = fields.at(2).substr(0, fields.at(2).find('.'));
+  std::stringstream row;
+  row << fields.at(0) << "," << fields.at(1) << "," << heading << "," << matches.size() << "\n";
+  return row.str();
+}
+
+// Build the big matcher the old way, storing it as bigmatcher-descriptors.bin and
+// bigmatcher-tree.xml.gz. The files of a bigmatcher stored by FeatureSaver::saveBigTree are
+// removed once it is stored, as the locator would otherwise prefer them over this one.
 void DataGenerator::bigTree(const char* filenames_filename, const char* features_folder)
 {
   // open the file containing the list of SV filenames
@@ -131,6 +253,11 @@ void DataGenerator::bigTree(const char* filenames_filename, const char* features
   FILE * fp;
   fp = fopen("intervals.txt", "w+");
 
+  // Read features from the packed shard if it has been created. The big matcher only
+  // references the descriptors until it is trained, so the shard is kept open until then.
+  FeatureShard shard;
+  bool packed = shard.open(featuresFolder + "/" + SHARD_FILENAME);
+
   // TODO: set the interval to separate each latlng, ie. in an interval are all the descriptors for a lat-lng point (all headings)
   // Saveable matcher to fast match against all the descriptors
   Ptr<SaveableFlannBasedMatcher> bigMatcher = new SaveableFlannBasedMatcher("bigmatcher");
@@ -142,20 +269,25 @@ void DataGenerator::bigTree(const char* filenames_filename, const char* features
     std::string full_path = featuresFolder + "/" + svPaths.at(i);
     std::cout << full_path << std::endl;
 
-    FileStorage file(full_path, FileStorage::READ);
     std::vector<KeyPoint> svKeypoints;
     Mat svDescriptors;
     std::vector<Point2f> objCorners;
-    file["keypoints"] >> svKeypoints;
-    file["descriptors"] >> svDescriptors;
-    file["objCorners"] >> objCorners;
+    if(!readSVFeatures(packed ? &shard : NULL, featuresFolder, svPaths.at(i), svKeypoints, svDescriptors, objCorners))
+    {
+      // Keep an empty segment in its place, so every later image's index still matches its
+      // line of the filenames file
+      printf("Can't read features of '%s', adding it without descriptors\n", svPaths.at(i).c_str());
+      svDescriptors = Mat();
+    }
     std::cout << svKeypoints.size() << " " << svDescriptors.rows << "," << svDescriptors.cols << " " << objCorners.size() << std::endl;
 
-    if(i == 0)
+    if(dummyDescs.empty())
     {
       // rememeber a descriptor so we can perform the necessary match with the saveable matcher
       dummyDescs = svDescriptors;
-    } else {
+    }
+    if(i != 0)
+    {
       // print intervals to file
       lastInterval += svDescriptors.rows;
       fprintf(fp, "%lu\n", lastInterval);
@@ -163,6 +295,11 @@ void DataGenerator::bigTree(const char* filenames_filename, const char* features
     bigMatcher->add(svDescriptors);
   }
   fclose(fp);
+  if(dummyDescs.empty())
+  {
+    printf("No readable features, not building the big matcher\n");
+    return;
+  }
 
   std::cout << "Training big matcher" << std::endl;
   bigMatcher->train();
@@ -171,7 +308,11 @@ void DataGenerator::bigTree(const char* filenames_filename, const char* features
   bigMatcher->match(dummyDescs, matches);
   std::cout << "Saving matcher" << std::endl;
   bigMatcher->store();
-
+  remove("bigmatcher.snapshot");
+  remove("bigmatcher-regions.txt");
+  remove("bigmatcher-owners.bin");     // would credit the wrong viewpoints
+  remove("bigmatcher-clusters.bin");   // derived from the filenames instead when missing
+  remove("bigmatcher-content.txt");    // saveBigTree must not reuse what was removed
 }
 
 // Python Wrapper
@@ -180,5 +321,6 @@ BOOST_PYTHON_MODULE(data_generator)
   class_<DataGenerator>("DataGenerator", init<>())
       .def("generate", &DataGenerator::generate)
       .def("bigTree", &DataGenerator::bigTree)
+      .def("convertToShard", &DataGenerator::convertToShard)
   ;
 }
@@ -4,6 +4,7 @@
 #include <opencv2/xfeatures2d.hpp>
 #include <opencv2/features2d.hpp>
 #include "engine.hpp"
+#include "feature_shard.hpp"
 
 #include <boost/python.hpp>
 
@@ -18,4 +19,8 @@ public:
 
   void generate(const char* img_filename, const char* filenames_filename, const char* features_folder, const char* out_filename);
   void bigTree(const char* filenames_filename, const char* features_folder);
+  void convertToShard(const char* filenames_filename, const char* features_folder);
+private:
+  std::string matchRow(const std::string &svPath, std::vector<KeyPoint> &svKeypoints, Mat &svDescriptors,
+    std::vector<Point2f> &objCorners, std::vector<KeyPoint> &queryKeypoints, Mat &queryDescriptors);
 };
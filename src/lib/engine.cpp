@@ -6,7 +6,12 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <string>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
 #include "engine.hpp"
 
 using namespace cv;
@@ -38,6 +43,23 @@ void getKeypointsAndDescriptors(Mat &image, std::vector<KeyPoint> &keypoints, Ma
 {
   detector->detectAndCompute(image, noArray(), keypoints, descriptors, false);
 }
+/* Single image, keeping at most budget keypoints (see retainKeypointBudget)
+** so that only the retained keypoints have descriptors computed.
+** A budget of 0 or less keeps every keypoint.
+**  In:   image, budget
+**  Out:  keypoints, descriptors
+*/
+void getKeypointsAndDescriptors(Mat &image, std::vector<KeyPoint> &keypoints, Mat &descriptors, Ptr<FeatureDetector> &detector, int budget)
+{
+  if(budget <= 0)
+  {
+    getKeypointsAndDescriptors(image, keypoints, descriptors, detector);
+    return;
+  }
+  detector->detect(image, keypoints);
+  retainKeypointBudget(keypoints, budget, image.size());
+  detector->compute(image, keypoints, descriptors);
+}
 /* Multiple images.
 **  In:   images
 **  Out:  keypoints, descriptors
@@ -61,6 +83,115 @@ void getKeypointsAndDescriptors(Mat &queryImage, std::vector<KeyPoint> &queryKey
   detector->compute(trainingImages, trainingKeypoints, trainingDescriptors);
 }
 
+/* Work out how many keypoints to keep for an image, given a density per
+** megapixel clamped to [minBudget, maxBudget]. A load above 1 (more runnable
+** work than cores, see serverLoad) shrinks the budget proportionally, but
+** never below minBudget.
+**    In:   imageSize, perMegapixel, minBudget, maxBudget, load
+**    Out:  keypoint budget (0 = unlimited, when perMegapixel is 0)
+*/
+int keypointBudget(Size imageSize, int perMegapixel, int minBudget, int maxBudget, double load)
+{
+  if(perMegapixel <= 0) return 0;
+  double megapixels = (double)imageSize.width * (double)imageSize.height / 1000000.0;
+  double budget = perMegapixel * megapixels;
+  if(load > 1.0) budget /= load;
+  budget = std::min(budget, (double)maxBudget);
+  budget = std::max(budget, (double)minBudget);
+  return (int)budget;
+}
+
+/* The 1-minute load average per online core, i.e. roughly how many
+** runnable threads are competing for each core (1.0 = fully busy).
+*/
+double serverLoad()
+{
+  double loadavg[1];
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if(getloadavg(loadavg, 1) != 1 || cores <= 0) return 0.0;
+  return loadavg[0] / (double)cores;
+}
+
+/* Measure how sharp an image is as the variance of its Laplacian, computed
+** on a greyscale copy downscaled so its longest side is at most maxSide
+** (which keeps the check cheap and independent of the upload resolution).
+** Blurred or featureless images have a low variance.
+*/
+double laplacianVariance(Mat &image, int maxSide)
+{
+  Mat grey;
+  if(image.channels() == 3)
+  {
+    cvtColor(image, grey, CV_BGR2GRAY);
+  } else {
+    grey = image;
+  }
+  int longest = std::max(grey.cols, grey.rows);
+  if(longest > maxSide)
+  {
+    double scale = (double)maxSide / longest;
+    resize(grey, grey, Size(), scale, scale, INTER_AREA);
+  }
+
+  Mat laplacian;
+  Laplacian(grey, laplacian, CV_64F);
+  Scalar mean, stddev;
+  meanStdDev(laplacian, mean, stddev);
+  return stddev[0] * stddev[0];
+}
+
+bool response_sorter(KeyPoint const &lhs, KeyPoint const &rhs) {
+  return lhs.response > rhs.response; // sorts in descending order
+}
+
+/* Keep at most budget keypoints, chosen by response strength but spread
+** uniformly over the image: the image is split into a gridSize x gridSize
+** grid and keypoints are taken in rounds, the strongest remaining keypoint
+** of every cell per round, so textured cells cannot starve the others.
+**    In:   keypoints, budget, imageSize, gridSize
+**    Out:  keypoints
+*/
+void retainKeypointBudget(std::vector<KeyPoint> &keypoints, int budget, Size imageSize, int gridSize)
+{
+  if(budget <= 0 || keypoints.size() <= budget) return;
+
+  // Bucket the keypoints into grid cells, strongest first within each cell
+  std::vector<std::vector<KeyPoint> > cells(gridSize * gridSize);
+  double cellWidth = std::max(1.0, (double)imageSize.width / gridSize);
+  double cellHeight = std::max(1.0, (double)imageSize.height / gridSize);
+  for(int i = 0; i < keypoints.size(); i++)
+  {
+    int cx = std::min(gridSize - 1, std::max(0, (int)(keypoints.at(i).pt.x / cellWidth)));
+    int cy = std::min(gridSize - 1, std::max(0, (int)(keypoints.at(i).pt.y / cellHeight)));
+    cells.at(cy * gridSize + cx).push_back(keypoints.at(i));
+  }
+  for(int c = 0; c < cells.size(); c++)
+  {
+    std::sort(cells.at(c).begin(), cells.at(c).end(), &response_sorter);
+  }
+
+  // Take the rank-th strongest keypoint of each cell per round; if a round would
+  // overflow the budget, keep the strongest of that round
+  std::vector<KeyPoint> kept;
+  kept.reserve(budget);
+  for(int rank = 0; kept.size() < budget; rank++)
+  {
+    std::vector<KeyPoint> round;
+    for(int c = 0; c < cells.size(); c++)
+    {
+      if(rank < cells.at(c).size()) round.push_back(cells.at(c).at(rank));
+    }
+    if(round.size() == 0) break;
+    if(kept.size() + round.size() > budget)
+    {
+      std::sort(round.begin(), round.end(), &response_sorter);
+      round.resize(budget - kept.size());
+    }
+    kept.insert(kept.end(), round.begin(), round.end());
+  }
+  keypoints = kept;
+}
+
 // Compute the RootSIFT from SIFT according to Arandjelovic and Zisserman
 // https://alufr-ros-pkg.googlecode.com/svn/trunk/rgbdslam_freiburg/rgbdslam/src/node.cpp
 void rootSIFT(cv::Mat& descriptors)
@@ -120,6 +251,7 @@ void loweFilter(std::vector<std::vector<DMatch> > &knnMatches, std::vector<DMatc
   for (int i = 0; i < knnMatches.size(); i++)
   {
     const float ratio = 0.8; // 0.8 in Lowe's paper; can be tuned
+    if (knnMatches[i].size() < 2) continue; // no second neighbour to compare with
     if (knnMatches[i][0].distance <= ratio * knnMatches[i][1].distance)
     {
       good_matches.push_back(knnMatches[i][0]);
@@ -171,55 +303,87 @@ void ransacFilter(std::vector<DMatch> &matches, std::vector<KeyPoint> &queryKeyp
 
 /* 1D vector of query keypoints, a set of training keypoint vectors,
 ** each usually corresponding to its own training image.
-** If no matches are found for a set of training keypoints, the identity
-** matrix is pushed onto the homographies list.
+** Matches are bucketed by imgIdx in a single pass and each training image
+** is then verified independently, in parallel across cores.
+** If fewer than 4 matches are found for a set of training keypoints, the
+** identity matrix is pushed onto the homographies list and that image has
+** no inliers.
 **
 **    In:   matches, queryKeypoints, trainingKeypoints
-**    Out:  matches, homographies
+**    Out:  matches, homographies, imageMatches (inliers per training image)
 */
-void ransacFilter(std::vector<DMatch> &matches, std::vector<KeyPoint> &queryKeypoints, std::vector<std::vector<KeyPoint> > &trainingKeypoints, std::vector<Mat> &homographies)
+void ransacFilter(std::vector<DMatch> &matches, std::vector<KeyPoint> &queryKeypoints, std::vector<std::vector<KeyPoint> > &trainingKeypoints,
+  std::vector<Mat> &homographies, std::vector<std::vector<DMatch> > &imageMatches)
 {
-  std::vector<Point2f> queryCoords;
-  std::vector<Point2f> trainingCoords;
-  std::vector<DMatch> good_matches;
+  int numImages = trainingKeypoints.size();
 
-  for(int j = 0; j < trainingKeypoints.size(); j++)
+  // Bucket the matches by the training image they were derived from
+  imageMatches.assign(numImages, std::vector<DMatch>());
+  for(int i = 0; i < matches.size(); i++)
   {
-    queryCoords.clear();
-    trainingCoords.clear();
-
-    for( int i = 0; i < matches.size(); i++ )
+    int imgIdx = matches.at(i).imgIdx;
+    if(imgIdx >= 0 && imgIdx < numImages)
     {
-      //Get the coords of the keypoints from the matches, making sure to
-      //only consider matches derived from keypoints in this training image
-      if(matches.at(i).imgIdx == j)
-      {
-        queryCoords.push_back( queryKeypoints.at(matches.at(i).queryIdx).pt );
-        trainingCoords.push_back( trainingKeypoints.at(j).at(matches.at(i).trainIdx).pt );
-      }
+      imageMatches.at(imgIdx).push_back(matches.at(i));
     }
+  }
 
-    Mat outputMask;
-    int inlierCounter = 0;
+  // Estimate each image's homography independently
+  homographies.assign(numImages, Mat());
+  #pragma omp parallel for schedule(dynamic)
+  for(int j = 0; j < numImages; j++)
+  {
+    std::vector<DMatch> &bucket = imageMatches.at(j);
+    if(bucket.size() < 4)
+    {
+      //cant compute homography with < 4 matches in this training image, so push identity matrix
+      homographies.at(j) = Mat::eye(3, 3, CV_64F);
+      bucket.clear();
+      continue;
+    }
 
-    if(queryCoords.size() != 0 && queryCoords.size() != 0)
+    //Get the coords of the keypoints from this image's matches
+    std::vector<Point2f> queryCoords;
+    std::vector<Point2f> trainingCoords;
+    for(int i = 0; i < bucket.size(); i++)
     {
-      homographies.push_back(findHomography(queryCoords, trainingCoords, CV_RANSAC, 3, outputMask));
-    } else {
-      //cant compute homography is there were no matches in this training image, so push identity matrix
-      homographies.push_back(Mat::eye(3, 3, CV_64F));
+      queryCoords.push_back(queryKeypoints.at(bucket.at(i).queryIdx).pt);
+      trainingCoords.push_back(trainingKeypoints.at(j).at(bucket.at(i).trainIdx).pt);
     }
 
-    //Filter matches according to RANSAC inliers
-    for (int i = 0; i < outputMask.rows; i++) {
-      if((unsigned int)outputMask.at<uchar>(i)) {
-        inlierCounter++;
-        good_matches.push_back(matches[i]);
+    Mat outputMask;
+    homographies.at(j) = findHomography(queryCoords, trainingCoords, CV_RANSAC, 3, outputMask);
+
+    //Filter this image's matches according to RANSAC inliers
+    std::vector<DMatch> good_matches;
+    for(int i = 0; i < outputMask.rows; i++)
+    {
+      if((unsigned int)outputMask.at<uchar>(i))
+      {
+        good_matches.push_back(bucket.at(i));
       }
     }
+    bucket = good_matches;
+  }
+
+  // Gather the inliers of every image, in image order
+  std::vector<DMatch> good_matches;
+  for(int j = 0; j < numImages; j++)
+  {
+    good_matches.insert(good_matches.end(), imageMatches.at(j).begin(), imageMatches.at(j).end());
   }
   matches = good_matches;
 }
+/* As above, discarding the per-image inlier sets.
+**
+**    In:   matches, queryKeypoints, trainingKeypoints
+**    Out:  matches, homographies
+*/
+void ransacFilter(std::vector<DMatch> &matches, std::vector<KeyPoint> &queryKeypoints, std::vector<std::vector<KeyPoint> > &trainingKeypoints, std::vector<Mat> &homographies)
+{
+  std::vector<std::vector<DMatch> > imageMatches;
+  ransacFilter(matches, queryKeypoints, trainingKeypoints, homographies, imageMatches);
+}
 
 /* Consider the bounding box of input image as the object.
 ** Transform this box according to the homography matrix and draw it on the
@@ -258,13 +422,57 @@ double calcProjectedAreaRatio(std::vector<Point2f> &objCorners, Mat &homography)
 }
 
 
+/* Build a FLANN index over a set of descriptors, with the parameters FlannBasedMatcher
+** uses by default, so that it can be matched against many times without rebuilding it.
+*/
+Ptr<flann::Index> buildMatchIndex(const Mat &descriptors)
+{
+  return new flann::Index(descriptors, flann::KDTreeIndexParams());
+}
+
+/* The k nearest neighbours in index (built over indexRows descriptors) of each query
+** descriptor, as FlannBasedMatcher::knnMatch gives them: trainIdx is the row in the
+** index and distance the L2 distance.
+*/
+void knnMatchIndex(const Mat &queryDescriptors, flann::Index &index, int indexRows, std::vector<std::vector<DMatch> > &knnMatches, int k)
+{
+  knnMatches.clear();
+  k = std::min(k, indexRows);
+  if(queryDescriptors.rows == 0 || k <= 0) return;
+  Mat indices(queryDescriptors.rows, k, CV_32S);
+  Mat dists(queryDescriptors.rows, k, CV_32F);
+  index.knnSearch(queryDescriptors, indices, dists, k, flann::SearchParams());
+  knnMatches.resize(queryDescriptors.rows);
+  for(int q = 0; q < queryDescriptors.rows; q++)
+  {
+    for(int j = 0; j < k; j++)
+    {
+      int row = indices.at<int>(q, j);
+      if(row < 0 || row >= indexRows) continue;
+      knnMatches[q].push_back(DMatch(q, row, 0, std::sqrt(dists.at<float>(q, j))));
+    }
+  }
+}
+
 void getFilteredMatches(Mat &image1, std::vector<KeyPoint> &keypoints1, Mat &descriptors1, std::vector<KeyPoint> &keypoints2, Mat &descriptors2, std::vector<DMatch> &matches)
+{
+  matches.clear();
+  if(descriptors2.rows < 2) return;   // too few to apply the ratio test to
+  Ptr<flann::Index> index2 = buildMatchIndex(descriptors2);
+  getFilteredMatches(image1, keypoints1, descriptors1, keypoints2, descriptors2, *index2, matches);
+}
+
+/* As above, matching against an index already built over descriptors2 (see buildMatchIndex),
+** e.g. to match many images against the same query without rebuilding its index each time.
+*/
+void getFilteredMatches(Mat &image1, std::vector<KeyPoint> &keypoints1, Mat &descriptors1, std::vector<KeyPoint> &keypoints2, Mat &descriptors2,
+  flann::Index &index2, std::vector<DMatch> &matches)
 {
   // Match query and viewpoint
-  Ptr<FlannBasedMatcher> matcher = new FlannBasedMatcher();
   std::vector<std::vector<DMatch> > knn_matches;
   matches.clear();
-  matcher->knnMatch(descriptors1, descriptors2, knn_matches, 2);
+  if(descriptors2.rows < 2) return;
+  knnMatchIndex(descriptors1, index2, descriptors2.rows, knn_matches, 2);
   loweFilter(knn_matches, matches);
 
   // Perform geometric verification
@@ -291,3 +499,16 @@ void getFilteredMatches(Mat &image1, std::vector<KeyPoint> &keypoints1, Mat &des
     }
   }
 }
+
+// Split a string by the delimiter, putting each segment as an entry in the vector
+std::vector<std::string> splitString(const char* str, char delimiter)
+{
+  std::stringstream stream(str);
+  std::string segment;
+  std::vector<std::string> seglist;
+  while(std::getline(stream, segment, delimiter))
+  {
+     seglist.push_back(segment);
+  }
+  return seglist;
+}
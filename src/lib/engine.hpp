@@ -1,3 +1,6 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -9,11 +12,17 @@ using namespace cv;
 void createDetector(Ptr<FeatureDetector> &detector, std::string type);
 
 void getKeypointsAndDescriptors(Mat &image, std::vector<KeyPoint> &keypoints, Mat &descriptors, Ptr<FeatureDetector> &detector);
+void getKeypointsAndDescriptors(Mat &image, std::vector<KeyPoint> &keypoints, Mat &descriptors, Ptr<FeatureDetector> &detector, int budget);
 void getKeypointsAndDescriptors(std::vector<Mat> &images, std::vector<std::vector<KeyPoint> > &keypoints, std::vector<Mat> &descriptors, Ptr<FeatureDetector> &detector);
 void getKeypointsAndDescriptors(Mat &queryImage, std::vector<KeyPoint> &queryKeypoints, Mat &queryDescriptors,
   std::vector<Mat> &trainingImages, std::vector<std::vector<KeyPoint> > &trainingKeypoints, std::vector<Mat> &trainingDescriptors,
   Ptr<FeatureDetector> &detector);
 
+int keypointBudget(Size imageSize, int perMegapixel, int minBudget, int maxBudget, double load);
+double serverLoad();
+double laplacianVariance(Mat &image, int maxSide = 320);
+void retainKeypointBudget(std::vector<KeyPoint> &keypoints, int budget, Size imageSize, int gridSize = 8);
+
 void rootSIFT(cv::Mat& descriptors);
 
 void simpleFilter(Mat &queryDescriptors, std::vector<DMatch> &matches);
@@ -21,8 +30,19 @@ void loweFilter(std::vector<std::vector<DMatch> > &knnMatches, std::vector<DMatc
 
 void ransacFilter(std::vector<DMatch> &matches, std::vector<KeyPoint> &queryKeypoints, std::vector<KeyPoint> &trainingKeypoints, Mat &homography);
 void ransacFilter(std::vector<DMatch> &matches, std::vector<KeyPoint> &queryKeypoints, std::vector<std::vector<KeyPoint> > &trainingKeypoints, std::vector<Mat> &homographies);
+void ransacFilter(std::vector<DMatch> &matches, std::vector<KeyPoint> &queryKeypoints, std::vector<std::vector<KeyPoint> > &trainingKeypoints,
+  std::vector<Mat> &homographies, std::vector<std::vector<DMatch> > &imageMatches);
 
 void drawProjection(Mat &input, Mat &homography, Mat &output);
 double calcProjectedAreaRatio(std::vector<Point2f> &objCorners, Mat &homography);
 
+Ptr<flann::Index> buildMatchIndex(const Mat &descriptors);
+void knnMatchIndex(const Mat &queryDescriptors, flann::Index &index, int indexRows, std::vector<std::vector<DMatch> > &knnMatches, int k);
+
 void getFilteredMatches(Mat &image1, std::vector<KeyPoint> &keypoints1, Mat &descriptors1, std::vector<KeyPoint> &keypoints2, Mat &descriptors2, std::vector<DMatch> &matches);
+void getFilteredMatches(Mat &image1, std::vector<KeyPoint> &keypoints1, Mat &descriptors1, std::vector<KeyPoint> &keypoints2, Mat &descriptors2,
+  flann::Index &index2, std::vector<DMatch> &matches);
+
+std::vector<std::string> splitString(const char* str, char delimiter);
+
+#endif
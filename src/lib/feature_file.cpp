@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <cstring>
+#include <fstream>
+#include "feature_file.hpp"
+
+// Pack keypoints into fixed size records of KEYPOINT_RECORD_SIZE bytes
+void packKeypoints(const std::vector<KeyPoint> &keypoints, std::vector<char> &records)
+{
+  records.resize(keypoints.size() * KEYPOINT_RECORD_SIZE);
+  for(int i = 0; i < keypoints.size(); i++)
+  {
+    float floats[5] = { keypoints.at(i).pt.x, keypoints.at(i).pt.y, keypoints.at(i).size, keypoints.at(i).angle, keypoints.at(i).response };
+    int ints[2] = { keypoints.at(i).octave, keypoints.at(i).class_id };
+    memcpy(&records[i * KEYPOINT_RECORD_SIZE], floats, sizeof(floats));
+    memcpy(&records[i * KEYPOINT_RECORD_SIZE + sizeof(floats)], ints, sizeof(ints));
+  }
+}
+
+// Unpack count keypoint records starting at data
+void unpackKeypoints(const char* data, int count, std::vector<KeyPoint> &keypoints)
+{
+  keypoints.resize(count);
+  for(int i = 0; i < count; i++)
+  {
+    float floats[5];
+    int ints[2];
+    memcpy(floats, data + i * KEYPOINT_RECORD_SIZE, sizeof(floats));
+    memcpy(ints, data + i * KEYPOINT_RECORD_SIZE + sizeof(floats), sizeof(ints));
+    keypoints.at(i) = KeyPoint(Point2f(floats[0], floats[1]), floats[2], floats[3], floats[4], ints[0], ints[1]);
+  }
+}
+
+std::string featureFilename(const std::string &name)
+{
+  return name + "-features.bin";
+}
+
+bool featuresExist(const std::string &name)
+{
+  FILE* file = fopen(featureFilename(name).c_str(), "r");
+  if(file == NULL) return false;
+  fclose(file);
+  return true;
+}
+
+// Write the keypoints and descriptors of an image to <name>-features.bin
+bool writeFeatures(const std::string &name, const std::vector<KeyPoint> &keypoints, const Mat &descriptors)
+{
+  std::ofstream outFILE(featureFilename(name).c_str(), std::ios::out | std::ofstream::binary);
+  if(!outFILE.is_open()) return false;
+
+  FeatureFileHeader header;
+  memcpy(header.magic, "SVF1", 4);
+  header.rows = descriptors.rows;
+  header.cols = descriptors.cols;
+  header.type = descriptors.type();
+  header.numKeypoints = keypoints.size();
+  outFILE.write(reinterpret_cast<char*>(&header), sizeof(header));
+
+  // Write the descriptors row by row, in case the matrix is not continuous
+  for(int r = 0; r < descriptors.rows; r++)
+  {
+    outFILE.write(reinterpret_cast<const char*>(descriptors.ptr(r)), descriptors.cols * descriptors.elemSize());
+  }
+
+  // Write the keypoints as fixed size records
+  std::vector<char> records;
+  packKeypoints(keypoints, records);
+  if(records.size() > 0) outFILE.write(&records[0], records.size());
+
+  outFILE.close();
+  return outFILE.good();
+}
+
+bool readFeatureHeader(std::ifstream &inFILE, FeatureFileHeader &header)
+{
+  inFILE.read(reinterpret_cast<char*>(&header), sizeof(header));
+  return inFILE.good() && memcmp(header.magic, "SVF1", 4) == 0 && header.rows >= 0 && header.cols >= 0 && header.numKeypoints >= 0;
+}
+
+bool readFeatureHeader(const std::string &name, FeatureFileHeader &header)
+{
+  std::ifstream inFILE(featureFilename(name).c_str(), std::ios::in | std::ios::binary);
+  return inFILE.is_open() && readFeatureHeader(inFILE, header);
+}
+
+bool readFeatureDescriptors(std::ifstream &inFILE, FeatureFileHeader &header, Mat &descriptors)
+{
+  descriptors.create(header.rows, header.cols, header.type);
+  inFILE.read(reinterpret_cast<char*>(descriptors.data), descriptors.total() * descriptors.elemSize());
+  return inFILE.good();
+}
+
+// Read only the descriptors of an image from <name>-features.bin
+bool readFeatureDescriptors(const std::string &name, Mat &descriptors)
+{
+  std::ifstream inFILE(featureFilename(name).c_str(), std::ios::in | std::ios::binary);
+  FeatureFileHeader header;
+  if(!inFILE.is_open() || !readFeatureHeader(inFILE, header)) return false;
+  return readFeatureDescriptors(inFILE, header, descriptors);
+}
+
+// Read the keypoints and descriptors of an image from <name>-features.bin
+bool readFeatures(const std::string &name, std::vector<KeyPoint> &keypoints, Mat &descriptors)
+{
+  std::ifstream inFILE(featureFilename(name).c_str(), std::ios::in | std::ios::binary);
+  FeatureFileHeader header;
+  if(!inFILE.is_open() || !readFeatureHeader(inFILE, header)) return false;
+  if(!readFeatureDescriptors(inFILE, header, descriptors)) return false;
+
+  std::vector<char> records(header.numKeypoints * KEYPOINT_RECORD_SIZE);
+  if(records.size() > 0) inFILE.read(&records[0], records.size());
+  if(!inFILE.good()) return false;
+
+  unpackKeypoints(records.size() > 0 ? &records[0] : NULL, header.numKeypoints, keypoints);
+  return true;
+}
@@ -0,0 +1,43 @@
+/*  Lightweight on-disk format for the features of a single image: its
+**  keypoints and descriptors, without any matcher index.
+**
+**  Stored as <name>-features.bin:
+**    header:       magic "SVF1", descriptor rows, cols and type, #keypoints (ints)
+**    descriptors:  rows * cols elements, row-major
+**    keypoints:    x, y, size, angle, response (floats), octave, class_id (ints) each
+**
+**  The header and descriptors come first so the descriptors can be read
+**  without parsing the keypoints.
+*/
+#ifndef FEATURE_FILE_HPP
+#define FEATURE_FILE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+// On-disk size of each keypoint record
+static const int KEYPOINT_RECORD_SIZE = 5 * sizeof(float) + 2 * sizeof(int);
+
+struct FeatureFileHeader {
+  char magic[4];
+  int rows;
+  int cols;
+  int type;
+  int numKeypoints;
+};
+
+void packKeypoints(const std::vector<KeyPoint> &keypoints, std::vector<char> &records);
+void unpackKeypoints(const char* data, int count, std::vector<KeyPoint> &keypoints);
+
+std::string featureFilename(const std::string &name);
+bool featuresExist(const std::string &name);
+
+bool writeFeatures(const std::string &name, const std::vector<KeyPoint> &keypoints, const Mat &descriptors);
+bool readFeatures(const std::string &name, std::vector<KeyPoint> &keypoints, Mat &descriptors);
+bool readFeatureHeader(const std::string &name, FeatureFileHeader &header);
+bool readFeatureDescriptors(const std::string &name, Mat &descriptors);
+
+#endif
@@ -0,0 +1,106 @@
+/*  Feature pipelines specialised at compile time: a detector, a post-processing
+**  step applied to its descriptors, and the descriptors' element type.
+**
+**  A pipeline is picked by name once, when its user is constructed (see
+**  createFeaturePipeline), rather than comparing the name on every image.
+**  Each combination is its own instantiation of SpecialisedPipeline, so the
+**  post-processing is inlined for its element type and a combination which
+**  doesn't make sense (e.g. rootSIFT of binary descriptors) fails to compile.
+**
+**    SIFT      SIFT, as detected                   float
+**    ROOTSIFT  SIFT, L1 normalised and square root float
+**    SURF      SURF, as detected                   float
+**    ORB       ORB, as detected                    uchar, matched by Hamming distance
+*/
+#ifndef FEATURE_PIPELINE_HPP
+#define FEATURE_PIPELINE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/xfeatures2d.hpp>
+#include <opencv2/features2d.hpp>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include "engine.hpp"
+
+using namespace cv;
+
+// Detectors
+struct SiftDetector
+{
+  static Ptr<FeatureDetector> create() { return xfeatures2d::SIFT::create(); }
+};
+
+struct SurfDetector
+{
+  static Ptr<FeatureDetector> create() { return xfeatures2d::SURF::create(); }
+};
+
+struct OrbDetector
+{
+  static Ptr<FeatureDetector> create() { return ORB::create(); }
+};
+
+// Post-processing of the descriptors of element type T
+struct NoPostProcess
+{
+  template<typename T> static void apply(Mat &descriptors) {}
+};
+
+struct RootSiftPostProcess
+{
+  template<typename T> static void apply(Mat &descriptors)
+  {
+    static_assert(std::is_same<T, float>::value, "rootSIFT needs float descriptors");
+    rootSIFT(descriptors);
+  }
+};
+
+class FeaturePipeline
+{
+public:
+  virtual ~FeaturePipeline() {}
+
+  // Keypoints and post-processed descriptors of image, keeping at most budget keypoints (0 = all)
+  virtual void extract(Mat &image, std::vector<KeyPoint> &keypoints, Mat &descriptors, int budget) = 0;
+  // CV_32F or CV_8U, as SaveableFlannBasedMatcher takes it
+  virtual int descriptorType() const = 0;
+};
+
+template<typename Detector, typename PostProcess, typename T>
+class SpecialisedPipeline : public FeaturePipeline
+{
+public:
+  SpecialisedPipeline() : detector(Detector::create()) {}
+
+  void extract(Mat &image, std::vector<KeyPoint> &keypoints, Mat &descriptors, int budget)
+  {
+    getKeypointsAndDescriptors(image, keypoints, descriptors, detector, budget);
+    PostProcess::template apply<T>(descriptors);
+  }
+
+  int descriptorType() const
+  {
+    return DataType<T>::type;
+  }
+
+protected:
+  Ptr<FeatureDetector> detector;
+};
+
+typedef SpecialisedPipeline<SiftDetector, NoPostProcess, float> SiftPipeline;
+typedef SpecialisedPipeline<SiftDetector, RootSiftPostProcess, float> RootSiftPipeline;
+typedef SpecialisedPipeline<SurfDetector, NoPostProcess, float> SurfPipeline;
+typedef SpecialisedPipeline<OrbDetector, NoPostProcess, uchar> OrbPipeline;
+
+// The pipeline named type (see above), or an empty pointer if there is none of that name
+inline Ptr<FeaturePipeline> createFeaturePipeline(const std::string &type)
+{
+  if(type == "SIFT") return makePtr<SiftPipeline>();
+  if(type == "ROOTSIFT") return makePtr<RootSiftPipeline>();
+  if(type == "SURF") return makePtr<SurfPipeline>();
+  if(type == "ORB") return makePtr<OrbPipeline>();
+  return Ptr<FeaturePipeline>();
+}
+
+#endif
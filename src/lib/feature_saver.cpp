@@ -2,105 +2,781 @@
 ** descriptors, and save them to a file */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <set>
+#include <algorithm>
 #include "feature_saver.hpp"
+#include "bounded_queue.hpp"
 
 using namespace cv;
 using namespace boost::python;
 
-// Split a string by the delimiter, putting each segment as an entry in the vector
-std::vector<std::string> splitString(const char* str, char delimiter)
+FeatureSaver::FeatureSaver()
 {
-  std::stringstream stream(str);
-  std::string segment;
-  std::vector<std::string> seglist;
-  while(std::getline(stream, segment, delimiter))
-  {
-     seglist.push_back(segment);
-  }
-  return seglist;
+  threads = std::max(1, (int)std::thread::hardware_concurrency());
+  throughput = 0;
+  hits = 0;
+  misses = 0;
+  buildImageIndexes = false;
+  removeArchived = false;
+  dedupDistance = 0;
+  regionSize = 0;
 }
 
-FeatureSaver::FeatureSaver(){}
+// An image passing through the saveFeatures pipeline
+struct IngestItem {
+  std::string filename;
+  std::string id;                           // <lat>,<lng>,<heading>,<pitch>
+  std::vector<uchar> encoded;               // the image file's bytes, kept only when archiving
+  unsigned long long hash;                  // content hash of the bytes, see content_index.hpp
+  std::string reusedFrom;                   // id already holding features of the same content
+  std::shared_ptr<std::string> matcherName; // shared so the matcher's pointer to it survives copies of the item
+  Mat image;
+  std::vector<KeyPoint> keypoints;
+  Mat descriptors;
+  Ptr<SaveableFlannBasedMatcher> matcher;
+};
 
-// Store the descriptors (using a SaveableFlannBasedMatcher) for each image in _img_folder given by _img_filenames.
+// Store the keypoints and descriptors (as <lat>,<lng>,<heading>,<pitch>-features.bin) for each image
+// in _img_folder given by _img_filenames. If buildImageIndexes is set, a SaveableFlannBasedMatcher
+// with its own index is also built and stored for each image, as it used to be. If an archive
+// has been set, each image is also appended to it so the SV images can be read from one file,
+// and if removeArchived is set its .jpg is deleted once the archive has been closed successfully.
+// Images whose content hash shows their features are already stored are not decoded or extracted
+// again: an unchanged image under the same id is skipped, and one under a new id has the stored
+// features copied. The number of such hits and of extracted misses is reported after each run.
+// The images flow through a pipeline of bounded queues, so memory use does not depend on the
+// length of the list: a pool of decoder threads reads the images, a pool of extractor threads
+// (each with its own detector) computes the features, and a single writer thread stores them.
 void FeatureSaver::saveFeatures(const char* _img_folder, const char* _img_filenames, const char* _out_folder)
 {
   // separate img_filenames with ':' delimiter
   std::vector<std::string> filename_list = splitString(_img_filenames, ':');
-  // Create SIFT detector
-  Ptr<FeatureDetector> detector;
-  createDetector(detector, "SIFT");
+  std::string img_folder(_img_folder);
+  std::string out_folder(_out_folder);
+
+  int numDecoders = std::max(1, threads / 4);
+  int numExtractors = threads;
+  BoundedQueue<IngestItem> decoded(2 * numExtractors);
+  BoundedQueue<IngestItem> extracted(2 * numExtractors);
+  std::atomic<int> nextImage(0);
+  std::atomic<int> failed(0);
+  std::atomic<int> stored(0);
+  std::atomic<int> hitCount(0);
+  std::atomic<int> missCount(0);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-  // For each image, compute descriptors and save to disk
-  for(int i = 0; i < filename_list.size(); i++)
+  ContentIndex content;
+  content.load(out_folder + "content.idx");
+
+  ImageArchive existing;
+  if(!archivePath.empty()) existing.open(archivePath);
+  ImageArchiveWriter archive;
+  if(!archivePath.empty() && !archive.open(archivePath))
   {
-    std::string img_folder(_img_folder);
-    Mat img = imread(img_folder + filename_list.at(i));
-    if(img.data == NULL) {
-      printf("Can't read image '%s'\n", filename_list.at(i).c_str());
-      return;
+    printf("Can't open image archive '%s'\n", archivePath.c_str());
+    return;
+  }
+
+  // Image files held by the archive, removed after it is closed if removeArchived is set
+  std::vector<std::string> archivedFiles;
+  std::mutex archivedMutex;
+
+  // Decode stage: read each image from disk
+  std::vector<std::thread> decoders;
+  for(int t = 0; t < numDecoders; t++)
+  {
+    decoders.push_back(std::thread([&]() {
+      for(int i = nextImage++; i < filename_list.size(); i = nextImage++)
+      {
+        IngestItem item;
+        item.filename = filename_list.at(i);
+        size_t lastindex = item.filename.find_last_of(".");
+        item.id = item.filename.substr(0, lastindex); // remove extension
+        if(!readFileBytes(img_folder + item.filename, item.encoded))
+        {
+          printf("Can't read image '%s'\n", item.filename.c_str());
+          failed++;
+          continue;
+        }
+
+        // Skip the extraction of content whose features are already stored
+        item.hash = contentHash(item.encoded, FEATURE_SIGNATURE);
+        std::string knownId;
+        if(content.find(item.hash, knownId) && featuresExist(out_folder + knownId))
+        {
+          hitCount++;
+          if(knownId == item.id)
+          {
+            if(existing.contains(item.id))
+            {
+              std::lock_guard<std::mutex> lock(archivedMutex);
+              archivedFiles.push_back(img_folder + item.filename);
+            }
+            continue;
+          }
+          item.reusedFrom = knownId;
+          if(archivePath.empty()) std::vector<uchar>().swap(item.encoded);
+          extracted.push(item);
+          continue;
+        }
+        missCount++;
+
+        item.image = imdecode(item.encoded, IMREAD_COLOR);
+        if(item.image.data == NULL) {
+          printf("Can't read image '%s'\n", item.filename.c_str());
+          failed++;
+          continue;
+        }
+        if(archivePath.empty()) std::vector<uchar>().swap(item.encoded);
+        decoded.push(item);
+      }
+    }));
+  }
+
+  // Extract stage: compute rootSIFT keypoints and descriptors and build the matcher tree
+  std::vector<std::thread> extractors;
+  for(int t = 0; t < numExtractors; t++)
+  {
+    extractors.push_back(std::thread([&]() {
+      // Create SIFT detector for this thread
+      Ptr<FeatureDetector> detector;
+      createDetector(detector, "SIFT");
+
+      IngestItem item;
+      while(decoded.pop(item))
+      {
+        // Get keypoints and descriptors, converting to rootSIFT
+        getKeypointsAndDescriptors(item.image, item.keypoints, item.descriptors, detector);
+        rootSIFT(item.descriptors);
+        item.image.release();
+
+        // Features are saved with name of format <lat>,<lng>,<heading>,<pitch>
+        item.matcherName = std::make_shared<std::string>(out_folder + item.id);
+
+        if(buildImageIndexes)
+        {
+          // Create saveable matcher and build its tree
+          item.matcher = new SaveableFlannBasedMatcher(item.matcherName->c_str());
+          item.matcher->add(item.descriptors);
+          item.matcher->train();
+          std::vector<DMatch> dummy_matches;
+          item.matcher->match(item.descriptors, dummy_matches); // dummy match to itself (required for OpenCV to build tree)
+        }
+        extracted.push(item);
+      }
+    }));
+  }
+
+  // Write stage: save each image's features (and matcher) to disk. The item owns
+  // the matcher's name, so it must outlive the call to store(). Reused features
+  // are copied from the id already holding them.
+  std::thread writer([&]() {
+    IngestItem item;
+    while(extracted.pop(item))
+    {
+      if(!item.reusedFrom.empty())
+      {
+        if(!readFeatures(out_folder + item.reusedFrom, item.keypoints, item.descriptors))
+        {
+          printf("Can't read features '%s'\n", featureFilename(out_folder + item.reusedFrom).c_str());
+          failed++;
+          continue;
+        }
+        item.matcherName = std::make_shared<std::string>(out_folder + item.id);
+      }
+      if(!writeFeatures(*item.matcherName, item.keypoints, item.descriptors))
+      {
+        printf("Can't write features '%s'\n", featureFilename(*item.matcherName).c_str());
+        failed++;
+        continue;
+      }
+      if(!item.matcher.empty()) item.matcher->store();
+      content.append(item.hash, item.id);
+      if(!archivePath.empty())
+      {
+        if(archive.add(item.id, item.encoded))
+        {
+          std::lock_guard<std::mutex> lock(archivedMutex);
+          archivedFiles.push_back(img_folder + item.filename);
+        }
+        else
+        {
+          printf("Can't archive image '%s'\n", item.filename.c_str());
+        }
+      }
+      stored++;
+    }
+  });
+
+  // Close each queue once every thread feeding it has finished
+  for(int t = 0; t < decoders.size(); t++) decoders.at(t).join();
+  decoded.close();
+  for(int t = 0; t < extractors.size(); t++) extractors.at(t).join();
+  extracted.close();
+  writer.join();
+  if(!archivePath.empty() && !archive.close())
+  {
+    printf("Can't close image archive '%s', keeping the image files\n", archivePath.c_str());
+  }
+  else if(removeArchived)
+  {
+    for(int i = 0; i < archivedFiles.size(); i++) std::remove(archivedFiles.at(i).c_str());
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  throughput = seconds > 0 ? stored / seconds : 0;
+  printf("Saved features of %d images (%d failed) in %.1fs: %.2f images/s\n", (int)stored, (int)failed, seconds, throughput);
+  hits = hitCount;
+  misses = missCount;
+  printf("Content hits: %d (extraction skipped), misses: %d (extracted)\n", hits, misses);
+}
+
+// Images per second stored by the last call to saveFeatures
+double FeatureSaver::getThroughput()
+{
+  return throughput;
+}
+
+// Distance (between rootSIFT descriptors) under which saveBigTree merges descriptors from different
+// views of the same location; 0 disables merging
+void FeatureSaver::setDedupDistance(float distance)
+{
+  dedupDistance = std::max(0.0f, distance);
+}
+
+// Size in degrees of the lat-lng grid cells saveBigTree splits the bigmatcher into, stored as
+// regional indexes the locator loads on demand (see RegionalIndex); 0 stores a single index
+void FeatureSaver::setRegionSize(double degrees)
+{
+  regionSize = std::max(0.0, degrees);
+}
+
+// Images of the last call to saveFeatures whose features were already stored
+int FeatureSaver::getHits()
+{
+  return hits;
+}
+
+// Images of the last call to saveFeatures whose features had to be extracted
+int FeatureSaver::getMisses()
+{
+  return misses;
+}
+
+// Number of threads used to extract features (decoders use a quarter as many)
+void FeatureSaver::setThreads(int _threads)
+{
+  threads = std::max(1, _threads);
+}
+
+// Whether saveFeatures also builds and stores a FLANN index per image (off by default;
+// the locate path only needs the descriptors)
+void FeatureSaver::setBuildImageIndexes(bool build)
+{
+  buildImageIndexes = build;
+}
+
+// Append each image saved by saveFeatures to the archive at path as well ("" to stop archiving)
+void FeatureSaver::setArchive(const char* path)
+{
+  archivePath = path;
+}
+
+// Delete each image file saveFeatures has appended to the archive, leaving the archive as the only copy
+void FeatureSaver::setRemoveArchived(bool remove)
+{
+  removeArchived = remove;
+}
+
+// Migrate the SV images listed in filenames_filename (one <lat>,<lng>,<heading>,<pitch> per line)
+// from individual .jpg files in img_folder into the archive at archive_path. Images already in
+// the archive are skipped, so an interrupted migration can simply be run again.
+void FeatureSaver::archiveImages(const char* _img_folder, const char* filenames_filename, const char* archive_path)
+{
+  std::string img_folder(_img_folder);
+  std::string archivePath(archive_path);
+  ImageArchive existing;
+  existing.open(archivePath);
+
+  ImageArchiveWriter archive;
+  if(!archive.open(archivePath))
+  {
+    printf("Can't open image archive '%s'\n", archivePath.c_str());
+    return;
+  }
+
+  std::ifstream filenameFile(filenames_filename);
+  std::string id;
+  int added = 0;
+  int skipped = 0;
+  int failed = 0;
+  while(std::getline(filenameFile, id))
+  {
+    if(id.empty()) continue;
+    if(existing.contains(id))
+    {
+      skipped++;
+      continue;
+    }
+    if(!archive.addFile(id, img_folder + id + ".jpg"))
+    {
+      printf("Can't archive image '%s'\n", (img_folder + id + ".jpg").c_str());
+      failed++;
+      continue;
     }
+    added++;
+  }
+  archive.close();
+  printf("Archived %d images into '%s' (%d already archived, %d failed)\n", added, archivePath.c_str(), skipped, failed);
+}
 
-    // Get keypoints and descriptors, converting to rootSIFT
-    std::vector<KeyPoint> keypoints;
-    Mat descriptors;
-    getKeypointsAndDescriptors(img, keypoints, descriptors, detector);
-    rootSIFT(descriptors);
+// Hash of the ordered list of viewpoints and the content hash of each, identifying what a
+// bigmatcher was built from. Returns 0 (never up to date) if any viewpoint's content is unknown.
+unsigned long long bigTreeContentKey(const std::vector<std::string> &ids, const std::string &contentIndexPath, const std::string &settings)
+{
+  ContentIndex content;
+  if(!content.load(contentIndexPath)) return 0;
+  std::string key = settings + "\n";
+  for(int i = 0; i < ids.size(); i++)
+  {
+    unsigned long long hash;
+    if(!content.hashOf(ids.at(i), hash)) return 0;
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", hash);
+    key += ids.at(i) + " " + hex + "\n";
+  }
+  return contentHash(reinterpret_cast<const uchar*>(key.c_str()), key.size(), FEATURE_SIGNATURE);
+}
 
-    // Create saveable matcher with name of format <lat>,<lng>,<heading>,<pitch>
-    std::ostringstream matcher_name;
-    std::string out_folder(_out_folder);
-    size_t lastindex = filename_list.at(i).find_last_of(".");
-    std::string rawname = filename_list.at(i).substr(0, lastindex); // remove extension
-    matcher_name << out_folder << rawname;
-    char* matcher_name_c = new char[matcher_name.str().size() + 1];
-    strcpy(matcher_name_c, matcher_name.str().c_str()); // make copy as result of c_str() is valid only for string lifetime
-    Ptr<SaveableFlannBasedMatcher> matcher = new SaveableFlannBasedMatcher(matcher_name_c);
+// Merge near-duplicate descriptors between the views of each location (the viewpoints sharing a
+// lat,lng, i.e. every heading and pitch fetched there). Descriptors of different views within
+// maxDistance of one another are grouped; the first of each group stays in its own view's segment
+// and the views of the others are recorded in table as its extra owners. Locations are processed
+// in parallel, each with its own small index. buffer and offsets are replaced by the compacted
+// descriptors. Returns the number of descriptors merged away.
+long dedupDescriptors(const std::vector<std::string> &ids, Mat &buffer, std::vector<long> &offsets, float maxDistance, ViewpointOwners &table)
+{
+  // Group the viewpoints by location
+  ViewpointClusters locations;
+  locations.build(ids);
+  std::vector<std::vector<int> > clusters(locations.numClusters());
+  for(int i = 0; i < ids.size(); i++)
+  {
+    clusters.at(locations.clusterOf(i)).push_back(i);
+  }
+
+  std::vector<char> keep(buffer.rows, 1);
+  std::vector<std::vector<int> > extra(buffer.rows);
+  float maxDistanceSq = maxDistance * maxDistance; // FLANN's L2 distances are squared
+  #pragma omp parallel for schedule(dynamic)
+  for(int c = 0; c < clusters.size(); c++)
+  {
+    const std::vector<int> &views = clusters.at(c);
+    if(views.size() < 2) continue;
+
+    // Gather the location's descriptors, remembering the view of each
+    std::vector<long> rows;
+    std::vector<int> rowView;
+    for(int v = 0; v < views.size(); v++)
+    {
+      for(long r = offsets.at(views.at(v)); r < offsets.at(views.at(v) + 1); r++)
+      {
+        rows.push_back(r);
+        rowView.push_back(views.at(v));
+      }
+    }
+    if(rows.size() < 2) continue;
+    Mat descs(rows.size(), buffer.cols, buffer.type());
+    for(int r = 0; r < rows.size(); r++)
+    {
+      memcpy(descs.ptr(r), buffer.ptr(rows.at(r)), buffer.cols * buffer.elemSize());
+    }
+
+    int k = std::min(8, (int)rows.size());
+    flann::Index index(descs, flann::KDTreeIndexParams());
+    Mat indices, dists;
+    index.knnSearch(descs, indices, dists, k, flann::SearchParams());
 
-    // Build matcher tree
-    matcher->add(descriptors);
-    matcher->train();
-    std::vector<DMatch> dummy_matches;
-    matcher->match(descriptors, dummy_matches); // dummy match to itself (required for OpenCV to build tree)
-    // Save the matcher to disk
-    matcher->store();
+    // Greedily group each remaining descriptor with its unmerged neighbours from other views;
+    // descriptors before it are already either merged or leading a group of their own
+    std::vector<char> merged(rows.size(), 0);
+    for(int r = 0; r < rows.size(); r++)
+    {
+      if(merged.at(r)) continue;
+      std::vector<int> &owners = extra.at(rows.at(r));
+      for(int n = 0; n < k; n++)
+      {
+        int q = indices.at<int>(r, n);
+        if(q <= r || merged.at(q) || dists.at<float>(r, n) > maxDistanceSq) continue;
+        // keypoints of the same view are distinct features, and a view owns a descriptor once
+        int view = rowView.at(q);
+        if(view == rowView.at(r) || std::find(owners.begin(), owners.end(), view) != owners.end()) continue;
+        merged.at(q) = 1;
+        keep.at(rows.at(q)) = 0;
+        owners.push_back(view);
+      }
+    }
+  }
+
+  // Compact the kept descriptors, building the owners table in the same row order
+  std::vector<long> compactedOffsets(offsets.size(), 0);
+  for(int v = 0; v + 1 < offsets.size(); v++)
+  {
+    compactedOffsets.at(v + 1) = compactedOffsets.at(v) + std::count(keep.begin() + offsets.at(v), keep.begin() + offsets.at(v + 1), 1);
   }
+  Mat compacted(compactedOffsets.back(), buffer.cols, buffer.type());
+  table.clear();
+  table.offsets.push_back(0);
+  long row = 0;
+  for(int v = 0; v + 1 < offsets.size(); v++)
+  {
+    table.starts.push_back(compactedOffsets.at(v));
+    for(long r = offsets.at(v); r < offsets.at(v + 1); r++)
+    {
+      if(!keep.at(r)) continue;
+      memcpy(compacted.ptr(row++), buffer.ptr(r), buffer.cols * buffer.elemSize());
+      table.owners.insert(table.owners.end(), extra.at(r).begin(), extra.at(r).end());
+      table.offsets.push_back(table.owners.size());
+    }
+  }
+  table.starts.push_back(compactedOffsets.back());
+
+  long removed = buffer.rows - compacted.rows;
+  buffer = compacted;
+  offsets = compactedOffsets;
+  return removed;
 }
 
-// Read descriptors from stored SaveableFlannBasedMatchers (names given by filenames_file) and
-// build a big tree from this (one big SaveableFlannBasedMatcher), saving to disk as "bigmatcher"
-void FeatureSaver::saveBigTree(const char* filenames_filename, const char* folder) {
-  // Create big matcher
-  Ptr<SaveableFlannBasedMatcher> bigMatcher = new SaveableFlannBasedMatcher("bigmatcher");
+// A memory field of this process's /proc/self/status in kB, e.g. "VmHWM:" (0 if unknown)
+long statusKB(const char* field)
+{
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  size_t length = strlen(field);
+  while(std::getline(status, line))
+  {
+    if(line.compare(0, length, field) == 0) return atol(line.c_str() + length);
+  }
+  return 0;
+}
+
+// Reset the peak resident set size (VmHWM) to the current one, so that a build inside a long
+// running process measures its own peak rather than the process's. False if the kernel refused.
+bool resetPeakResident()
+{
+  std::ofstream clearRefs("/proc/self/clear_refs");
+  clearRefs << "5";
+  clearRefs.close();
+  return clearRefs.good();
+}
+
+// Skip the "SVD1" header of a stored matcher's descriptors file, if it has one (see
+// saveable_matcher.hpp). False unless the descriptors are float.
+static bool skipDescriptorsHeader(std::ifstream &inFILE)
+{
+  char magic[4];
+  int type = CV_32F;
+  inFILE.read(magic, 4);
+  if(inFILE.good() && memcmp(magic, "SVD1", 4) == 0)
+  {
+    inFILE.read(reinterpret_cast<char*>(&type), sizeof(int));
+  }
+  else
+  {
+    inFILE.clear();
+    inFILE.seekg(0);
+  }
+  return inFILE.good() && type == CV_32F;
+}
+
+// Descriptor rows and columns stored for a viewpoint, read from the header of its features file,
+// or for images saved before features files existed, from its stored matcher's descriptors file
+bool readDescriptorShape(const std::string &name, int &rows, int &cols)
+{
+  FeatureFileHeader header;
+  if(readFeatureHeader(name, header))
+  {
+    rows = header.rows;
+    cols = header.cols;
+    return header.type == CV_32F || header.rows == 0;
+  }
 
-  // Read each small matcher name from the filenames_file
+  std::ifstream inFILE((name + "-descriptors.bin").c_str(), std::ios::in | std::ios::binary);
+  rows = 0;
+  cols = 0;
+  if(!skipDescriptorsHeader(inFILE)) return false;
+  int size, width, height;
+  inFILE.read(reinterpret_cast<char*>(&size), sizeof(int));
+  for(int i = 0; i < size && inFILE.good(); i++)
+  {
+    inFILE.read(reinterpret_cast<char*>(&width), sizeof(int));
+    inFILE.read(reinterpret_cast<char*>(&height), sizeof(int));
+    inFILE.seekg((long)width * height * sizeof(float), std::ios::cur);
+    rows += height;
+    cols = width;
+  }
+  return inFILE.good();
+}
+
+// Read a viewpoint's descriptors straight into dest, which is preallocated with the right shape
+bool readDescriptorsInto(const std::string &name, Mat &dest)
+{
+  if(featuresExist(name))
+  {
+    std::ifstream inFILE(featureFilename(name).c_str(), std::ios::in | std::ios::binary);
+    FeatureFileHeader header;
+    inFILE.read(reinterpret_cast<char*>(&header), sizeof(header));
+    inFILE.read(reinterpret_cast<char*>(dest.data), dest.total() * dest.elemSize());
+    return inFILE.good();
+  }
+
+  std::ifstream inFILE((name + "-descriptors.bin").c_str(), std::ios::in | std::ios::binary);
+  if(!skipDescriptorsHeader(inFILE)) return false;
+  int size, width, height;
+  inFILE.read(reinterpret_cast<char*>(&size), sizeof(int));
+  int row = 0;
+  for(int i = 0; i < size && inFILE.good(); i++)
+  {
+    inFILE.read(reinterpret_cast<char*>(&width), sizeof(int));
+    inFILE.read(reinterpret_cast<char*>(&height), sizeof(int));
+    inFILE.read(reinterpret_cast<char*>(dest.ptr<float>(row)), (long)width * height * sizeof(float));
+    row += height;
+  }
+  return inFILE.good();
+}
+
+// Read descriptors stored by saveFeatures (names given by filenames_file) and build a big tree
+// from this, saving to disk as "bigmatcher.snapshot" (see mapped_index.hpp).
+// Every viewpoint's descriptor shape is read first, so that all descriptors can be streamed in
+// parallel into one preallocated contiguous buffer, which the index is then built over directly.
+// This avoids holding a matcher per viewpoint plus the merged copy FlannBasedMatcher::train makes.
+// If the stored bigmatcher was built from the same viewpoints with the same contents, it is kept.
+// Regional indexes are also reused one region at a time: a region whose viewpoints and contents
+// are unchanged (per its bigmatcher-region-*-content.txt) keeps its snapshot, and its viewpoints'
+// descriptors are not read. A single index, or dedup's owners numbered across the whole
+// bigmatcher, can't be rebuilt in part, so those are rebuilt from every viewpoint.
+// If a dedup distance has been set, near-duplicate descriptors across the views of each location
+// are merged first (see dedupDescriptors), with their extra viewpoints in bigmatcher-owners.bin.
+// The location cluster of each viewpoint is stored alongside in bigmatcher-clusters.bin.
+void FeatureSaver::saveBigTree(const char* filenames_filename, const char* folder) {
+  // Read each viewpoint name from the filenames_file
   std::ifstream filenames_file;
   filenames_file.open(filenames_filename);
+  if(!filenames_file.is_open())
+  {
+    return;
+  }
   std::string line;
-  if(filenames_file.is_open())
+  std::vector<std::string> names;
+  std::vector<std::string> ids;
+  while(std::getline(filenames_file, line))
+  {
+    names.push_back(std::string(folder) + line);
+    ids.push_back(line);
+  }
+  if(names.size() == 0)
+  {
+    return;
+  }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  // Reuse the stored bigmatcher if it was built from exactly the same contents and settings
+  char settings[64];
+  snprintf(settings, sizeof(settings), "dedup %.4f regions %.4f", dedupDistance, regionSize);
+  unsigned long long contentKey = bigTreeContentKey(ids, std::string(folder) + "content.idx", settings);
+  std::ifstream keyFile("bigmatcher-content.txt");
+  unsigned long long storedKey = 0;
+  std::ifstream storedSnapshot("bigmatcher.snapshot");
+  std::ifstream storedRegions("bigmatcher-regions.txt");
+  bool stored = regionSize > 0 ? storedRegions.is_open() : storedSnapshot.is_open();
+  if(contentKey != 0 && keyFile >> std::hex >> storedKey && storedKey == contentKey && stored)
+  {
+    printf("Bigmatcher is up to date with the %d images, reusing it\n", (int)names.size());
+    return;
+  }
+  bool peakReset = resetPeakResident();
+  long startKB = statusKB("VmRSS:");
+
+  // Find the regions whose stored index is up to date, and the content key of each other one
+  std::vector<char> reused(names.size(), 0);
+  std::set<std::pair<int, int> > reusedCells;
+  std::map<std::pair<int, int>, unsigned long long> rebuiltKeys;
+  if(regionSize > 0 && dedupDistance == 0)
+  {
+    std::map<std::pair<int, int>, std::vector<std::string> > cellIds;
+    for(int i = 0; i < ids.size(); i++)
+    {
+      cellIds[RegionalIndex::cellOf(ids.at(i), regionSize)].push_back(ids.at(i));
+    }
+    for(std::map<std::pair<int, int>, std::vector<std::string> >::iterator it = cellIds.begin(); it != cellIds.end(); ++it)
+    {
+      unsigned long long regionKey = bigTreeContentKey(it->second, std::string(folder) + "content.idx", settings);
+      std::string prefix = RegionalIndex::regionPrefix("", it->first.first, it->first.second);
+      std::ifstream regionKeyFile((prefix + "-content.txt").c_str());
+      std::ifstream regionSnapshot((prefix + ".snapshot").c_str());
+      unsigned long long storedRegionKey = 0;
+      if(regionKey != 0 && regionKeyFile >> std::hex >> storedRegionKey && storedRegionKey == regionKey && regionSnapshot.is_open())
+      {
+        reusedCells.insert(it->first);
+      }
+      else
+      {
+        rebuiltKeys[it->first] = regionKey;
+        remove((prefix + "-content.txt").c_str()); // until the region has been stored again
+      }
+    }
+    for(int i = 0; i < ids.size(); i++)
+    {
+      reused.at(i) = reusedCells.count(RegionalIndex::cellOf(ids.at(i), regionSize)) > 0;
+    }
+    printf("Reusing %d of %d regions whose viewpoints are unchanged\n", (int)reusedCells.size(), (int)cellIds.size());
+  }
+
+  // Work out where each viewpoint's descriptors go in the buffer; those of reused regions take none
+  std::vector<int> rows(names.size(), 0);
+  std::vector<int> cols(names.size(), 0);
+  bool failed = false;
+  #pragma omp parallel for schedule(dynamic) reduction(||:failed)
+  for(int i = 0; i < names.size(); i++)
+  {
+    if(!readDescriptorShape(names.at(i), rows.at(i), cols.at(i)))
+    {
+      printf("Can't read descriptors of '%s'\n", names.at(i).c_str());
+      failed = true;
+    }
+  }
+  if(failed)
+  {
+    return;
+  }
+  std::vector<long> offsets(names.size() + 1, 0);
+  int descriptorSize = 0;
+  for(int i = 0; i < names.size(); i++)
+  {
+    offsets.at(i + 1) = offsets.at(i) + (reused.at(i) ? 0 : rows.at(i));
+    if(rows.at(i) == 0 || reused.at(i)) continue;
+    if(descriptorSize != 0 && cols.at(i) != descriptorSize)
+    {
+      printf("Descriptors of '%s' have %d columns, expected %d\n", names.at(i).c_str(), cols.at(i), descriptorSize);
+      return;
+    }
+    descriptorSize = cols.at(i);
+  }
+  if(offsets.back() == 0 && reusedCells.empty())
+  {
+    printf("No descriptors to build bigmatcher from\n");
+    return;
+  }
+
+  // Stream the descriptors into one contiguous buffer, each viewpoint being a view into it
+  Mat buffer(offsets.back(), descriptorSize, CV_32F);
+  std::vector<Mat> segments(names.size());
+  #pragma omp parallel for schedule(dynamic) reduction(||:failed)
+  for(int i = 0; i < names.size(); i++)
+  {
+    segments.at(i) = buffer.rowRange(offsets.at(i), offsets.at(i + 1));
+    if(segments.at(i).rows > 0 && !readDescriptorsInto(names.at(i), segments.at(i)))
+    {
+      printf("Can't read descriptors of '%s'\n", names.at(i).c_str());
+      failed = true;
+    }
+  }
+  if(failed)
+  {
+    return;
+  }
+  double rawMB = buffer.total() * buffer.elemSize() / (1024.0 * 1024.0);
+  double readSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("Read %ld descriptors of %d images (%.1fMB) in %.1fs\n", offsets.back(), (int)names.size(), rawMB, readSeconds);
+
+  // Merge the descriptors repeated across overlapping views of the same location
+  ViewpointOwners owners;
+  if(dedupDistance > 0)
   {
-    while(std::getline(filenames_file, line))
+    long total = offsets.back();
+    long removed = dedupDescriptors(ids, buffer, offsets, dedupDistance, owners);
+    for(int i = 0; i < names.size(); i++)
     {
-      // Load the small matcher and add its descriptors to the big matcher
-      std::stringstream matcher_name;
-      matcher_name << folder << line;
-      char* matcher_name_c = new char[matcher_name.str().size() + 1];
-      strcpy(matcher_name_c, matcher_name.str().c_str()); // make copy as result of c_str() is valid only for string lifetime
-      Ptr<SaveableFlannBasedMatcher> smallMatcher = new SaveableFlannBasedMatcher(matcher_name_c);
-      smallMatcher->load();
-      std::vector<Mat> descriptors = smallMatcher->getTrainDescriptors();
-      bigMatcher->add(descriptors);
+      segments.at(i) = buffer.rowRange(offsets.at(i), offsets.at(i + 1));
     }
+    printf("Merged %ld of %ld descriptors (%.1f%%) into near-duplicates from other views\n", removed, total, 100.0 * removed / total);
+  }
+  for(int i = 0; i < names.size(); i++)
+  {
+    if(!reused.at(i)) rows.at(i) = offsets.at(i + 1) - offsets.at(i);
+  }
+
+  // Build the index over the buffer with the same parameters FlannBasedMatcher uses by default
+  if(regionSize > 0)
+  {
+    // Index each region separately; the locator prefers the regions when the manifest exists
+    printf("Training regions!\n");
+    if(!RegionalIndex::store("bigmatcher-regions.txt", regionSize, ids, buffer, offsets, rows, reusedCells))
+    {
+      printf("Can't store regional bigmatcher\n");
+      return;
+    }
+    for(std::map<std::pair<int, int>, unsigned long long>::iterator it = rebuiltKeys.begin(); it != rebuiltKeys.end(); ++it)
+    {
+      std::string prefix = RegionalIndex::regionPrefix("", it->first.first, it->first.second);
+      FILE* regionFp = it->second != 0 ? fopen((prefix + "-content.txt").c_str(), "w") : NULL;
+      if(regionFp != NULL)
+      {
+        fprintf(regionFp, "%016llx\n", it->second);
+        fclose(regionFp);
+      }
+    }
+  }
+  else
+  {
     printf("Training!\n");
-    // Build and save the big matcher to disk
-    bigMatcher->train();
-    std::vector<DMatch> dummy_matches;
-    printf("Matching!\n");
-    bigMatcher->match(bigMatcher->getTrainDescriptors().at(0), dummy_matches); // dummy match required for OpenCV to build tree
+    flann::Index index(buffer, flann::KDTreeIndexParams());
+
+    // Store the index with the buffer as it is in one snapshot, so the locator can map it rather
+    // than read a copy, and remove the files of a matcher stored the old ways
     printf("Storing!\n");
-    bigMatcher->store();
+    if(!MappedIndex::store("bigmatcher.snapshot", buffer, offsets, index))
+    {
+      printf("Can't store bigmatcher snapshot\n");
+      return;
+    }
+    remove("bigmatcher-descriptors.bin");
+    remove("bigmatcher-tree.xml.gz");
+    remove("bigmatcher-descriptors.mapped");
+    remove("bigmatcher.flannindex");
+    remove("bigmatcher-regions.txt");   // would be preferred over this index
+  }
+  if(!owners.empty())
+  {
+    owners.store("bigmatcher-owners.bin");
   }
+  else
+  {
+    remove("bigmatcher-owners.bin"); // a stale table would credit the wrong viewpoints
+  }
+  ViewpointClusters clusters;
+  clusters.build(ids);
+  clusters.store("bigmatcher-clusters.bin");
+  FILE* fp = fopen("bigmatcher-content.txt", "w");
+  if(fp != NULL)
+  {
+    fprintf(fp, "%016llx\n", contentKey);
+    fclose(fp);
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  // Without the reset, VmHWM may be an earlier peak of the process, so report the growth instead
+  double peakMB = (peakReset ? statusKB("VmHWM:") : statusKB("VmRSS:") - startKB) / 1024.0;
+  printf("Built bigmatcher in %.1fs, %s %.1fMB (%.2fx the raw descriptors)\n", seconds,
+    peakReset ? "peak memory" : "memory growth", peakMB, rawMB > 0 ? peakMB / rawMB : 0);
 }
 
 // Python Wrapper
@@ -109,5 +785,15 @@ BOOST_PYTHON_MODULE(feature_saver)
   class_<FeatureSaver>("FeatureSaver", init<>())
       .def("saveFeatures", &FeatureSaver::saveFeatures)
       .def("saveBigTree", &FeatureSaver::saveBigTree)
+      .def("getThroughput", &FeatureSaver::getThroughput)
+      .def("getHits", &FeatureSaver::getHits)
+      .def("getMisses", &FeatureSaver::getMisses)
+      .def("setThreads", &FeatureSaver::setThreads)
+      .def("setBuildImageIndexes", &FeatureSaver::setBuildImageIndexes)
+      .def("setArchive", &FeatureSaver::setArchive)
+      .def("setRemoveArchived", &FeatureSaver::setRemoveArchived)
+      .def("setDedupDistance", &FeatureSaver::setDedupDistance)
+      .def("setRegionSize", &FeatureSaver::setRegionSize)
+      .def("archiveImages", &FeatureSaver::archiveImages)
   ;
 }
@@ -7,6 +7,13 @@
 #include <fstream>
 #include "saveable_matcher.hpp"
 #include "engine.hpp"
+#include "feature_file.hpp"
+#include "image_archive.hpp"
+#include "content_index.hpp"
+#include "viewpoint_owners.hpp"
+#include "viewpoint_clusters.hpp"
+#include "mapped_index.hpp"
+#include "regional_index.hpp"
 
 #include <boost/python.hpp>
 
@@ -22,4 +29,25 @@ public:
   void saveFeatures(const char* _img_folder, const char* _img_filenames, const char* _out_folder);
   void saveBigTree(const char* filenames_filename, const char* folder);
 
+  double getThroughput();
+  int getHits();
+  int getMisses();
+  void setThreads(int _threads);
+  void setBuildImageIndexes(bool build);
+  void setArchive(const char* path);
+  void setRemoveArchived(bool remove);
+  void setDedupDistance(float distance);
+  void setRegionSize(double degrees);
+  void archiveImages(const char* _img_folder, const char* filenames_filename, const char* archive_path);
+
+protected:
+  int threads;              // extractor threads used by saveFeatures
+  double throughput;        // images per second stored by the last saveFeatures
+  int hits;                 // images of the last saveFeatures whose features were reused
+  int misses;               // images of the last saveFeatures whose features were extracted
+  bool buildImageIndexes;   // also store a SaveableFlannBasedMatcher per image
+  std::string archivePath;  // image archive saveFeatures appends to, if not empty
+  bool removeArchived;      // delete each image file once it is safely in the archive
+  float dedupDistance;      // saveBigTree merges cross-view descriptors closer than this, if > 0
+  double regionSize;        // saveBigTree stores regional indexes of this many degrees, if > 0
 };
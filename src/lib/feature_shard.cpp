@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <cstring>
+#include "feature_shard.hpp"
+
+FeatureShardWriter::FeatureShardWriter(){}
+
+// Start a new shard at path, overwriting any existing file
+bool FeatureShardWriter::open(const std::string &path)
+{
+  entries.clear();
+  names.clear();
+  out.open(path.c_str(), std::ios::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!out.is_open()) return false;
+
+  // Placeholder header, rewritten by close() once the index offset is known
+  ShardHeader header;
+  memset(&header, 0, sizeof(header));
+  out.write(reinterpret_cast<char*>(&header), sizeof(header));
+  return out.good();
+}
+
+// Pad the file with zeros up to the next multiple of alignment
+void FeatureShardWriter::pad(int alignment)
+{
+  long long offset = out.tellp();
+  static const char zeros[64] = {0};
+  if(offset % alignment != 0) out.write(zeros, alignment - offset % alignment);
+}
+
+// Append an image's features to the shard
+bool FeatureShardWriter::add(const std::string &name, const std::vector<KeyPoint> &keypoints, const Mat &descriptors, const std::vector<Point2f> &corners)
+{
+  ShardEntry entry;
+  pad(16);
+  entry.descriptorsOffset = out.tellp();
+  entry.rows = descriptors.rows;
+  entry.cols = descriptors.cols;
+  entry.type = descriptors.type();
+  for(int r = 0; r < descriptors.rows; r++)
+  {
+    out.write(reinterpret_cast<const char*>(descriptors.ptr(r)), descriptors.cols * descriptors.elemSize());
+  }
+
+  entry.keypointsOffset = out.tellp();
+  entry.numKeypoints = keypoints.size();
+  std::vector<char> records;
+  packKeypoints(keypoints, records);
+  if(records.size() > 0) out.write(&records[0], records.size());
+
+  entry.cornersOffset = out.tellp();
+  entry.numCorners = corners.size();
+  for(int i = 0; i < corners.size(); i++)
+  {
+    float xy[2] = { corners.at(i).x, corners.at(i).y };
+    out.write(reinterpret_cast<char*>(xy), sizeof(xy));
+  }
+
+  entry.nameLength = name.size();
+  entries.push_back(entry);
+  names.push_back(name);
+  return out.good();
+}
+
+// Write the index and header, finishing the shard
+bool FeatureShardWriter::close()
+{
+  pad(8);
+  ShardHeader header;
+  memcpy(header.magic, "SVS1", 4);
+  header.count = entries.size();
+  header.indexOffset = out.tellp();
+  for(int i = 0; i < entries.size(); i++)
+  {
+    out.write(reinterpret_cast<char*>(&entries.at(i)), sizeof(ShardEntry));
+    out.write(names.at(i).c_str(), names.at(i).size());
+  }
+  out.seekp(0);
+  out.write(reinterpret_cast<char*>(&header), sizeof(header));
+  out.close();
+  return out.good();
+}
+
+// Map the shard at path and read its index
+bool FeatureShard::open(const std::string &path)
+{
+  entries.clear();
+  names.clear();
+  lookup.clear();
+  if(!file.open(path)) return false;
+
+  ShardHeader header;
+  if(file.size() < sizeof(header)) return false;
+  memcpy(&header, file.data(), sizeof(header));
+  if(memcmp(header.magic, "SVS1", 4) != 0 || header.count < 0 || header.indexOffset < (long long)sizeof(header)
+    || header.indexOffset > file.size())
+  {
+    printf("Invalid feature shard '%s'\n", path.c_str());
+    file.close();
+    return false;
+  }
+
+  // Read and bounds check each entry of the index
+  long long offset = header.indexOffset;
+  for(int i = 0; i < header.count; i++)
+  {
+    ShardEntry entry;
+    if(offset + sizeof(entry) > file.size()) break;
+    memcpy(&entry, file.data() + offset, sizeof(entry));
+    offset += sizeof(entry);
+    long long descriptorsEnd = entry.descriptorsOffset + (long long)entry.rows * entry.cols * CV_ELEM_SIZE(entry.type);
+    long long keypointsEnd = entry.keypointsOffset + (long long)entry.numKeypoints * KEYPOINT_RECORD_SIZE;
+    long long cornersEnd = entry.cornersOffset + (long long)entry.numCorners * 2 * sizeof(float);
+    // Negative counts or offsets would otherwise pass the end checks and read before the data
+    if(entry.rows < 0 || entry.cols < 0 || entry.numKeypoints < 0 || entry.numCorners < 0 || entry.descriptorsOffset < (long long)sizeof(header) ||
+       entry.keypointsOffset < (long long)sizeof(header) || entry.cornersOffset < (long long)sizeof(header) ||
+       entry.nameLength < 0 || offset + entry.nameLength > file.size() ||
+       descriptorsEnd > header.indexOffset || keypointsEnd > header.indexOffset || cornersEnd > header.indexOffset)
+    {
+      break;
+    }
+    std::string entryName(file.data() + offset, entry.nameLength);
+    offset += entry.nameLength;
+
+    lookup[entryName] = entries.size();
+    entries.push_back(entry);
+    names.push_back(entryName);
+  }
+  if(entries.size() != header.count)
+  {
+    printf("Truncated feature shard '%s'\n", path.c_str());
+    file.close();
+    entries.clear();
+    names.clear();
+    lookup.clear();
+    return false;
+  }
+  return true;
+}
+
+int FeatureShard::size() const
+{
+  return entries.size();
+}
+
+const std::string& FeatureShard::name(int i) const
+{
+  return names.at(i);
+}
+
+// Index of the entry with the given name, or -1 if there is none
+int FeatureShard::find(const std::string &name) const
+{
+  std::map<std::string, int>::const_iterator it = lookup.find(name);
+  return it == lookup.end() ? -1 : it->second;
+}
+
+// The descriptors of entry i, as a read-only view into the mapping
+bool FeatureShard::getDescriptors(int i, Mat &descriptors) const
+{
+  if(i < 0 || i >= entries.size()) return false;
+  const ShardEntry &entry = entries.at(i);
+  descriptors = Mat(entry.rows, entry.cols, entry.type, (void*)(file.data() + entry.descriptorsOffset));
+  return true;
+}
+
+bool FeatureShard::get(int i, std::vector<KeyPoint> &keypoints, Mat &descriptors, std::vector<Point2f> &corners) const
+{
+  if(!getDescriptors(i, descriptors)) return false;
+  const ShardEntry &entry = entries.at(i);
+  unpackKeypoints(file.data() + entry.keypointsOffset, entry.numKeypoints, keypoints);
+  corners.resize(entry.numCorners);
+  for(int c = 0; c < entry.numCorners; c++)
+  {
+    float xy[2];
+    memcpy(xy, file.data() + entry.cornersOffset + c * sizeof(xy), sizeof(xy));
+    corners.at(c) = Point2f(xy[0], xy[1]);
+  }
+  return true;
+}
+
+bool FeatureShard::get(const std::string &name, std::vector<KeyPoint> &keypoints, Mat &descriptors, std::vector<Point2f> &corners) const
+{
+  return get(find(name), keypoints, descriptors, corners);
+}
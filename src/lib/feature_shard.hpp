@@ -0,0 +1,81 @@
+/*  Binary shard packing the features (keypoints, descriptors and object
+**  corners) of many SV images into one file, read back through mmap.
+**
+**  Layout:
+**    header:   magic "SVS1", #entries, offset of the index
+**    data:     per entry, its descriptors (16-byte aligned, row-major),
+**              keypoint records (see feature_file.hpp) and corners (x, y floats)
+**    index:    per entry, a ShardEntry followed by its name
+**
+**  Descriptors are returned as views into the mapping rather than copies,
+**  so they are only valid while the shard is open and must not be written.
+*/
+#ifndef FEATURE_SHARD_HPP
+#define FEATURE_SHARD_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include "mapped_file.hpp"
+#include "feature_file.hpp"
+
+using namespace cv;
+
+struct ShardHeader {
+  char magic[4];
+  int count;
+  long long indexOffset;
+};
+
+struct ShardEntry {
+  long long descriptorsOffset;
+  long long keypointsOffset;
+  long long cornersOffset;
+  int rows;
+  int cols;
+  int type;
+  int numKeypoints;
+  int numCorners;
+  int nameLength;
+};
+
+class FeatureShardWriter
+{
+public:
+  FeatureShardWriter();
+
+  bool open(const std::string &path);
+  bool add(const std::string &name, const std::vector<KeyPoint> &keypoints, const Mat &descriptors, const std::vector<Point2f> &corners);
+  bool close();
+
+protected:
+  void pad(int alignment);
+
+  std::ofstream out;
+  std::vector<ShardEntry> entries;
+  std::vector<std::string> names;
+};
+
+class FeatureShard
+{
+public:
+  bool open(const std::string &path);
+
+  int size() const;
+  const std::string& name(int i) const;
+  int find(const std::string &name) const;
+
+  bool get(int i, std::vector<KeyPoint> &keypoints, Mat &descriptors, std::vector<Point2f> &corners) const;
+  bool get(const std::string &name, std::vector<KeyPoint> &keypoints, Mat &descriptors, std::vector<Point2f> &corners) const;
+  bool getDescriptors(int i, Mat &descriptors) const;
+
+protected:
+  MappedFile file;
+  std::vector<ShardEntry> entries;
+  std::vector<std::string> names;
+  std::map<std::string, int> lookup;
+};
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <cstring>
+#include <sys/stat.h>
+#include "image_archive.hpp"
+
+// Read the whole of a file into bytes
+bool readFileBytes(const std::string &filename, std::vector<uchar> &bytes)
+{
+  std::ifstream in(filename.c_str(), std::ios::in | std::ifstream::binary);
+  if(!in.is_open()) return false;
+  in.seekg(0, std::ios::end);
+  long long length = in.tellg();
+  in.seekg(0, std::ios::beg);
+  if(length <= 0) return false;
+  bytes.resize(length);
+  in.read(reinterpret_cast<char*>(&bytes[0]), length);
+  return in.good();
+}
+
+ImageArchiveWriter::ImageArchiveWriter()
+{
+  offset = 0;
+}
+
+// Open the archive at path for appending, creating it if it does not exist
+bool ImageArchiveWriter::open(const std::string &path)
+{
+  struct stat st;
+  offset = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+  archive.open(path.c_str(), std::ios::out | std::ofstream::binary | std::ofstream::app);
+  index.open((path + ".idx").c_str(), std::ios::out | std::ofstream::binary | std::ofstream::app);
+  if(!archive.is_open() || !index.is_open()) return false;
+  if(offset == 0)
+  {
+    char header[8] = {'S', 'V', 'A', '1', 0, 0, 0, 0};
+    archive.write(header, sizeof(header));
+    offset = sizeof(header);
+  }
+  return archive.good();
+}
+
+// Append an encoded image to the archive, then its entry to the index
+bool ImageArchiveWriter::add(const std::string &id, const std::vector<uchar> &encoded)
+{
+  ArchiveRecord record;
+  memcpy(record.magic, "SVIR", 4);
+  record.idLength = id.size();
+  record.size = encoded.size();
+  archive.write(reinterpret_cast<char*>(&record), sizeof(record));
+  archive.write(id.c_str(), id.size());
+  if(encoded.size() > 0) archive.write(reinterpret_cast<const char*>(&encoded[0]), encoded.size());
+  archive.flush();
+  if(!archive.good()) return false;
+
+  ArchiveIndexEntry entry;
+  entry.offset = offset + sizeof(record) + id.size();
+  entry.size = encoded.size();
+  entry.idLength = id.size();
+  entry.reserved = 0;
+  index.write(reinterpret_cast<char*>(&entry), sizeof(entry));
+  index.write(id.c_str(), id.size());
+  index.flush();
+  offset = entry.offset + entry.size;
+  return index.good();
+}
+
+// Append the encoded image stored in filename
+bool ImageArchiveWriter::addFile(const std::string &id, const std::string &filename)
+{
+  std::vector<uchar> encoded;
+  if(!readFileBytes(filename, encoded)) return false;
+  return add(id, encoded);
+}
+
+bool ImageArchiveWriter::close()
+{
+  archive.close();
+  index.close();
+  return archive.good() && index.good();
+}
+
+// Map the archive at path and read its index
+bool ImageArchive::open(const std::string &path)
+{
+  close();
+  if(!file.open(path)) return false;
+  if(file.size() < 8 || memcmp(file.data(), "SVA1", 4) != 0)
+  {
+    printf("Invalid image archive '%s'\n", path.c_str());
+    close();
+    return false;
+  }
+
+  // Read the index, ignoring any entry that does not fit in the archive
+  long long indexed = 8;
+  std::vector<uchar> index;
+  if(readFileBytes(path + ".idx", index))
+  {
+    size_t pos = 0;
+    while(pos + sizeof(ArchiveIndexEntry) <= index.size())
+    {
+      ArchiveIndexEntry entry;
+      memcpy(&entry, &index[pos], sizeof(entry));
+      pos += sizeof(entry);
+      if(entry.idLength < 0 || pos + entry.idLength > index.size()) break;
+      std::string id(reinterpret_cast<char*>(&index[pos]), entry.idLength);
+      pos += entry.idLength;
+      if(!addEntry(id, entry.offset, entry.size)) break;
+      indexed = std::max(indexed, entry.offset + entry.size);
+    }
+  }
+
+  // Recover any records appended after the last one in the index
+  long long offset = indexed;
+  while(offset + (long long)sizeof(ArchiveRecord) <= (long long)file.size())
+  {
+    ArchiveRecord record;
+    memcpy(&record, file.data() + offset, sizeof(record));
+    if(memcmp(record.magic, "SVIR", 4) != 0 || record.idLength < 0) break;
+    long long dataOffset = offset + sizeof(record) + record.idLength;
+    std::string id(file.data() + offset + sizeof(record), std::min((long long)record.idLength, (long long)file.size() - offset - (long long)sizeof(record)));
+    if(!addEntry(id, dataOffset, record.size)) break;
+    offset = dataOffset + record.size;
+  }
+  return true;
+}
+
+// Record an image's location, if it lies within the archive
+bool ImageArchive::addEntry(const std::string &id, long long offset, long long size)
+{
+  if(offset < 8 || size <= 0 || offset + size > (long long)file.size()) return false;
+  lookup[id] = std::make_pair(offset, size);
+  return true;
+}
+
+void ImageArchive::close()
+{
+  file.close();
+  lookup.clear();
+}
+
+bool ImageArchive::isOpen() const
+{
+  return file.isOpen();
+}
+
+int ImageArchive::size() const
+{
+  return lookup.size();
+}
+
+bool ImageArchive::contains(const std::string &id) const
+{
+  return lookup.find(id) != lookup.end();
+}
+
+// The encoded bytes of an image, pointing into the mapping
+bool ImageArchive::getEncoded(const std::string &id, const uchar* &data, size_t &size) const
+{
+  std::map<std::string, std::pair<long long, long long> >::const_iterator it = lookup.find(id);
+  if(it == lookup.end()) return false;
+  data = reinterpret_cast<const uchar*>(file.data() + it->second.first);
+  size = it->second.second;
+  return true;
+}
+
+// Decode an image straight from the mapping; returns an empty Mat if there is no such image
+Mat ImageArchive::read(const std::string &id, int flags) const
+{
+  const uchar* data;
+  size_t size;
+  if(!getEncoded(id, data, size)) return Mat();
+  return imdecode(Mat(1, size, CV_8UC1, (void*)data), flags);
+}
@@ -0,0 +1,78 @@
+/*  Append-only archive of encoded SV images, keyed by viewpoint id
+**  (<lat>,<lng>,<heading>,<pitch>), replacing one small JPEG file per image.
+**
+**  Layout of <path>:
+**    header:   magic "SVA1", 4 reserved bytes
+**    records:  per image, an ArchiveRecord, its id and its encoded bytes
+**
+**  Layout of <path>.idx:
+**    entries:  per image, an ArchiveIndexEntry followed by its id
+**
+**  Records are written before their index entries, so the index may lag the
+**  archive after a crash but never points past it; records beyond the last
+**  indexed one are recovered by scanning their headers when the archive is
+**  opened. A later record with the same id replaces an earlier one.
+*/
+#ifndef IMAGE_ARCHIVE_HPP
+#define IMAGE_ARCHIVE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include "mapped_file.hpp"
+
+using namespace cv;
+
+struct ArchiveRecord {
+  char magic[4];
+  int idLength;
+  long long size;
+};
+
+struct ArchiveIndexEntry {
+  long long offset;   // of the encoded bytes within the archive
+  long long size;
+  int idLength;
+  int reserved;
+};
+
+class ImageArchiveWriter
+{
+public:
+  ImageArchiveWriter();
+
+  bool open(const std::string &path);
+  bool add(const std::string &id, const std::vector<uchar> &encoded);
+  bool addFile(const std::string &id, const std::string &filename);
+  bool close();
+
+protected:
+  std::ofstream archive;
+  std::ofstream index;
+  long long offset;
+};
+
+class ImageArchive
+{
+public:
+  bool open(const std::string &path);
+  void close();
+
+  bool isOpen() const;
+  int size() const;
+  bool contains(const std::string &id) const;
+  bool getEncoded(const std::string &id, const uchar* &data, size_t &size) const;
+  Mat read(const std::string &id, int flags = IMREAD_COLOR) const;
+
+protected:
+  bool addEntry(const std::string &id, long long offset, long long size);
+
+  MappedFile file;
+  std::map<std::string, std::pair<long long, long long> > lookup; // id -> (offset, size)
+};
+
+bool readFileBytes(const std::string &filename, std::vector<uchar> &bytes);
+
+#endif
@@ -5,9 +5,17 @@
 #include <stdio.h>
 #include <cstring>
 #include <fstream>
+#include <sstream>
+#include <functional>
 #include <cmath>
 #include <chrono>
 #include <omp.h>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <set>
+#include <thread>
+#include <stdexcept>
 #include "locator.hpp"
 
 using namespace cv;
@@ -24,90 +32,1015 @@ double radians(double d) {
   return d * (M_PI / 180.0);
 }
 
-Locator::Locator() {
-  // Load the big matcher
-  bigMatcher = new SaveableFlannBasedMatcher("bigmatcher");
-  bigMatcher->load();
+LocateParams::LocateParams()
+{
+  rerankDepth = 50;
+  rerankBatchSize = 0;
+  earlyStop = true;
+  earlyStopMinInliers = 60;
+  earlyStopMinViews = 3;
+  earlyStopVoteScale = 3.0;
+  budgetMs = 0;
+  keypointsPerMegapixel = 0;
+  minKeypoints = 300;
+  maxKeypoints = 1500;
+  loadAdaptive = true;
+  precheck = true;
+  minSharpness = 15.0;
+  minQueryKeypoints = 80;
+  strongResponse = 0.03;
+  minStrongKeypoints = 20;
+  clusterShortlist = true;
+  shortlistClusters = 16;
+  headingsPerCluster = 2;
+  useCache = true;
+  hintLat = 0;
+  hintLng = 0;
+  hintRadius = 0;
+}
+
+LocateResult::LocateResult()
+{
+  status = LOCATE_OK;
+  lat = 0;
+  lng = 0;
+  reranked = 0;
+  skipped = 0;
+  degraded = false;
+  keypointBudget = 0;
+  queryKeypoints = 0;
+  extractMs = 0;
+  elapsedMs = 0;
+  sharpness = 0;
+  cached = false;
+  shardsMissed = 0;
+}
+
+LocatorStats::LocatorStats()
+{
+  requests = 0;
+  located = 0;
+  degraded = 0;
+  rejected = std::vector<long>(LOCATE_STATUS_COUNT, 0);
+  rejectedMs = 0;
+  fullPipelines = 0;
+  fullPipelineMs = 0;
+  searches = 0;
+  coalescedQueries = 0;
+  coalesceWaitMs = 0;
+}
+
+Deadline::Deadline(int budgetMs)
+{
+  unlimited = budgetMs <= 0;
+  end = std::chrono::steady_clock::now() + std::chrono::milliseconds(budgetMs);
+}
+
+bool Deadline::expired() const
+{
+  return !unlimited && std::chrono::steady_clock::now() >= end;
+}
+
+// Move the deadline later by delay, for time the request spent waiting rather than being worked on
+void Deadline::postpone(std::chrono::steady_clock::duration delay)
+{
+  end += delay;
+}
+
+// Milliseconds left before the deadline, at least 1 until it has passed (0 = unlimited)
+int Deadline::remainingMs() const
+{
+  if(unlimited) return 0;
+  long long left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count();
+  return (int)std::max(1LL, left);
+}
+
+Locator::Locator() : Locator(true) {}
+
+// A Locator which only coordinates shards (see setShards) is created with loadBigMatcher false:
+// it searches no bigmatcher of its own, so none is loaded.
+Locator::Locator(bool loadBigMatcher) {
+  coalesceWindowMs = 0;
+  coalesceMaxBatch = 1;
+  coalesceLeader = false;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  // Load the big matcher: if it was split into regions, only their manifest is read and each
+  // region is loaded when first searched. Otherwise map the verified snapshot so its descriptors
+  // are shared with other processes, or else read a private copy of a matcher stored the old way.
+  std::vector<int> segmentRows;
+  if(!loadBigMatcher)
+  {
+    printf("Not loading a bigmatcher, the search must be scattered over shards\n");
+  }
+  else if(regionalIndex.load("bigmatcher-regions.txt"))
+  {
+    regionalIndex.setBudget((size_t)2048 * 1024 * 1024);
+    segmentRows = regionalIndex.getSegmentRows();
+  }
+  else
+  {
+    if(!mappedIndex.load("bigmatcher.snapshot"))
+    {
+      bigMatcher = new SaveableFlannBasedMatcher("bigmatcher");
+      bigMatcher->load();
+      // Once a snapshot is saved the old files are removed, so a refused snapshot usually
+      // leaves nothing to fall back on: refuse to start rather than match every query to nothing
+      if(bigMatcher->getTrainDescriptors().empty())
+      {
+        printf("No usable bigmatcher: the snapshot is missing or corrupt and there are no bigmatcher-descriptors.bin to fall back on\n");
+        throw std::runtime_error("no usable bigmatcher");
+      }
+    }
+    const std::vector<Mat> &segments = mappedIndex.isLoaded() ? mappedIndex.getSegments() : bigMatcher->getTrainDescriptors();
+    for(int i = 0; i < segments.size(); i++) segmentRows.push_back(segments.at(i).rows);
+  }
+
+  // Viewpoints sharing descriptors merged when the bigmatcher was built, if any were
+  owners.load("bigmatcher-owners.bin", segmentRows);
+
+  // Location cluster of each viewpoint, derived from the filenames at locate time if missing
+  clusters.load("bigmatcher-clusters.bin", segmentRows.size());
+
+  // Verify repeated and near-duplicate queries against the viewpoints of the last few hundred
+  // locations found, rather than searching the bigmatcher for them
+  cache.configure(256, 4);
+
+  // Keep the rerank data of the viewpoints verified most recently
+  viewpointCache.configure(256 * 1024 * 1024, 512);
+
+  readyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("Locator ready in %.2fs\n", readyMs / 1000.0);
+}
+
+// Keep up to capacity locations in the result cache (0 turns it off), hitting for queries whose
+// perceptual hashes differ in at most maxDistance of their 64 bits. Clears the cache.
+void Locator::setCache(int capacity, int maxDistance) {
+  cache.configure(capacity, maxDistance);
+}
+
+// Keep the regions of a regional bigmatcher resident within maxMB of memory, evicting the least
+// recently searched ones (0 = no limit)
+void Locator::setRegionBudget(int maxMB) {
+  regionalIndex.setBudget((size_t)std::max(0, maxMB) * 1024 * 1024);
+}
+
+// Keep the rerank data of up to maxEntries recently verified viewpoints, in at most maxMB of
+// memory (either 0 turns the viewpoint cache off)
+void Locator::setViewpointCache(int maxMB, int maxEntries) {
+  viewpointCache.configure((size_t)std::max(0, maxMB) * 1024 * 1024, maxEntries);
+}
+
+// Scatter bigmatcher searches over the shard processes listening on these Unix sockets (see
+// shard_set.hpp), instead of searching a local index. Each shard votes for its topK best
+// viewpoints; a shard which takes longer than timeoutMs is left out. No paths turns it off.
+void Locator::setShards(const std::vector<std::string> &paths, int timeoutMs, int topK) {
+  shards.configure(paths, timeoutMs, topK);
+  clearCache();
+}
+
+void Locator::pySetShards(list paths, int timeoutMs, int topK) {
+  std::vector<std::string> shardPaths;
+  for(int i = 0; i < len(paths); i++)
+  {
+    shardPaths.push_back(extract<std::string>(paths[i]));
+  }
+  setShards(shardPaths, timeoutMs, topK);
+}
+
+// Forget every cached location and viewpoint, e.g. because the SV images or the index have changed
+void Locator::clearCache() {
+  cache.clear();
+  viewpointCache.clear();
+}
+
+// Combine the bigmatcher searches of concurrent locate calls: each waits up to windowMs for
+// others to join it, up to maxBatch queries per search. Trades a little latency per request
+// for throughput when requests arrive together; a window of 0 turns coalescing off.
+void Locator::setCoalescing(double windowMs, int maxBatch) {
+  std::lock_guard<std::mutex> lock(coalesceMutex);
+  coalesceWindowMs = std::max(0.0, windowMs);
+  coalesceMaxBatch = std::max(1, maxBatch);
+}
+
+// Read SV images from the archive at path, falling back to individual files for any image it
+// does not hold. Calling this again picks up images appended since the last call, and clears
+// the caches since new images can change where a query is located.
+// The archive is opened afresh and swapped in, so requests still reading the old mapping keep it
+// until they finish.
+bool Locator::openArchive(const char* path) {
+  std::shared_ptr<ImageArchive> opened = std::make_shared<ImageArchive>();
+  bool ok = opened->open(path);
+  {
+    std::lock_guard<std::mutex> lock(archiveMutex);
+    archive = opened;
+  }
+  clearCache();
+  if(!ok)
+  {
+    printf("Can't open image archive '%s', reading individual SV images\n", path);
+    return false;
+  }
+  printf("Reading %d SV images from archive '%s'\n", opened->size(), path);
+  return true;
+}
+
+// Data struc to store the vote & other data associated with a particular SV image
+struct Viewpoint {
+  int segment;    // line of the filenames_file, which is also its bigmatcher index
+  int votes;
+  int cluster;
+  std::string lat;
+  std::string lng;
+  std::string heading;
+  std::string pitch;
+  Mat image;
+  std::vector<KeyPoint> keypoints;
+  Mat descriptors;
+  Ptr<flann::Index> index;  // over descriptors, to match other viewpoints against this one
+};
+bool vote_sorter(Viewpoint const &lhs, Viewpoint const &rhs) {
+  return lhs.votes > rhs.votes; // sorts in descending order
+}
+
+// Shortlist the viewpoints to rerank from their bigmatcher votes: the votes of each location
+// cluster are summed, and only the best headingsPerCluster viewpoints of each of the top
+// shortlistClusters clusters are kept, sorted by their own votes. The rerank then covers
+// distinct locations rather than many headings and pitches of the same few.
+void shortlistByCluster(std::vector<Viewpoint> &vpTable, int numClusters, const LocateParams &params)
+{
+  std::vector<long> clusterVotes(numClusters, 0);
+  for(int i = 0; i < vpTable.size(); i++)
+  {
+    clusterVotes.at(vpTable.at(i).cluster) += vpTable.at(i).votes;
+  }
+  std::vector<int> order(numClusters);
+  for(int c = 0; c < numClusters; c++) order.at(c) = c;
+  int numShortlisted = std::min(numClusters, std::max(0, params.shortlistClusters));
+  std::partial_sort(order.begin(), order.begin() + numShortlisted, order.end(),
+    [&clusterVotes](int a, int b) { return clusterVotes.at(a) > clusterVotes.at(b); });
+  std::vector<char> shortlisted(numClusters, 0);
+  for(int r = 0; r < numShortlisted && clusterVotes.at(order.at(r)) > 0; r++)
+  {
+    shortlisted.at(order.at(r)) = 1;
+  }
+
+  std::stable_sort(vpTable.begin(), vpTable.end(), &vote_sorter);
+  std::vector<int> taken(numClusters, 0);
+  std::vector<Viewpoint> shortlist;
+  for(int i = 0; i < vpTable.size() && vpTable.at(i).votes > 0; i++)
+  {
+    int cluster = vpTable.at(i).cluster;
+    if(shortlisted.at(cluster) && taken.at(cluster) < params.headingsPerCluster)
+    {
+      shortlist.push_back(vpTable.at(i));
+      taken.at(cluster)++;
+    }
+  }
+  vpTable.swap(shortlist);
+}
+
+// Decide whether the rerank can stop after the first `processed` entries of the vpTable have been
+// verified: the location cluster with the most verified matches in total must have enough of them,
+// there must be enough distinct views to triangulate from, and no other cluster may be able to
+// overtake the leader even if every bigmatcher vote of its unverified candidates turned into
+// earlyStopVoteScale verified matches.
+bool canStopRerank(std::vector<Viewpoint> &vpTable, int processed, const LocateParams &params)
+{
+  if(processed >= vpTable.size()) return true;
+
+  // Verified matches of each cluster so far, and its best single view
+  std::map<int, double> verifiedVotes;
+  std::map<int, int> bestView;
+  for(int i = 0; i < processed; i++)
+  {
+    verifiedVotes[vpTable.at(i).cluster] += vpTable.at(i).votes;
+    bestView[vpTable.at(i).cluster] = std::max(bestView[vpTable.at(i).cluster], vpTable.at(i).votes);
+  }
+  int leader = -1;
+  for(std::map<int, double>::iterator it = verifiedVotes.begin(); it != verifiedVotes.end(); ++it)
+  {
+    if(leader < 0 || it->second > verifiedVotes[leader]) leader = it->first;
+  }
+  int views = 0;
+  for(std::map<int, int>::iterator it = bestView.begin(); it != bestView.end(); ++it)
+  {
+    if(it->second >= 9) views++;
+  }
+  if(leader < 0 || verifiedVotes[leader] < params.earlyStopMinInliers || views < params.earlyStopMinViews) return false;
+
+  // Unverified candidates still hold their bigmatcher votes: bound what each cluster could still gain
+  std::map<int, double> bound(verifiedVotes);
+  for(int i = processed; i < vpTable.size(); i++)
+  {
+    bound[vpTable.at(i).cluster] += params.earlyStopVoteScale * vpTable.at(i).votes;
+  }
+  for(std::map<int, double>::iterator it = bound.begin(); it != bound.end(); ++it)
+  {
+    if(it->first != leader && it->second >= verifiedVotes[leader]) return false;
+  }
+  return true;
+}
+
+// Locate the object in the image given by img_filename by matching against the stored bigmatcher,
+// taking the top scoring images, and performing a rigourous matching against these.
+// (_imgs_folder = the folder containing the SV images, filenames_filename = the location of the file describing the SV filenames)
+bool Locator::locate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename)
+{
+  return locate(img_filename, _imgs_folder, filenames_filename, LocateParams());
+}
+
+// As above, using the given tuning parameters for this request
+bool Locator::locate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params)
+{
+  LocateResult result;
+  bool located = locate(img_filename, _imgs_folder, filenames_filename, params, result);
+  std::lock_guard<std::mutex> lock(lastMutex);
+  last = result;
+  return located;
+}
+
+// As above, writing the location and pipeline statistics to result
+bool Locator::locate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, LocateResult &result)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  bool located = runPipeline(img_filename, _imgs_folder, filenames_filename, params, result);
+  result.elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  recordStats(result, located);
+  return located;
+}
+
+// As above, for a query given as an encoded image (e.g. received over a socket) rather than a path
+bool Locator::locate(const std::vector<uchar> &encoded, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, LocateResult &result)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  Deadline deadline(params.budgetMs);
+  bool located = false;
+  Mat queryImage;
+  if(!encoded.empty())
+  {
+    queryImage = imdecode(encoded, IMREAD_COLOR);
+  }
+  if(queryImage.data == NULL)
+  {
+    printf("Can't decode query image (%d bytes)\n", (int)encoded.size());
+    result.status = LOCATE_UNREADABLE;
+  }
+  else
+  {
+    located = runStages(queryImage, _imgs_folder, filenames_filename, params, deadline, result);
+  }
+  result.elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  recordStats(result, located);
+  return located;
+}
+
+// Locate a batch of queries, each given by its path or, if encoded[i] is not empty, its encoded
+// image. The queries are processed in chunks of one per thread: while a chunk is searched and
+// verified, the next chunk is decoded and extracted on another thread, and each chunk's
+// bigmatcher search is a single kNN call over all of its queries. Each query's latency budget
+// starts when its extraction does, and is paused while an extracted query waits for its chunk's
+// search to begin, so a prefetched query is not charged for the previous chunk's work. The
+// prefetching thread extracts with half the OpenMP threads, leaving the rest to that work.
+void Locator::locateBatch(std::vector<std::string> &paths, std::vector<std::vector<uchar> > &encoded, const char* _imgs_folder,
+  const char* filenames_filename, const LocateParams &params, std::vector<LocateResult> &results)
+{
+  int n = paths.size();
+  results.assign(n, LocateResult());
+  std::vector<QueryFeatures> features(n);
+  std::vector<Deadline> deadlines(n, Deadline(params.budgetMs));
+  std::vector<std::chrono::steady_clock::time_point> starts(n);
+  std::vector<std::chrono::steady_clock::time_point> extractedAt(n);
+  std::vector<char> extracted(n, 0);
+  std::vector<char> cached(n, 0);
+  std::vector<char> hit(n, 0);
+  std::vector<CachedLocation> hits(n);
+  std::vector<unsigned long long> hashes(n, 0);
+  int chunkSize = std::max(1, omp_get_max_threads());
+
+  // Stage 1 for a chunk: decode the images and extract their features in parallel
+  auto extractChunk = [&](int begin, int end, int threads) {
+    #pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for(int i = begin; i < end; i++)
+    {
+      starts.at(i) = std::chrono::steady_clock::now();
+      deadlines.at(i) = Deadline(params.budgetMs);
+      Mat queryImage = encoded.at(i).empty() ? imread(paths.at(i)) : imdecode(encoded.at(i), IMREAD_COLOR);
+      std::vector<uchar>().swap(encoded.at(i));
+      if(queryImage.data == NULL)
+      {
+        results.at(i).status = LOCATE_UNREADABLE;
+        continue;
+      }
+      hit.at(i) = lookupCache(queryImage, params, hashes.at(i), hits.at(i));
+      extracted.at(i) = extractQuery(queryImage, params, deadlines.at(i), results.at(i), features.at(i));
+      extractedAt.at(i) = std::chrono::steady_clock::now();
+    }
+  };
+
+  extractChunk(0, std::min(chunkSize, n), chunkSize);
+  for(int begin = 0; begin < n; begin += chunkSize)
+  {
+    int end = std::min(begin + chunkSize, n);
+    std::thread prefetch;
+    if(end < n)
+    {
+      prefetch = std::thread(extractChunk, end, std::min(end + chunkSize, n), std::max(1, chunkSize / 2));
+    }
+
+    // The chunk's work starts now, so take the time its queries waited off their budgets
+    std::chrono::steady_clock::time_point searchStart = std::chrono::steady_clock::now();
+    for(int i = begin; i < end; i++)
+    {
+      if(!extracted.at(i)) continue;
+      deadlines.at(i).postpone(searchStart - extractedAt.at(i));
+      starts.at(i) += searchStart - extractedAt.at(i);
+    }
+
+    // Result cache hits confirmed by their cached viewpoints need no search
+    for(int i = begin; i < end; i++)
+    {
+      if(extracted.at(i) && hit.at(i))
+      {
+        cached.at(i) = verifyCached(_imgs_folder, filenames_filename, params, deadlines.at(i), features.at(i), hits.at(i), results.at(i));
+      }
+    }
+
+    // Stage 2: one bigmatcher search for every other extracted query of the chunk
+    std::vector<QueryFeatures*> batch;
+    std::vector<int> batchIdxs;
+    for(int i = begin; i < end; i++)
+    {
+      if(extracted.at(i) && !cached.at(i) && params.candidates.empty())
+      {
+        batch.push_back(&features.at(i));
+        batchIdxs.push_back(i);
+      }
+    }
+    std::vector<std::vector<DMatch> > batchMatches(batch.size());
+    std::vector<std::vector<int> > votes(end - begin);
+    if(shards.isEnabled())
+    {
+      // Each query is scattered over the shards on its own, within its own budget
+      for(int b = 0; b < batch.size(); b++)
+      {
+        int i = batchIdxs.at(b);
+        searchShards(batch.at(b)->descriptors, deadlines.at(i), votes.at(i - begin), results.at(i));
+      }
+    }
+    else if(regionalIndex.isLoaded())
+    {
+      // Each query searches the regions around its own location hint
+      for(int b = 0; b < batch.size(); b++)
+      {
+        searchRegions(batch.at(b)->descriptors, params, batchMatches.at(b));
+      }
+    }
+    else
+    {
+      searchBigMatcher(batch, batchMatches);
+    }
+    std::vector<std::vector<DMatch> > matches(end - begin);
+    for(int b = 0; b < batch.size(); b++)
+    {
+      matches.at(batchIdxs.at(b) - begin).swap(batchMatches.at(b));
+    }
+
+    // Stage 3: verify and triangulate each query, its rerank running in parallel
+    for(int i = begin; i < end; i++)
+    {
+      bool located = cached.at(i) || (extracted.at(i) &&
+        verifyAndLocate(_imgs_folder, filenames_filename, params, deadlines.at(i), features.at(i), matches.at(i - begin),
+        votes.at(i - begin), results.at(i)));
+      if(!cached.at(i)) storeCache(hashes.at(i), params, results.at(i), located);
+      features.at(i) = QueryFeatures();
+      results.at(i).elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - starts.at(i)).count();
+      recordStats(results.at(i), located);
+    }
+
+    if(prefetch.joinable()) prefetch.join();
+  }
+}
+
+// Releases the GIL for as long as it is in scope, so other Python threads can run
+struct ScopedGILRelease
+{
+  ScopedGILRelease() { state = PyEval_SaveThread(); }
+  ~ScopedGILRelease() { PyEval_RestoreThread(state); }
+  PyThreadState* state;
+};
+
+// A Python dict describing a locate result
+dict resultDict(const LocateResult &r)
+{
+  dict d;
+  d["located"] = r.status == LOCATE_OK;
+  d["status"] = r.status;
+  d["lat"] = r.lat;
+  d["lng"] = r.lng;
+  d["degraded"] = r.degraded;
+  d["reranked"] = r.reranked;
+  d["cached"] = r.cached;
+  d["shardsMissed"] = r.shardsMissed;
+  d["elapsedMs"] = r.elapsedMs;
+  return d;
+}
+
+// Python entry points to locate, which release the GIL while locating so that concurrent
+// requests (and so the request coalescer) can run in parallel. The result is only shared
+// through last under lastMutex, so concurrent callers should use locateResult, which returns
+// the result of their own request rather than whichever finished last.
+bool Locator::pyLocate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename)
+{
+  ScopedGILRelease release;
+  return locate(img_filename, _imgs_folder, filenames_filename);
+}
+
+bool Locator::pyLocate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params)
+{
+  ScopedGILRelease release;
+  return locate(img_filename, _imgs_folder, filenames_filename, params);
+}
+
+dict Locator::pyLocateResult(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params)
+{
+  LocateResult result;
+  {
+    ScopedGILRelease release;
+    locate(img_filename, _imgs_folder, filenames_filename, params, result);
+  }
+  return resultDict(result);
+}
+
+// Locate each query of a Python list of image paths (str) or encoded images (bytearray, or
+// bytes on Python 3), returning a list with a dict describing the result of each query
+list Locator::locateBatch(list queries, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params)
+{
+  int n = len(queries);
+  std::vector<std::string> paths(n);
+  std::vector<std::vector<uchar> > encoded(n);
+  for(int i = 0; i < n; i++)
+  {
+    object item = queries[i];
+    PyObject* obj = item.ptr();
+    if(PyByteArray_Check(obj))
+    {
+      const char* data = PyByteArray_AsString(obj);
+      encoded.at(i).assign(data, data + PyByteArray_Size(obj));
+    }
+#if PY_MAJOR_VERSION >= 3
+    else if(PyBytes_Check(obj))
+    {
+      const char* data = PyBytes_AsString(obj);
+      encoded.at(i).assign(data, data + PyBytes_Size(obj));
+    }
+#endif
+    else
+    {
+      paths.at(i) = extract<std::string>(item);
+    }
+  }
+
+  std::vector<LocateResult> results;
+  {
+    // Nothing below touches Python objects
+    ScopedGILRelease release;
+    locateBatch(paths, encoded, _imgs_folder, filenames_filename, params, results);
+  }
+
+  list out;
+  for(int i = 0; i < results.size(); i++)
+  {
+    out.append(resultDict(results.at(i)));
+  }
+  return out;
+}
+
+// Whether the status is a rejection by the query pre-check
+bool isPrecheckReject(LocateStatus status)
+{
+  return status == LOCATE_BLURRY || status == LOCATE_UNTEXTURED || status == LOCATE_LOW_CONTRAST;
+}
+
+// Add the outcome of a request to the running statistics
+void Locator::recordStats(const LocateResult &result, bool located)
+{
+  std::lock_guard<std::mutex> lock(statsMutex);
+  stats.requests++;
+  if(located) stats.located++;
+  if(result.degraded) stats.degraded++;
+  if(!located) stats.rejected.at(result.status)++;
+  if(isPrecheckReject(result.status))
+  {
+    stats.rejectedMs += result.elapsedMs;
+  }
+  else if(result.status != LOCATE_UNREADABLE && !result.cached)
+  {
+    stats.fullPipelines++;
+    stats.fullPipelineMs += result.elapsedMs;
+  }
+}
+
+// Check the query is worth locating before any matching: a blurry image (low variance of the
+// Laplacian), or too few or too weak keypoints (sky, blank walls) will not collect enough
+// verified votes. Returns LOCATE_OK if the query passes, otherwise the reason it is rejected.
+LocateStatus precheckQuery(double sharpness, std::vector<KeyPoint> &keypoints, const LocateParams &params)
+{
+  if(sharpness < params.minSharpness)
+  {
+    return LOCATE_BLURRY;
+  }
+  if(keypoints.size() < params.minQueryKeypoints)
+  {
+    return LOCATE_UNTEXTURED;
+  }
+  int strong = 0;
+  for(int i = 0; i < keypoints.size(); i++)
+  {
+    if(keypoints.at(i).response >= params.strongResponse) strong++;
+  }
+  if(strong < params.minStrongKeypoints)
+  {
+    return LOCATE_LOW_CONTRAST;
+  }
+  return LOCATE_OK;
+}
+
+bool Locator::runPipeline(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, LocateResult &result)
+{
+  // The latency budget is checked between stages; once it runs out the best estimate so far is
+  // returned with result.degraded set, or false if there is no estimate yet
+  Deadline deadline(params.budgetMs);
+
+  // Load the query image
+  Mat queryImage = imread(img_filename);
+  if(queryImage.data == NULL)
+  {
+    printf("Can't read image '%s'\n", img_filename);
+    result.status = LOCATE_UNREADABLE;
+    return false;
+  }
+  return runStages(queryImage, _imgs_folder, filenames_filename, params, deadline, result);
+}
+
+// Run the extraction, search and verification stages for a loaded query image. If the result
+// cache holds a near-duplicate of the query, the search is skipped as long as the viewpoints its
+// location came from verify against the query.
+bool Locator::runStages(Mat &queryImage, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params,
+  const Deadline &deadline, LocateResult &result)
+{
+  unsigned long long hash = 0;
+  CachedLocation hit;
+  bool found = lookupCache(queryImage, params, hash, hit);
+  QueryFeatures query;
+  if(!extractQuery(queryImage, params, deadline, result, query))
+  {
+    return false;
+  }
+  if(found && verifyCached(_imgs_folder, filenames_filename, params, deadline, query, hit, result))
+  {
+    return true;
+  }
+  std::vector<DMatch> matches;
+  std::vector<int> shardVotes;
+  if(params.candidates.empty() && shards.isEnabled())
+  {
+    searchShards(query.descriptors, deadline, shardVotes, result);
+  }
+  else if(params.candidates.empty() && regionalIndex.isLoaded())
+  {
+    searchRegions(query.descriptors, params, matches);
+  }
+  else if(params.candidates.empty() && isCoalescing())
+  {
+    coalescedSearch(query, matches);
+  }
+  else if(params.candidates.empty())
+  {
+    searchBigMatcher(query.descriptors, matches);
+  }
+  bool located = verifyAndLocate(_imgs_folder, filenames_filename, params, deadline, query, matches, shardVotes, result);
+  storeCache(hash, params, result, located);
+  return located;
+}
+
+// Whether the result cache applies to a request: it only holds full searches
+bool Locator::cacheable(const LocateParams &params)
+{
+  return params.useCache && params.candidates.empty() && cache.enabled();
+}
+
+// Key of the parameters which change the location found for a query, so that a cached result
+// is only reused by requests asking for the same search. The budget is left out, as degraded
+// results are never cached.
+unsigned long long cacheParamsKey(const LocateParams &params)
+{
+  std::stringstream key;
+  key << params.rerankDepth << " " << params.earlyStop << " " << params.earlyStopMinInliers << " " << params.earlyStopMinViews
+    << " " << params.earlyStopVoteScale << " " << params.keypointsPerMegapixel << " " << params.minKeypoints << " " << params.maxKeypoints
+    << " " << params.loadAdaptive << " " << params.precheck << " " << params.minSharpness << " " << params.minQueryKeypoints
+    << " " << params.strongResponse << " " << params.minStrongKeypoints << " " << params.clusterShortlist << " " << params.shortlistClusters
+    << " " << params.headingsPerCluster << " " << params.hintLat << " " << params.hintLng << " " << params.hintRadius;
+  return std::hash<std::string>()(key.str());
+}
+
+// Look the query up in the result cache, setting hit to the cached location of a near-duplicate
+// located with the same parameters. hash is set to the query's perceptual hash for storeCache
+// whenever the cache applies.
+bool Locator::lookupCache(const Mat &queryImage, const LocateParams &params, unsigned long long &hash, CachedLocation &hit)
+{
+  if(!cacheable(params)) return false;
+  hash = perceptualHash(queryImage);
+  return cache.find(hash, cacheParamsKey(params), hit);
+}
+
+// Verify the query against the viewpoints a cached location came from, as a session verifies
+// the viewpoints of its last keyframe, rather than trusting a perceptual hash match. On success
+// result is the verified location, marked cached; otherwise it is left as extraction set it, for
+// the full search.
+bool Locator::verifyCached(const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, const Deadline &deadline,
+  QueryFeatures &query, const CachedLocation &hit, LocateResult &result)
+{
+  if(hit.viewpoints.empty()) return false;
+  LocateParams cachedParams = params;
+  cachedParams.candidates = hit.viewpoints;
+  LocateResult verified = result;
+  std::vector<DMatch> noMatches;
+  std::vector<int> noVotes;
+  if(!verifyAndLocate(_imgs_folder, filenames_filename, cachedParams, deadline, query, noMatches, noVotes, verified))
+  {
+    return false;
+  }
+  verified.cached = true;
+  result = verified;
+  cache.confirmHit();
+  return true;
+}
+
+// Cache the location found for a query, unless it is only a degraded estimate
+void Locator::storeCache(unsigned long long hash, const LocateParams &params, const LocateResult &result, bool located)
+{
+  if(located && !result.degraded && cacheable(params))
+  {
+    cache.insert(hash, cacheParamsKey(params), result.lat, result.lng, result.viewpoints);
+  }
+}
+
+// Stage 1: pre-check the query and extract its rootSIFT features. Returns false (with
+// result.status set) if the query is rejected or the deadline has already passed.
+bool Locator::extractQuery(Mat &queryImage, const LocateParams &params, const Deadline &deadline, LocateResult &result, QueryFeatures &query)
+{
+  // Reject blurry queries before paying for feature extraction
+  result.sharpness = laplacianVariance(queryImage);
+  if(params.precheck && result.sharpness < params.minSharpness)
+  {
+    result.status = LOCATE_BLURRY;
+    return false;
+  }
+
+  // Create SIFT detector
+  Ptr<FeatureDetector> detector;
+  createDetector(detector, "SIFT");
+
+  // Get query keypoints and descriptors, converting to rootSIFT; in keypoint budget mode
+  // only the strongest, spatially spread keypoints are kept, fewer under server load
+  std::chrono::steady_clock::time_point extractStart = std::chrono::steady_clock::now();
+  result.keypointBudget = keypointBudget(queryImage.size(), params.keypointsPerMegapixel, params.minKeypoints, params.maxKeypoints,
+    params.loadAdaptive ? serverLoad() : 0.0);
+  std::vector<KeyPoint> &queryKeypoints = query.keypoints;
+  Mat &queryDescriptors = query.descriptors;
+  detector->detect(queryImage, queryKeypoints);
+
+  // Reject untextured queries before computing descriptors or matching
+  if(params.precheck)
+  {
+    result.status = precheckQuery(result.sharpness, queryKeypoints, params);
+    if(result.status != LOCATE_OK)
+    {
+      result.queryKeypoints = queryKeypoints.size();
+      return false;
+    }
+  }
+
+  retainKeypointBudget(queryKeypoints, result.keypointBudget, queryImage.size());
+  detector->compute(queryImage, queryKeypoints, queryDescriptors);
+  rootSIFT(queryDescriptors);
+  result.queryKeypoints = queryKeypoints.size();
+  result.extractMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - extractStart).count();
+  if(deadline.expired())
+  {
+    result.status = LOCATE_TIMEOUT;
+    return false;
+  }
+  return true;
+}
+
+// Stage 2: match the query descriptors against all SV images using the bigmatcher
+void Locator::searchBigMatcher(const Mat &queryDescriptors, std::vector<DMatch> &matches)
+{
+#ifdef PROFILE_LOCATE
+  std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+#endif
+  std::vector<std::vector<DMatch> > knn_matches;
+  bigMatcherKnn(queryDescriptors, knn_matches);
+  loweFilter(knn_matches, matches);
+#ifdef PROFILE_LOCATE
+  std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count();
+  std::cout << duration << ",";
+#endif
+}
+
+// The two nearest bigmatcher descriptors of each query descriptor
+void Locator::bigMatcherKnn(const Mat &queryDescriptors, std::vector<std::vector<DMatch> > &knn_matches)
+{
+  if(mappedIndex.isLoaded())
+  {
+    mappedIndex.knnMatch(queryDescriptors, knn_matches, 2);
+  }
+  else if(!bigMatcher.empty())
+  {
+    bigMatcher->knnMatch(queryDescriptors, knn_matches, 2);
+  }
+}
+
+// Stage 2 over a regional bigmatcher: only the regions around the query's location hint are
+// searched, loading any which are not resident, then the regions bordering them are prefetched
+// for the queries likely to follow. A query without a hint is searched in every region.
+void Locator::searchRegions(const Mat &queryDescriptors, const LocateParams &params, std::vector<DMatch> &matches)
+{
+  std::vector<int> regions;
+  if(params.hintRadius > 0)
+  {
+    regions = regionalIndex.regionsNear(params.hintLat, params.hintLng, params.hintRadius);
+  }
+  else
+  {
+    regions = regionalIndex.allRegions();
+  }
+  std::vector<std::vector<DMatch> > knn_matches;
+  regionalIndex.knnMatch(queryDescriptors, regions, knn_matches, 2);
+  loweFilter(knn_matches, matches);
+  if(params.hintRadius > 0)
+  {
+    regionalIndex.prefetch(regionalIndex.neighboursOf(regions));
+  }
 }
 
-// Data struc to store the vote & other data associated with a particular SV image
-struct Viewpoint {
-  int votes;
-  std::string lat;
-  std::string lng;
-  std::string heading;
-  std::string pitch;
-  Mat image;
-  std::vector<KeyPoint> keypoints;
-  Mat descriptors;
-};
-bool vote_sorter(Viewpoint const &lhs, Viewpoint const &rhs) {
-  return lhs.votes > rhs.votes; // sorts in descending order
+// Stage 2 scattered over the shard processes: each searches its own viewpoints and votes for its
+// best ones, and the votes are summed per viewpoint. Note the ratio test is applied within each
+// shard, so a descriptor can vote once per shard rather than once overall.
+void Locator::searchShards(const Mat &queryDescriptors, const Deadline &deadline, std::vector<int> &votes, LocateResult &result)
+{
+  int answered = shards.search(queryDescriptors, deadline.remainingMs(), votes);
+  result.shardsMissed = shards.size() - answered;
 }
 
-// Split a string by the delimiter, putting each segment as an entry in the vector
-std::vector<std::string> splitString(const char* str, char delimiter)
+// Stage 2 for several queries at once: their descriptors are stacked so the bigmatcher is
+// searched with a single kNN call, and the matches are split back per query
+void Locator::searchBigMatcher(std::vector<QueryFeatures*> &queries, std::vector<std::vector<DMatch> > &matches)
 {
-  std::stringstream stream(str);
-  std::string segment;
-  std::vector<std::string> seglist;
-  while(std::getline(stream, segment, delimiter))
+  matches.assign(queries.size(), std::vector<DMatch>());
+  std::vector<int> offsets(queries.size() + 1, 0);
+  int cols = 0;
+  for(int q = 0; q < queries.size(); q++)
+  {
+    const Mat &descriptors = queries.at(q)->descriptors;
+    offsets.at(q + 1) = offsets.at(q) + descriptors.rows;
+    if(descriptors.rows > 0) cols = descriptors.cols;
+  }
+  if(offsets.back() == 0) return;
+
+  Mat stacked(offsets.back(), cols, CV_32F);
+  for(int q = 0; q < queries.size(); q++)
   {
-     seglist.push_back(segment);
+    if(queries.at(q)->descriptors.rows == 0) continue;
+    Mat segment = stacked.rowRange(offsets.at(q), offsets.at(q + 1));
+    queries.at(q)->descriptors.copyTo(segment);
+  }
+  std::vector<std::vector<DMatch> > knn_matches;
+  bigMatcherKnn(stacked, knn_matches);
+
+  for(int q = 0; q < queries.size(); q++)
+  {
+    std::vector<std::vector<DMatch> > queryKnn(knn_matches.begin() + offsets.at(q), knn_matches.begin() + offsets.at(q + 1));
+    for(int i = 0; i < queryKnn.size(); i++)
+    {
+      for(int k = 0; k < queryKnn.at(i).size(); k++) queryKnn.at(i).at(k).queryIdx -= offsets.at(q);
+    }
+    loweFilter(queryKnn, matches.at(q));
   }
-  return seglist;
 }
 
-// Locate the object in the image given by img_filename by matching against the stored bigmatcher,
-// taking the top scoring images, and performing a rigourous matching against these.
-// (_imgs_folder = the folder containing the SV images, filenames_filename = the location of the file describing the SV filenames)
-bool Locator::locate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename)
+// Whether stage 2 goes through the request coalescer; setCoalescing can change this at any time
+bool Locator::isCoalescing()
 {
-  // Load the query image
-  Mat queryImage = imread(img_filename);
-  if(queryImage.data == NULL)
+  std::lock_guard<std::mutex> lock(coalesceMutex);
+  return coalesceWindowMs > 0;
+}
+
+// Stage 2 through the request coalescer: concurrent callers' queries are gathered into one
+// bigmatcher search. The first caller to find no search gathering becomes its leader, waits up
+// to the coalescing window (or until maxBatch queries have joined), then searches for all of
+// them and hands each its matches; the others wait for theirs. A new search can gather while
+// the previous one runs.
+void Locator::coalescedSearch(QueryFeatures &query, std::vector<DMatch> &matches)
+{
+  PendingSearch mine;
+  mine.query = &query;
+  mine.matches = &matches;
+  mine.queued = std::chrono::steady_clock::now();
+  mine.taken = false;
+  mine.done = false;
+
+  std::unique_lock<std::mutex> lock(coalesceMutex);
+  pendingSearches.push_back(&mine);
+  if(pendingSearches.size() >= coalesceMaxBatch) coalesceCv.notify_all();
+  while(!mine.done)
   {
-    printf("Can't read image '%s'\n", img_filename);
-    return false;
-  }
+    // Only a caller whose query is still pending may lead; one already gathered into another
+    // caller's search just waits for its matches
+    if(coalesceLeader || mine.taken)
+    {
+      coalesceCv.wait(lock);
+      continue;
+    }
 
-  // Create SIFT detector
-  Ptr<FeatureDetector> detector;
-  createDetector(detector, "SIFT");
+    // Lead the next search: gather concurrent queries for up to the window
+    coalesceLeader = true;
+    std::chrono::steady_clock::time_point windowEnd = std::chrono::steady_clock::now() +
+      std::chrono::microseconds((long)(coalesceWindowMs * 1000));
+    coalesceCv.wait_until(lock, windowEnd, [this]() { return pendingSearches.size() >= coalesceMaxBatch; });
+    int size = std::min((int)pendingSearches.size(), coalesceMaxBatch);
+    std::vector<PendingSearch*> batch(pendingSearches.begin(), pendingSearches.begin() + size);
+    pendingSearches.erase(pendingSearches.begin(), pendingSearches.begin() + size);
+    for(int i = 0; i < batch.size(); i++) batch.at(i)->taken = true;
+    coalesceLeader = false;
+    coalesceCv.notify_all(); // any queries left over can start gathering the next search
+    if(batch.empty()) continue;
+    lock.unlock();
 
-  // Get query keypoints and descriptors, converting to rootSIFT
-  std::vector<KeyPoint> queryKeypoints;
-  Mat queryDescriptors;
-  getKeypointsAndDescriptors(queryImage, queryKeypoints, queryDescriptors, detector);
-  rootSIFT(queryDescriptors);
+    std::chrono::steady_clock::time_point searchStart = std::chrono::steady_clock::now();
+    double waitMs = 0;
+    std::vector<QueryFeatures*> queries;
+    for(int i = 0; i < batch.size(); i++)
+    {
+      queries.push_back(batch.at(i)->query);
+      waitMs += std::chrono::duration<double, std::milli>(searchStart - batch.at(i)->queued).count();
+    }
+    std::vector<std::vector<DMatch> > batchMatches;
+    searchBigMatcher(queries, batchMatches);
+    {
+      std::lock_guard<std::mutex> statsLock(statsMutex);
+      stats.searches++;
+      stats.coalescedQueries += batch.size();
+      stats.coalesceWaitMs += waitMs;
+    }
+
+    lock.lock();
+    for(int i = 0; i < batch.size(); i++)
+    {
+      batch.at(i)->matches->swap(batchMatches.at(i));
+      batch.at(i)->done = true;
+    }
+    coalesceCv.notify_all();
+  }
+}
 
-  // Match query image against all SV images using bigmatcher
+// Stage 3: vote for viewpoints with the bigmatcher matches, verify the best of them against
+// the query, and triangulate the location from the distinct verified viewpoints
+bool Locator::verifyAndLocate(const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, const Deadline &deadline,
+  QueryFeatures &query, std::vector<DMatch> &matches, const std::vector<int> &shardVotes, LocateResult &result)
+{
 #ifdef PROFILE_LOCATE
   std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+  std::chrono::high_resolution_clock::time_point t2;
+  long long duration;
 #endif
-  std::vector<std::vector<DMatch> > knn_matches;
-  bigMatcher->knnMatch(queryDescriptors, knn_matches, 2);
-  std::vector<DMatch> matches;
-  loweFilter(knn_matches, matches);
-#ifdef PROFILE_LOCATE
-  std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>( t2 - t1 ).count();
-  std::cout << duration << ",";
-#endif
+  std::vector<KeyPoint> &queryKeypoints = query.keypoints;
+  Mat &queryDescriptors = query.descriptors;
+  Ptr<FeatureDetector> detector;
+  createDetector(detector, "SIFT");
+
   // Read the filenames_file to build a viewpoint table with each entry set to 0
   std::ifstream filenames_file;
   filenames_file.open(filenames_filename);
   if(!filenames_file.is_open())
   {
+    result.status = LOCATE_NO_VIEWPOINTS;
     return false;
   }
   std::string line;
   std::vector<Viewpoint> vpTable;
+  std::vector<std::string> ids;
   while(std::getline(filenames_file, line))
   {
     std::vector<std::string> line_parts = splitString(line.c_str(), ',');
     Viewpoint vp;
+    vp.segment = vpTable.size();
     vp.votes = 0;
+    vp.cluster = 0;
+    ids.push_back(line);
     vp.lat = line_parts.at(0);
     vp.lng = line_parts.at(1);
     vp.heading = line_parts.at(2);
@@ -115,23 +1048,76 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
     vpTable.push_back(vp);
   }
 
-  // Populate the vpTable; vote for each image which a match corresponds to
+  // Populate the vpTable with the votes summed by the shards if the search was scattered.
+  // Otherwise vote for each image which a match corresponds to, including every other
+  // view owning the matched descriptor if it was merged from several
+  for(int i = 0; i < shardVotes.size() && i < vpTable.size(); i++)
+  {
+    vpTable.at(i).votes = shardVotes.at(i);
+  }
   for(int i = 0; i < matches.size(); i++)
   {
     int index = matches.at(i).imgIdx;
-    for(int j = 0; j < vpTable.size(); j++)
+    if(index >= 0 && index < vpTable.size()) vpTable.at(index).votes++;
+    const int* extra;
+    int numExtra = owners.extraOwners(index, matches.at(i).trainIdx, extra);
+    for(int j = 0; j < numExtra; j++)
     {
-      if(index == j) {
-        vpTable.at(j).votes++;
-      }
+      if(extra[j] < vpTable.size()) vpTable.at(extra[j]).votes++;
+    }
+  }
+
+  // Assign each viewpoint its location cluster, as precomputed when the bigmatcher was built
+  const ViewpointClusters* vpClusters = &clusters;
+  ViewpointClusters derivedClusters;
+  if(clusters.size() != vpTable.size())
+  {
+    derivedClusters.build(ids);
+    vpClusters = &derivedClusters;
+  }
+  int numClusters = vpClusters->numClusters();
+  for(int i = 0; i < vpTable.size(); i++)
+  {
+    vpTable.at(i).cluster = vpClusters->clusterOf(i);
+  }
+
+  if(!params.candidates.empty())
+  {
+    // Only verify the given viewpoints, e.g. those verified for a session's last keyframe
+    std::set<std::string> wanted(params.candidates.begin(), params.candidates.end());
+    std::vector<Viewpoint> candidateTable;
+    for(int i = 0; i < vpTable.size(); i++)
+    {
+      if(wanted.count(ids.at(i))) candidateTable.push_back(vpTable.at(i));
     }
+    vpTable.swap(candidateTable);
+  }
+  else if(params.clusterShortlist)
+  {
+    // Rerank the best headings of the most voted locations rather than the most voted images
+    shortlistByCluster(vpTable, numClusters, params);
   }
 
   // Sort the vpTable with the highest-matched images at the top
   std::sort(vpTable.begin(), vpTable.end(), &vote_sorter);
 
-  // Take the top 30 of these highest-matched images
-  if(vpTable.size() > 50) vpTable.resize(50);
+  // Take the top rerankDepth of these highest-matched images
+  if(vpTable.size() > params.rerankDepth) vpTable.resize(params.rerankDepth);
+
+  // Out of time before any verification: the best estimate is the bigmatcher's top viewpoint
+  if(deadline.expired())
+  {
+    if(vpTable.size() == 0 || vpTable.at(0).votes == 0)
+    {
+      result.status = LOCATE_TIMEOUT;
+      return false;
+    }
+    result.lat = stod(vpTable.at(0).lat);
+    result.lng = stod(vpTable.at(0).lng);
+    result.skipped = vpTable.size();
+    result.degraded = true;
+    return true;
+  }
 
 #ifdef PROFILE_LOCATE
   // Time prep vp table
@@ -140,65 +1126,166 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
   std::cout << duration << ",";
 #endif
 
-  // Read each of these top SV images afresh to perform a rigourous matching
+  // Index the query descriptors once, rather than once per candidate matched against them
+  Ptr<flann::Index> queryIndex;
+  if(queryDescriptors.rows >= 2) queryIndex = buildMatchIndex(queryDescriptors);
+
+  // Read each of these top SV images to perform a rigourous matching, unless its features
+  // are still cached from a recent request.
+  // Candidates are verified in vote order, one parallel batch at a time, stopping
+  // early once the leading viewpoint cannot be overturned by the remaining ones.
   std::string imgs_folder(_imgs_folder);
+  std::shared_ptr<ImageArchive> svArchive;
+  {
+    std::lock_guard<std::mutex> lock(archiveMutex);
+    svArchive = archive;
+  }
+  int batchSize = params.rerankBatchSize > 0 ? params.rerankBatchSize : omp_get_max_threads();
+  int processed = 0;
   bool abort = false; // flag for omp safe loop breakout if sv image cant be read
-  #pragma omp parallel for
-  for(int i = 0; i < vpTable.size(); i++)
+  bool timedOut = false; // flag for omp safe loop breakout once the budget runs out
+  while(processed < vpTable.size() && !abort && !timedOut)
   {
-    #pragma omp flush (abort)
-    if (!abort) {
-      // Read image
-      Mat svImage = imread(imgs_folder + vpTable.at(i).lat + "," + vpTable.at(i).lng + "," + vpTable.at(i).heading + "," + vpTable.at(i).pitch + ".jpg");
-      if(svImage.data == NULL)
+    int batchEnd = std::min((int)vpTable.size(), processed + batchSize);
+    std::vector<char> verified(batchEnd - processed, false);
+    #pragma omp parallel for schedule(dynamic)
+    for(int i = processed; i < batchEnd; i++)
+    {
+      #pragma omp flush (abort, timedOut)
+      if(!timedOut && deadline.expired())
       {
-        printf("Unable to load SV image!\n");
-        // set omp flag and sync across threads
-        abort = true;
-        #pragma omp flush (abort)
+        // cancel the remaining iterations cooperatively
+        timedOut = true;
+        #pragma omp flush (timedOut)
       }
-      // Get query keypoints and descriptors
-      std::vector<KeyPoint> svKeypoints;
-      Mat svDescriptors;
-      getKeypointsAndDescriptors(svImage, svKeypoints, svDescriptors, detector);
-      rootSIFT(svDescriptors);
-      vpTable.at(i).image = svImage;
-      vpTable.at(i).keypoints = svKeypoints;
-      vpTable.at(i).descriptors = svDescriptors;
-
-      // Match the SV image against the query, applying lowe + geometric filters
-      matches.clear();
-      getFilteredMatches(svImage, svKeypoints, svDescriptors, queryKeypoints, queryDescriptors, matches);
-
-      // update the votes for this image to be the number of "rigourous" matches
-      vpTable.at(i).votes = matches.size();
+      if (!abort && !timedOut) {
+        std::string id = vpTable.at(i).lat + "," + vpTable.at(i).lng + "," + vpTable.at(i).heading + "," + vpTable.at(i).pitch;
+        std::shared_ptr<const ViewpointFeatures> features = viewpointCache.find(id);
+        if(!features)
+        {
+          std::shared_ptr<ViewpointFeatures> extracted;
+          if(shards.owns(vpTable.at(i).segment))
+          {
+            // The bigmatcher is sharded: fetch the SV keypoints and descriptors from the shard
+            // owning the viewpoint, or drop the viewpoint rather than the request if it fails
+            extracted = shards.fetchFeatures(vpTable.at(i).segment, id, deadline.remainingMs());
+            if(!extracted)
+            {
+              vpTable.at(i).votes = 0;
+              verified.at(i - processed) = true;
+              continue;
+            }
+          }
+          else
+          {
+            // Read image, from the archive if it holds it, otherwise from its own file
+            Mat svImage = svArchive && svArchive->contains(id) ? svArchive->read(id) : imread(imgs_folder + id + ".jpg");
+            if(svImage.data == NULL)
+            {
+              printf("Unable to load SV image!\n");
+              // set omp flag and sync across threads
+              abort = true;
+              #pragma omp flush (abort)
+              continue;
+            }
+            // Get SV keypoints and descriptors
+            extracted = std::make_shared<ViewpointFeatures>();
+            extracted->image = svImage;
+            getKeypointsAndDescriptors(svImage, extracted->keypoints, extracted->descriptors, detector);
+            rootSIFT(extracted->descriptors);
+          }
+          // Index them for the triangulation
+          if(extracted->descriptors.rows >= 2) extracted->index = buildMatchIndex(extracted->descriptors);
+          extracted->bytes = viewpointFeaturesBytes(*extracted);
+          viewpointCache.insert(id, extracted);
+          features = extracted;
+        }
+        vpTable.at(i).image = features->image;
+        vpTable.at(i).keypoints = features->keypoints;
+        vpTable.at(i).descriptors = features->descriptors;
+        vpTable.at(i).index = features->index;
 
-      // Write match images to disk
-      //Mat img_matches;
-      //std::stringstream ss;
-      //ss << "matches" << i << ".jpg";
-      //drawMatches(svImage, svKeypoints, queryImage, queryKeypoints, matches, img_matches);
-      //imwrite(ss.str(), img_matches);
+        // Match the SV image against the query, applying lowe + geometric filters
+        std::vector<DMatch> svMatches;
+        if(!queryIndex.empty())
+        {
+          getFilteredMatches(vpTable.at(i).image, vpTable.at(i).keypoints, vpTable.at(i).descriptors, queryKeypoints, queryDescriptors,
+            *queryIndex, svMatches);
+        }
+
+        // update the votes for this image to be the number of "rigourous" matches
+        vpTable.at(i).votes = svMatches.size();
+        verified.at(i - processed) = true;
+
+        // Write match images to disk
+        //Mat img_matches;
+        //std::stringstream ss;
+        //ss << "matches" << i << ".jpg";
+        //drawMatches(svImage, svKeypoints, queryImage, queryKeypoints, svMatches, img_matches);
+        //imwrite(ss.str(), img_matches);
+      }
+    }
+
+    // Keep the verified prefix; a batch cut short by the deadline keeps only its verified entries
+    if(timedOut)
+    {
+      std::vector<Viewpoint> batch;
+      for(int i = processed; i < batchEnd; i++)
+      {
+        if(verified.at(i - processed)) batch.push_back(vpTable.at(i));
+      }
+      std::vector<Viewpoint> rest(vpTable.begin() + batchEnd, vpTable.end());
+      vpTable.resize(processed);
+      vpTable.insert(vpTable.end(), batch.begin(), batch.end());
+      processed = vpTable.size();
+      vpTable.insert(vpTable.end(), rest.begin(), rest.end());
+      break;
+    }
+    processed = batchEnd;
+
+    if(params.earlyStop && canStopRerank(vpTable, processed, params))
+    {
+      break;
+    }
+    if(deadline.expired())
+    {
+      timedOut = true;
     }
   }
+  // Drop the candidates which were never verified
+  result.reranked = processed;
+  result.skipped = vpTable.size() - processed;
+  vpTable.resize(processed);
+
   // An SV image couldn't be read, so we cannot locate
   if(abort)
   {
+    result.status = LOCATE_SV_UNREADABLE;
     return false;
   }
 
   // Sort the vpTable again according to these new votes
   std::sort(vpTable.begin(), vpTable.end(), &vote_sorter);
 
-  std::cout << vpTable.at(0).votes << std::endl;
+  if(vpTable.size() > 0) std::cout << vpTable.at(0).votes << std::endl;
 
   // If best SV image only has 15 matches with query, probably spurious,
   // so we cannot locate.
-  if(vpTable.at(0).votes < 15)
+  if(vpTable.size() == 0 || vpTable.at(0).votes < 15)
   {
+    result.status = timedOut ? LOCATE_TIMEOUT : LOCATE_NO_MATCH;
     return false;
   }
 
+  // Out of time during the rerank: use the best verified viewpoint as the prediction
+  if(timedOut || deadline.expired())
+  {
+    result.lat = stod(vpTable.at(0).lat);
+    result.lng = stod(vpTable.at(0).lng);
+    result.degraded = true;
+    return true;
+  }
+
 #ifdef PROFILE_LOCATE
   // Time prep rigourous match
   t2 = std::chrono::high_resolution_clock::now();
@@ -206,35 +1293,19 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
   std::cout << duration << ",";
 #endif
 
-  // Keep only the best viewpoint from each lat-lng to ensure distinct views
-  std::vector<int> distinctViewIdxs;
-  for(int i = 0; i < vpTable.size(); i++)
-  {
-    int maxIdx = i;
-    for(int j = 0; j < vpTable.size(); j++)
-    {
-      if(i != j)
-      {
-        if( vpTable.at(j).lat.compare(vpTable.at(maxIdx).lat) == 0 &&
-            vpTable.at(j).lng.compare(vpTable.at(maxIdx).lng) == 0 &&
-            vpTable.at(j).votes > vpTable.at(maxIdx).votes )
-        {
-          maxIdx = j;
-        }
-      }
-    }
-    if(std::find(distinctViewIdxs.begin(), distinctViewIdxs.end(), maxIdx) == distinctViewIdxs.end()) {
-      distinctViewIdxs.push_back(maxIdx);
-    }
-  }
+  // Keep only the best viewpoint from each location cluster to ensure distinct views.
+  // The table is sorted by votes, so the first viewpoint of each cluster is its best.
   // Keep the distinct views which have at least 9 matches with the
   // query image (otherwise likely to be superfluous)
+  std::vector<char> seenCluster(numClusters, 0);
   std::vector<Viewpoint> distinctVpTable;
-  for(int j = 0; j < distinctViewIdxs.size(); j++)
+  for(int i = 0; i < vpTable.size(); i++)
   {
-    if(vpTable.at(distinctViewIdxs.at(j)).votes >= 9)
+    if(seenCluster.at(vpTable.at(i).cluster)) continue;
+    seenCluster.at(vpTable.at(i).cluster) = 1;
+    if(vpTable.at(i).votes >= 9)
     {
-      distinctVpTable.push_back(vpTable.at(distinctViewIdxs.at(j)));
+      distinctVpTable.push_back(vpTable.at(i));
     }
   }
   vpTable = distinctVpTable;
@@ -242,14 +1313,19 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
   // If there are no distinct views with sufficient matches, we fail to locate the query
   if(vpTable.size() == 0)
   {
+    result.status = LOCATE_NO_MATCH;
     return false;
   }
+  for(int i = 0; i < vpTable.size(); i++)
+  {
+    result.viewpoints.push_back(vpTable.at(i).lat + "," + vpTable.at(i).lng + "," + vpTable.at(i).heading + "," + vpTable.at(i).pitch);
+  }
 
   // If there's only one distinct viewpoint, use the viewpoint location as the prediction
   if(vpTable.size() == 1)
   {
-    lat = stod(vpTable.at(0).lat);
-    lng = stod(vpTable.at(0).lng);
+    result.lat = stod(vpTable.at(0).lat);
+    result.lng = stod(vpTable.at(0).lng);
     return true;
   }
 
@@ -257,15 +1333,26 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
   std::vector<Viewpoint> v1s;
   std::vector<Viewpoint> v2s;
   std::vector<std::vector<DMatch> > matchesVector;
-  for(int i = 0; i < vpTable.size(); i++)
+  for(int i = 0; i < vpTable.size() && !timedOut; i++)
   {
     #pragma omp parallel for shared(v1s, v2s, matchesVector)
     for(int j = i + 1; j < vpTable.size(); j++)
     {
+      #pragma omp flush (timedOut)
+      if(timedOut || deadline.expired())
+      {
+        // cancel the remaining pairs cooperatively
+        timedOut = true;
+        #pragma omp flush (timedOut)
+        continue;
+      }
       std::vector<DMatch> vmatches;
       Viewpoint v1 = vpTable.at(i);
       Viewpoint v2 = vpTable.at(j);
-      getFilteredMatches(v1.image, v1.keypoints, v1.descriptors, v2.keypoints, v2.descriptors, vmatches);
+      if(!v2.index.empty())
+      {
+        getFilteredMatches(v1.image, v1.keypoints, v1.descriptors, v2.keypoints, v2.descriptors, *v2.index, vmatches);
+      }
       std::vector<int> removeMatchIdxs;
       for(int m = 0; m < vmatches.size(); m++)
       {
@@ -290,6 +1377,15 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
     }
   }
 
+  // Out of time during triangulation: use the best distinct viewpoint as the prediction
+  if(timedOut)
+  {
+    result.lat = stod(vpTable.at(0).lat);
+    result.lng = stod(vpTable.at(0).lng);
+    result.degraded = true;
+    return true;
+  }
+
   // Write shortlisted viewpoints to disk for review
   for(int i = 0; i < vpTable.size(); i++)
   {
@@ -371,8 +1467,8 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
   // Therefore use the best viewpoint location as the prediction
   if(lats.size() == 0)
   {
-    lat = stod(distinctVpTable.at(0).lat);
-    lng = stod(distinctVpTable.at(0).lng);
+    result.lat = stod(distinctVpTable.at(0).lat);
+    result.lng = stod(distinctVpTable.at(0).lng);
     return true;
   }
 
@@ -383,8 +1479,8 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
   // If there's only one intersection, use this as the prediction
   if(lats.size() == 1)
   {
-    lat = mean_lat;
-    lng = mean_lng;
+    result.lat = mean_lat;
+    result.lng = mean_lng;
     return true;
   }
 
@@ -415,8 +1511,8 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
   // (Weight each intersection according to the number of matches
   // between its two viewpoints)
   double sum = 0;
-  lat = 0;
-  lng = 0;
+  result.lat = 0;
+  result.lng = 0;
   for(int i = 0; i < weights.size(); i++)
   {
     sum += weights.at(i);
@@ -424,8 +1520,8 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
   for(int i = 0; i < weights.size(); i++)
   {
     weights.at(i) /= sum;
-    lat += (weights.at(i) * lats.at(i));
-    lng += (weights.at(i) * lngs.at(i));
+    result.lat += (weights.at(i) * lats.at(i));
+    result.lng += (weights.at(i) * lngs.at(i));
   }
 
   #ifdef PROFILE_LOCATE
@@ -438,19 +1534,423 @@ bool Locator::locate(const char* img_filename, const char* _imgs_folder, const c
 }
 
 double Locator::getLat() {
-  return lat;
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.lat;
 }
 
 double Locator::getLng() {
-  return lng;
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.lng;
+}
+
+int Locator::getReranked() {
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.reranked;
+}
+
+int Locator::getSkipped() {
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.skipped;
+}
+
+bool Locator::isCached() {
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.cached;
+}
+
+bool Locator::isDegraded() {
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.degraded;
+}
+
+int Locator::getQueryKeypoints() {
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.queryKeypoints;
+}
+
+double Locator::getExtractMs() {
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.extractMs;
+}
+
+double Locator::getElapsedMs() {
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.elapsedMs;
+}
+
+LocateStatus Locator::getStatus() {
+  std::lock_guard<std::mutex> lock(lastMutex);
+  return last.status;
+}
+
+// A copy of the running statistics, for callers outside Python
+LocatorStats Locator::getCounters()
+{
+  std::lock_guard<std::mutex> lock(statsMutex);
+  return stats;
+}
+
+// Running statistics over every request served by this Locator. The time saved by the
+// pre-check is estimated as what the rejected requests would have cost on average had
+// they gone through the full pipeline, less what they did cost.
+dict Locator::getStats()
+{
+  std::lock_guard<std::mutex> lock(statsMutex);
+  dict d;
+  d["requests"] = stats.requests;
+  d["located"] = stats.located;
+  d["degraded"] = stats.degraded;
+
+  dict rejected;
+  long precheckRejected = 0;
+  for(int s = 0; s < LOCATE_STATUS_COUNT; s++)
+  {
+    if(s == LOCATE_OK) continue;
+    rejected[locateStatusName((LocateStatus)s)] = stats.rejected.at(s);
+    if(isPrecheckReject((LocateStatus)s)) precheckRejected += stats.rejected.at(s);
+  }
+  d["rejected"] = rejected;
+  d["precheckRejected"] = precheckRejected;
+  d["precheckRejectedMs"] = stats.rejectedMs;
+
+  double meanFullPipelineMs = stats.fullPipelines > 0 ? stats.fullPipelineMs / stats.fullPipelines : 0;
+  d["meanFullPipelineMs"] = meanFullPipelineMs;
+  d["precheckSavedMs"] = std::max(0.0, precheckRejected * meanFullPipelineMs - stats.rejectedMs);
+
+  d["coalescedSearches"] = stats.searches;
+  d["meanSearchBatch"] = stats.searches > 0 ? (double)stats.coalescedQueries / stats.searches : 0.0;
+  d["meanCoalesceWaitMs"] = stats.coalescedQueries > 0 ? stats.coalesceWaitMs / stats.coalescedQueries : 0.0;
+
+  // A hash hit only counts as a hit once the query is verified against its viewpoints
+  long cacheHits = cache.getHits();
+  long cacheHashHits = cache.getHashHits();
+  long cacheLookups = cacheHashHits + cache.getMisses();
+  d["cacheHits"] = cacheHits;
+  d["cacheHashHits"] = cacheHashHits;
+  d["cacheLookups"] = cacheLookups;
+  d["cacheHitRate"] = cacheLookups > 0 ? (double)cacheHits / cacheLookups : 0.0;
+  d["cacheSize"] = cache.size();
+
+  long viewpointHits = viewpointCache.getHits();
+  long viewpointLookups = viewpointHits + viewpointCache.getMisses();
+  d["viewpointCacheHits"] = viewpointHits;
+  d["viewpointCacheLookups"] = viewpointLookups;
+  d["viewpointCacheHitRate"] = viewpointLookups > 0 ? (double)viewpointHits / viewpointLookups : 0.0;
+  d["viewpointCacheSize"] = viewpointCache.size();
+  d["viewpointCacheMB"] = viewpointCache.bytes() / (1024.0 * 1024.0);
+
+  d["readyMs"] = readyMs;
+
+  if(shards.isEnabled())
+  {
+    list shardStats;
+    std::vector<ShardStats> perShard = shards.getStats();
+    for(int s = 0; s < perShard.size(); s++)
+    {
+      const ShardStats &shard = perShard.at(s);
+      long answered = shard.requests - shard.failures - shard.stragglers;
+      dict sd;
+      sd["path"] = shard.path;
+      sd["requests"] = shard.requests;
+      sd["failures"] = shard.failures;
+      sd["stragglers"] = shard.stragglers;
+      sd["skipped"] = shard.skipped;
+      sd["meanMs"] = answered > 0 ? shard.totalMs / answered : 0.0;
+      sd["maxMs"] = shard.maxMs;
+      shardStats.append(sd);
+    }
+    d["shards"] = shardStats;
+  }
+
+  if(regionalIndex.isLoaded())
+  {
+    RegionStats regions = regionalIndex.getStats();
+    d["regions"] = regions.regions;
+    d["regionsResident"] = regions.resident;
+    d["regionsResidentMB"] = regions.residentBytes / (1024.0 * 1024.0);
+    d["regionHits"] = regions.hits;
+    d["regionLoads"] = regions.loads;
+    d["regionPrefetches"] = regions.prefetches;
+    d["regionEvictions"] = regions.evictions;
+    d["regionsFailed"] = regions.failed;
+  }
+  return d;
+}
+
+const char* locateStatusName(LocateStatus status)
+{
+  switch(status)
+  {
+    case LOCATE_OK: return "ok";
+    case LOCATE_UNREADABLE: return "unreadable";
+    case LOCATE_BLURRY: return "blurry";
+    case LOCATE_UNTEXTURED: return "untextured";
+    case LOCATE_LOW_CONTRAST: return "low_contrast";
+    case LOCATE_TIMEOUT: return "timeout";
+    case LOCATE_NO_VIEWPOINTS: return "no_viewpoints";
+    case LOCATE_SV_UNREADABLE: return "sv_unreadable";
+    case LOCATE_NO_MATCH: return "no_match";
+    case LOCATE_OVERLOADED: return "overloaded";
+    default: return "unknown";
+  }
+}
+
+LocateSession::LocateSession(Locator &_locator, const char* _imgs_folder, const char* _filenames_filename)
+  : locator(_locator), imgsFolder(_imgs_folder), filenamesFilename(_filenames_filename)
+{
+  keyframeInterval = 30;
+  minTrackedFraction = 0.5;
+  maxTrackPoints = 400;
+  frames = 0;
+  keyframes = 0;
+  fullSearches = 0;
+  reset();
+}
+
+void LocateSession::setParams(const LocateParams &_params)
+{
+  params = _params;
+}
+
+// Locate a new keyframe at least every keyframeInterval frames, or sooner once fewer than
+// minTrackedFraction of the maxTrackPoints corners taken from the keyframe are still tracked
+void LocateSession::setTracking(int _keyframeInterval, double _minTrackedFraction, int _maxTrackPoints)
+{
+  keyframeInterval = std::max(1, _keyframeInterval);
+  minTrackedFraction = _minTrackedFraction;
+  maxTrackPoints = std::max(8, _maxTrackPoints);
+}
+
+// Forget the current keyframe, so the next frame is located from scratch
+void LocateSession::reset()
+{
+  hasKeyframe = false;
+  keyframe = LocateResult();
+  prevGray.release();
+  keyframePoints.clear();
+  prevPoints.clear();
+  initialPoints = 0;
+  sinceKeyframe = 0;
+  lastWasKeyframe = false;
+  trackedFraction = 0;
+  status = LOCATE_OK;
+}
+
+// Locate the next frame of the sequence
+bool LocateSession::track(const char* frame_filename)
+{
+  frames++;
+  Mat frame = imread(frame_filename);
+  if(frame.data == NULL)
+  {
+    status = LOCATE_UNREADABLE;
+    return false;
+  }
+  Mat gray;
+  cvtColor(frame, gray, COLOR_BGR2GRAY);
+
+  // Follow the keyframe's points from the previous frame into this one
+  if(hasKeyframe && sinceKeyframe < keyframeInterval && prevPoints.size() > 0)
+  {
+    std::vector<Point2f> nextPoints;
+    std::vector<uchar> found;
+    std::vector<float> err;
+    calcOpticalFlowPyrLK(prevGray, gray, prevPoints, nextPoints, found, err);
+    std::vector<Point2f> tracked;
+    std::vector<Point2f> trackedKeyframe;
+    for(int i = 0; i < found.size(); i++)
+    {
+      if(!found.at(i)) continue;
+      tracked.push_back(nextPoints.at(i));
+      trackedKeyframe.push_back(keyframePoints.at(i));
+    }
+
+    // Only count the points still moving consistently with the keyframe view
+    std::vector<Point2f> inliers;
+    std::vector<Point2f> inliersKeyframe;
+    if(tracked.size() >= 8)
+    {
+      std::vector<uchar> mask;
+      Mat homography = findHomography(trackedKeyframe, tracked, CV_RANSAC, 3, mask);
+      for(int i = 0; !homography.empty() && i < mask.size(); i++)
+      {
+        if(!mask.at(i)) continue;
+        inliers.push_back(tracked.at(i));
+        inliersKeyframe.push_back(trackedKeyframe.at(i));
+      }
+    }
+    trackedFraction = (double)inliers.size() / initialPoints;
+    if(trackedFraction >= minTrackedFraction)
+    {
+      prevGray = gray;
+      prevPoints.swap(inliers);
+      keyframePoints.swap(inliersKeyframe);
+      sinceKeyframe++;
+      lastWasKeyframe = false;
+      status = LOCATE_OK;
+      return true;
+    }
+  }
+  return locateKeyframe(frame_filename, gray);
+}
+
+// Locate a frame through the Locator and start tracking from it. After tracking is lost,
+// the viewpoints verified for the last keyframe are tried first, as the camera is most
+// likely still looking at the same thing; only if that fails is the bigmatcher searched.
+bool LocateSession::locateKeyframe(const char* frame_filename, const Mat &gray)
+{
+  keyframes++;
+  lastWasKeyframe = true;
+  LocateResult result;
+  bool located = false;
+  if(hasKeyframe && keyframe.viewpoints.size() > 0)
+  {
+    LocateParams reuse = params;
+    reuse.candidates = keyframe.viewpoints;
+    reuse.earlyStop = false;  // there are no bigmatcher votes to bound the rest by
+    located = locator.locate(frame_filename, imgsFolder.c_str(), filenamesFilename.c_str(), reuse, result);
+  }
+  if(!located)
+  {
+    fullSearches++;
+    result = LocateResult();
+    located = locator.locate(frame_filename, imgsFolder.c_str(), filenamesFilename.c_str(), params, result);
+  }
+  status = result.status;
+  sinceKeyframe = 0;
+  if(!located)
+  {
+    reset();
+    status = result.status;
+    lastWasKeyframe = true;
+    return false;
+  }
+
+  hasKeyframe = true;
+  keyframe = result;
+  prevGray = gray;
+  goodFeaturesToTrack(gray, prevPoints, maxTrackPoints, 0.01, 8);
+  keyframePoints = prevPoints;
+  initialPoints = std::max(1, (int)prevPoints.size());
+  trackedFraction = 1.0;
+  return true;
+}
+
+double LocateSession::getLat() {
+  return keyframe.lat;
+}
+
+double LocateSession::getLng() {
+  return keyframe.lng;
+}
+
+// Whether the last frame was located through the Locator rather than tracked
+bool LocateSession::isKeyframe() {
+  return lastWasKeyframe;
+}
+
+double LocateSession::getTrackedFraction() {
+  return trackedFraction;
+}
+
+LocateStatus LocateSession::getStatus() {
+  return status;
+}
+
+int LocateSession::getFrames() {
+  return frames;
+}
+
+int LocateSession::getKeyframes() {
+  return keyframes;
+}
+
+// Keyframes which needed a search of the bigmatcher, rather than reusing viewpoints
+int LocateSession::getFullSearches() {
+  return fullSearches;
 }
 
 // Python Wrapper
 BOOST_PYTHON_MODULE(locator)
 {
-  class_<Locator>("Locator", init<>())
-    .def("locate", &Locator::locate)
+  enum_<LocateStatus>("LocateStatus")
+    .value("OK", LOCATE_OK)
+    .value("UNREADABLE", LOCATE_UNREADABLE)
+    .value("BLURRY", LOCATE_BLURRY)
+    .value("UNTEXTURED", LOCATE_UNTEXTURED)
+    .value("LOW_CONTRAST", LOCATE_LOW_CONTRAST)
+    .value("TIMEOUT", LOCATE_TIMEOUT)
+    .value("NO_VIEWPOINTS", LOCATE_NO_VIEWPOINTS)
+    .value("SV_UNREADABLE", LOCATE_SV_UNREADABLE)
+    .value("NO_MATCH", LOCATE_NO_MATCH)
+    .value("OVERLOADED", LOCATE_OVERLOADED)
+  ;
+
+  class_<LocateParams>("LocateParams", init<>())
+    .def_readwrite("rerankDepth", &LocateParams::rerankDepth)
+    .def_readwrite("rerankBatchSize", &LocateParams::rerankBatchSize)
+    .def_readwrite("earlyStop", &LocateParams::earlyStop)
+    .def_readwrite("earlyStopMinInliers", &LocateParams::earlyStopMinInliers)
+    .def_readwrite("earlyStopMinViews", &LocateParams::earlyStopMinViews)
+    .def_readwrite("earlyStopVoteScale", &LocateParams::earlyStopVoteScale)
+    .def_readwrite("budgetMs", &LocateParams::budgetMs)
+    .def_readwrite("keypointsPerMegapixel", &LocateParams::keypointsPerMegapixel)
+    .def_readwrite("minKeypoints", &LocateParams::minKeypoints)
+    .def_readwrite("maxKeypoints", &LocateParams::maxKeypoints)
+    .def_readwrite("loadAdaptive", &LocateParams::loadAdaptive)
+    .def_readwrite("precheck", &LocateParams::precheck)
+    .def_readwrite("minSharpness", &LocateParams::minSharpness)
+    .def_readwrite("minQueryKeypoints", &LocateParams::minQueryKeypoints)
+    .def_readwrite("strongResponse", &LocateParams::strongResponse)
+    .def_readwrite("minStrongKeypoints", &LocateParams::minStrongKeypoints)
+    .def_readwrite("clusterShortlist", &LocateParams::clusterShortlist)
+    .def_readwrite("shortlistClusters", &LocateParams::shortlistClusters)
+    .def_readwrite("headingsPerCluster", &LocateParams::headingsPerCluster)
+    .def_readwrite("useCache", &LocateParams::useCache)
+    .def_readwrite("hintLat", &LocateParams::hintLat)
+    .def_readwrite("hintLng", &LocateParams::hintLng)
+    .def_readwrite("hintRadius", &LocateParams::hintRadius)
+  ;
+
+  class_<Locator, boost::noncopyable>("Locator", init<>())
+    .def(init<bool>())
+    .def("locate", (bool (Locator::*)(const char*, const char*, const char*))&Locator::pyLocate)
+    .def("locate", (bool (Locator::*)(const char*, const char*, const char*, const LocateParams&))&Locator::pyLocate)
+    .def("locateResult", &Locator::pyLocateResult)
+    .def("locateBatch", (list (Locator::*)(list, const char*, const char*, const LocateParams&))&Locator::locateBatch)
     .def("getLat", &Locator::getLat)
     .def("getLng", &Locator::getLng)
+    .def("getReranked", &Locator::getReranked)
+    .def("getSkipped", &Locator::getSkipped)
+    .def("isDegraded", &Locator::isDegraded)
+    .def("isCached", &Locator::isCached)
+    .def("getQueryKeypoints", &Locator::getQueryKeypoints)
+    .def("getExtractMs", &Locator::getExtractMs)
+    .def("getElapsedMs", &Locator::getElapsedMs)
+    .def("getStatus", &Locator::getStatus)
+    .def("getStats", &Locator::getStats)
+    .def("openArchive", &Locator::openArchive)
+    .def("setCoalescing", &Locator::setCoalescing)
+    .def("setCache", &Locator::setCache)
+    .def("setViewpointCache", &Locator::setViewpointCache)
+    .def("setRegionBudget", &Locator::setRegionBudget)
+    .def("setShards", &Locator::pySetShards)
+    .def("clearCache", &Locator::clearCache)
+  ;
+
+  // The session keeps a reference to its Locator, so the Locator must outlive it
+  class_<LocateSession, boost::noncopyable>("LocateSession", init<Locator&, const char*, const char*>()[with_custodian_and_ward<1, 2>()])
+    .def("setParams", &LocateSession::setParams)
+    .def("setTracking", &LocateSession::setTracking)
+    .def("track", &LocateSession::track)
+    .def("reset", &LocateSession::reset)
+    .def("getLat", &LocateSession::getLat)
+    .def("getLng", &LocateSession::getLng)
+    .def("isKeyframe", &LocateSession::isKeyframe)
+    .def("getTrackedFraction", &LocateSession::getTrackedFraction)
+    .def("getStatus", &LocateSession::getStatus)
+    .def("getFrames", &LocateSession::getFrames)
+    .def("getKeyframes", &LocateSession::getKeyframes)
+    .def("getFullSearches", &LocateSession::getFullSearches)
   ;
 }
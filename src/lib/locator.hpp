@@ -3,8 +3,19 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/xfeatures2d.hpp>
 #include <opencv2/features2d.hpp>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 #include "engine.hpp"
 #include "saveable_matcher.hpp"
+#include "image_archive.hpp"
+#include "mapped_index.hpp"
+#include "query_cache.hpp"
+#include "viewpoint_cache.hpp"
+#include "regional_index.hpp"
+#include "shard_set.hpp"
+#include "viewpoint_owners.hpp"
+#include "viewpoint_clusters.hpp"
 
 #include <boost/python.hpp>
 
@@ -12,18 +23,254 @@ using namespace cv;
 using namespace boost::python;
 
 
+// Outcome of a locate request; anything other than LOCATE_OK is the reason it failed
+enum LocateStatus
+{
+  LOCATE_OK,
+  LOCATE_UNREADABLE,      // query image could not be read
+  LOCATE_BLURRY,          // pre-check: query too blurry
+  LOCATE_UNTEXTURED,      // pre-check: too few query keypoints
+  LOCATE_LOW_CONTRAST,    // pre-check: too few strong query keypoints
+  LOCATE_TIMEOUT,         // latency budget ran out before any estimate
+  LOCATE_NO_VIEWPOINTS,   // viewpoint table could not be read
+  LOCATE_SV_UNREADABLE,   // a shortlisted SV image could not be read
+  LOCATE_NO_MATCH,        // not enough verified matches with any viewpoint
+  LOCATE_OVERLOADED,      // refused by the locate daemon's admission control
+  LOCATE_STATUS_COUNT
+};
+const char* locateStatusName(LocateStatus status);
+
+// Tuning parameters for a single locate request
+struct LocateParams
+{
+  LocateParams();
+
+  int rerankDepth;            // max number of bigmatcher candidates to rerank
+  int rerankBatchSize;        // candidates verified in parallel per batch (0 = one per thread)
+  bool earlyStop;             // stop reranking once the leading location cluster cannot be overturned
+  int earlyStopMinInliers;    // verified matches the leading cluster needs in total before stopping
+  int earlyStopMinViews;      // distinct clusters with a view of >= 9 verified matches needed before stopping
+  double earlyStopVoteScale;  // assumed upper bound of verified matches per bigmatcher vote
+  int budgetMs;               // latency budget for the whole request (0 = unlimited)
+  int keypointsPerMegapixel;  // query keypoint budget density (0 = keep every keypoint)
+  int minKeypoints;           // floor of the query keypoint budget
+  int maxKeypoints;           // ceiling of the query keypoint budget
+  bool loadAdaptive;          // shrink the query keypoint budget when the server is overloaded
+  bool precheck;              // reject blurry or untextured queries before any matching
+  double minSharpness;        // min variance of the query's Laplacian
+  int minQueryKeypoints;      // min keypoints detected in the query
+  double strongResponse;      // detector response of a "strong" keypoint
+  int minStrongKeypoints;     // min strong keypoints detected in the query
+  bool clusterShortlist;      // shortlist by location cluster votes instead of per image votes
+  int shortlistClusters;      // location clusters shortlisted for the rerank
+  int headingsPerCluster;     // best viewpoints reranked per shortlisted cluster
+  bool useCache;              // answer from the result cache when the query was located recently
+  double hintLat;             // approximate location of the query, e.g. from the phone's GPS,
+  double hintLng;             //   used to pick the regions of a regional bigmatcher to search
+  double hintRadius;          // metres around the hint to search (0 = no hint, search every region)
+  std::vector<std::string> candidates;  // if set, verify only these viewpoint ids, skipping the bigmatcher
+};
+
+// Outcome of a single locate request
+struct LocateResult
+{
+  LocateResult();
+
+  LocateStatus status;
+  double lat;
+  double lng;
+  int reranked;   // candidates which were re-extracted and verified
+  int skipped;    // candidates not verified due to early termination or the deadline
+  bool degraded;  // the budget ran out and lat-lng is the best estimate found in time
+  int keypointBudget;   // query keypoint budget applied (0 = unlimited)
+  int queryKeypoints;   // query keypoints kept
+  double extractMs;     // time spent extracting query features
+  double elapsedMs;     // time spent on the whole request
+  double sharpness;     // variance of the query's Laplacian
+  std::vector<std::string> viewpoints;  // ids of the distinct verified viewpoints the location came from
+  bool cached;          // answered from the result cache rather than the pipeline
+  int shardsMissed;     // shards which failed or straggled, so their votes are missing
+};
+
+// Keypoints and rootSIFT descriptors extracted from a query
+struct QueryFeatures
+{
+  std::vector<KeyPoint> keypoints;
+  Mat descriptors;
+};
+
+// Running totals over every request a Locator has served
+struct LocatorStats
+{
+  LocatorStats();
+
+  long requests;
+  long located;
+  long degraded;
+  std::vector<long> rejected;   // failed requests, indexed by LocateStatus
+  double rejectedMs;            // time spent on requests rejected by the pre-check
+  long fullPipelines;           // requests which passed the pre-check
+  double fullPipelineMs;        // time spent on requests which passed the pre-check
+  long searches;                // bigmatcher searches run by the request coalescer
+  long coalescedQueries;        // queries answered by those searches
+  double coalesceWaitMs;        // time queries spent waiting for their search to start
+};
+
+// A query waiting in the request coalescer for its share of a combined bigmatcher search
+struct PendingSearch
+{
+  QueryFeatures* query;
+  std::vector<DMatch>* matches;
+  std::chrono::steady_clock::time_point queued;
+  bool taken;                   // gathered into a search, so no longer pending
+  bool done;
+};
+
+// Point in time by which a request's latency budget runs out
+class Deadline
+{
+public:
+  Deadline(int budgetMs);
+
+  bool expired() const;
+  int remainingMs() const;
+  void postpone(std::chrono::steady_clock::duration delay);
+
+protected:
+  bool unlimited;
+  std::chrono::steady_clock::time_point end;
+};
+
 class Locator
 {
 public:
   Locator();
+  Locator(bool loadBigMatcher);
 
   bool locate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename);
+  bool locate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params);
+  bool locate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, LocateResult &result);
+  bool locate(const std::vector<uchar> &encoded, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, LocateResult &result);
+  bool pyLocate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename);
+  bool pyLocate(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params);
+  dict pyLocateResult(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params);
+  list locateBatch(list queries, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params);
+  void locateBatch(std::vector<std::string> &paths, std::vector<std::vector<uchar> > &encoded, const char* _imgs_folder,
+    const char* filenames_filename, const LocateParams &params, std::vector<LocateResult> &results);
 
   double getLat();
   double getLng();
+  int getReranked();
+  int getSkipped();
+  bool isDegraded();
+  bool isCached();
+  int getQueryKeypoints();
+  double getExtractMs();
+  double getElapsedMs();
+  LocateStatus getStatus();
+  dict getStats();
+  LocatorStats getCounters();
+  bool openArchive(const char* path);
+  void setCoalescing(double windowMs, int maxBatch);
+  void setCache(int capacity, int maxDistance);
+  void setViewpointCache(int maxMB, int maxEntries);
+  void setRegionBudget(int maxMB);
+  void setShards(const std::vector<std::string> &paths, int timeoutMs, int topK);
+  void pySetShards(list paths, int timeoutMs, int topK);
+  void clearCache();
 
 protected:
-  Ptr<SaveableFlannBasedMatcher> bigMatcher;
-  double lat;
-  double lng;
+  bool runPipeline(const char* img_filename, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, LocateResult &result);
+  bool runStages(Mat &queryImage, const char* _imgs_folder, const char* filenames_filename, const LocateParams &params,
+    const Deadline &deadline, LocateResult &result);
+  bool extractQuery(Mat &queryImage, const LocateParams &params, const Deadline &deadline, LocateResult &result, QueryFeatures &query);
+  void searchBigMatcher(const Mat &queryDescriptors, std::vector<DMatch> &matches);
+  void bigMatcherKnn(const Mat &queryDescriptors, std::vector<std::vector<DMatch> > &knn_matches);
+  void searchRegions(const Mat &queryDescriptors, const LocateParams &params, std::vector<DMatch> &matches);
+  void searchShards(const Mat &queryDescriptors, const Deadline &deadline, std::vector<int> &votes, LocateResult &result);
+  void searchBigMatcher(std::vector<QueryFeatures*> &queries, std::vector<std::vector<DMatch> > &matches);
+  bool isCoalescing();
+  void coalescedSearch(QueryFeatures &query, std::vector<DMatch> &matches);
+  bool verifyAndLocate(const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, const Deadline &deadline,
+    QueryFeatures &query, std::vector<DMatch> &matches, const std::vector<int> &shardVotes, LocateResult &result);
+  void recordStats(const LocateResult &result, bool located);
+  bool cacheable(const LocateParams &params);
+  bool lookupCache(const Mat &queryImage, const LocateParams &params, unsigned long long &hash, CachedLocation &hit);
+  bool verifyCached(const char* _imgs_folder, const char* filenames_filename, const LocateParams &params, const Deadline &deadline,
+    QueryFeatures &query, const CachedLocation &hit, LocateResult &result);
+  void storeCache(unsigned long long hash, const LocateParams &params, const LocateResult &result, bool located);
+
+  Ptr<SaveableFlannBasedMatcher> bigMatcher;   // only loaded if there is no mapped index
+  MappedIndex mappedIndex;
+  RegionalIndex regionalIndex;  // used instead of the above if the bigmatcher was split into regions
+  ShardSet shards;              // used instead of any of the above if the search is scattered over shards
+  QueryCache cache;
+  ViewpointCache viewpointCache;
+  LocateResult last;            // result of the last locate, read by the getters
+  std::mutex lastMutex;         // guards last, which concurrent requests may write
+  LocatorStats stats;
+  std::mutex statsMutex;
+  std::shared_ptr<ImageArchive> archive;   // replaced whole by openArchive while requests read the old one
+  std::mutex archiveMutex;
+  ViewpointOwners owners;
+  ViewpointClusters clusters;
+
+  double coalesceWindowMs;      // how long a search waits for concurrent ones to join it (0 = off)
+  int coalesceMaxBatch;         // searches combined at most
+  std::mutex coalesceMutex;
+  std::condition_variable coalesceCv;
+  std::vector<PendingSearch*> pendingSearches;
+  bool coalesceLeader;          // a caller is gathering the next combined search
+
+  double readyMs;               // time the constructor took to load everything
+};
+
+// Locates consecutive frames of an image sequence or video. Only keyframes go through
+// the Locator; the frames in between follow the keyframe's points with optical flow and
+// reuse its location while enough of them are still tracked consistently.
+class LocateSession
+{
+public:
+  LocateSession(Locator &_locator, const char* _imgs_folder, const char* _filenames_filename);
+
+  void setParams(const LocateParams &_params);
+  void setTracking(int _keyframeInterval, double _minTrackedFraction, int _maxTrackPoints);
+  bool track(const char* frame_filename);
+  void reset();
+
+  double getLat();
+  double getLng();
+  bool isKeyframe();
+  double getTrackedFraction();
+  LocateStatus getStatus();
+  int getFrames();
+  int getKeyframes();
+  int getFullSearches();
+
+protected:
+  bool locateKeyframe(const char* frame_filename, const Mat &gray);
+
+  Locator &locator;
+  std::string imgsFolder;
+  std::string filenamesFilename;
+  LocateParams params;
+  int keyframeInterval;         // max frames tracked before locating a new keyframe
+  double minTrackedFraction;    // min fraction of the keyframe's points still tracked
+  int maxTrackPoints;           // corners tracked from each keyframe
+
+  bool hasKeyframe;
+  LocateResult keyframe;        // result of the last keyframe, reused by tracked frames
+  Mat prevGray;
+  std::vector<Point2f> keyframePoints;  // tracked points' positions in the keyframe
+  std::vector<Point2f> prevPoints;      // and in the previous frame
+  int initialPoints;
+  int sinceKeyframe;
+
+  bool lastWasKeyframe;
+  double trackedFraction;
+  LocateStatus status;
+  int frames;
+  int keyframes;
+  int fullSearches;
 };
+
@@ -0,0 +1,60 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mapped_file.hpp"
+
+MappedFile::MappedFile()
+{
+  start = NULL;
+  length = 0;
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+// Map the file at path, replacing any existing mapping
+bool MappedFile::open(const std::string &path)
+{
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    ::close(fd);
+    return false;
+  }
+  void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd); // the mapping keeps its own reference to the file
+  if(mapping == MAP_FAILED) return false;
+
+  start = (char*)mapping;
+  length = st.st_size;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if(start != NULL) munmap(start, length);
+  start = NULL;
+  length = 0;
+}
+
+bool MappedFile::isOpen() const
+{
+  return start != NULL;
+}
+
+const char* MappedFile::data() const
+{
+  return start;
+}
+
+size_t MappedFile::size() const
+{
+  return length;
+}
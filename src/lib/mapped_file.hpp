@@ -0,0 +1,32 @@
+/*  Read-only memory mapping of a whole file. The mapping is shared with any
+**  other process mapping the same file, and pages are read in on demand.
+*/
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+#include <stddef.h>
+
+class MappedFile
+{
+public:
+  MappedFile();
+  ~MappedFile();
+
+  bool open(const std::string &path);
+  void close();
+
+  bool isOpen() const;
+  const char* data() const;
+  size_t size() const;
+
+protected:
+  char* start;
+  size_t length;
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+};
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include "mapped_index.hpp"
+#include "content_index.hpp"
+
+static const int PAGE_ALIGN = 4096;
+static const int CHECKSUM_CHUNK = 16 * 1024 * 1024;
+static const int DEFAULT_TREES = 4;     // flann::KDTreeIndexParams()
+static const int DEFAULT_CHECKS = 32;   // flann::SearchParams()
+
+struct SnapshotSection
+{
+  char name[8];
+  unsigned long long offset;
+  unsigned long long size;
+  unsigned long long checksum;
+};
+
+struct SnapshotTrailer
+{
+  char magic[4];
+  int sections;
+  int chunkSize;
+  int reserved;
+  unsigned long long tableOffset;
+};
+
+MappedIndex::MappedIndex()
+{
+  checks = DEFAULT_CHECKS;
+}
+
+static long long fileSize(const std::string &path)
+{
+  std::ifstream in(path.c_str(), std::ios::in | std::ifstream::binary | std::ifstream::ate);
+  return in.is_open() ? (long long)in.tellg() : -1;
+}
+
+// Checksum every section of the file mapped at base, hashing the chunks of all of them in parallel
+static void checksumSections(const char* base, int chunkSize, const std::vector<SnapshotSection> &sections,
+  std::vector<unsigned long long> &checksums)
+{
+  std::vector<std::pair<int, unsigned long long> > chunks;   // section, offset within it
+  std::vector<int> firstChunk(sections.size() + 1, 0);
+  for(int s = 0; s < sections.size(); s++)
+  {
+    for(unsigned long long offset = 0; offset < sections.at(s).size; offset += chunkSize)
+    {
+      chunks.push_back(std::make_pair(s, offset));
+    }
+    firstChunk.at(s + 1) = chunks.size();
+  }
+  std::vector<unsigned long long> hashes(chunks.size());
+  #pragma omp parallel for schedule(dynamic)
+  for(int c = 0; c < chunks.size(); c++)
+  {
+    const SnapshotSection &section = sections.at(chunks.at(c).first);
+    size_t length = std::min((unsigned long long)chunkSize, section.size - chunks.at(c).second);
+    hashes.at(c) = contentHash((const uchar*)base + section.offset + chunks.at(c).second, length, "");
+  }
+  checksums.resize(sections.size());
+  for(int s = 0; s < sections.size(); s++)
+  {
+    int count = firstChunk.at(s + 1) - firstChunk.at(s);
+    checksums.at(s) = contentHash(count > 0 ? (const uchar*)&hashes.at(firstChunk.at(s)) : NULL, count * sizeof(unsigned long long), "");
+  }
+}
+
+static void addSection(std::vector<SnapshotSection> &sections, const char* name, unsigned long long offset, unsigned long long size)
+{
+  SnapshotSection section;
+  memset(&section, 0, sizeof(section));
+  strncpy(section.name, name, sizeof(section.name));
+  section.offset = offset;
+  section.size = size;
+  sections.push_back(section);
+}
+
+// Write the index and the descriptors it was built over, starts giving the first row of each
+// segment plus the total, as a snapshot at path. It is written to a temporary file renamed into
+// place, so processes mapping the old snapshot keep their view of it.
+bool MappedIndex::store(const std::string &path, const Mat &descriptors, const std::vector<long> &starts, flann::Index &index)
+{
+  std::string tmpPath = path + ".tmp";
+  index.save(tmpPath.c_str());
+  long long indexBytes = fileSize(tmpPath);
+  if(indexBytes <= 0) return false;
+
+  std::vector<SnapshotSection> sections;
+  addSection(sections, "index", 0, indexBytes);
+  std::ofstream out(tmpPath.c_str(), std::ios::out | std::ios::app | std::ofstream::binary);
+  if(!out.is_open()) return false;
+  unsigned long long offset = (indexBytes + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+  std::vector<char> padding(offset - indexBytes, 0);
+  if(padding.size() > 0) out.write(&padding[0], padding.size());
+
+  addSection(sections, "descs", offset, (unsigned long long)descriptors.rows * descriptors.cols * sizeof(float));
+  for(int row = 0; row < descriptors.rows; row++)
+  {
+    out.write(reinterpret_cast<const char*>(descriptors.ptr<float>(row)), descriptors.cols * sizeof(float));
+  }
+  offset += sections.back().size;
+
+  std::vector<int> rowStarts(starts.begin(), starts.end());
+  addSection(sections, "starts", offset, rowStarts.size() * sizeof(int));
+  out.write(reinterpret_cast<const char*>(&rowStarts[0]), rowStarts.size() * sizeof(int));
+  offset += sections.back().size;
+
+  std::stringstream params;
+  params << "rows " << descriptors.rows << "\ncols " << descriptors.cols << "\nsegments " << (int)starts.size() - 1
+    << "\ntrees " << DEFAULT_TREES << "\nchecks " << DEFAULT_CHECKS << "\n";
+  addSection(sections, "params", offset, params.str().size());
+  out << params.str();
+  offset += sections.back().size;
+  out.close();
+  if(!out.good())
+  {
+    remove(tmpPath.c_str());
+    return false;
+  }
+
+  // Checksum what was actually written, then append the section table
+  MappedFile written;
+  if(!written.open(tmpPath) || written.size() != offset)
+  {
+    remove(tmpPath.c_str());
+    return false;
+  }
+  std::vector<unsigned long long> checksums;
+  checksumSections(written.data(), CHECKSUM_CHUNK, sections, checksums);
+  written.close();
+  for(int s = 0; s < sections.size(); s++)
+  {
+    sections.at(s).checksum = checksums.at(s);
+  }
+  SnapshotTrailer trailer;
+  memset(&trailer, 0, sizeof(trailer));
+  memcpy(trailer.magic, "SVB1", 4);
+  trailer.sections = sections.size();
+  trailer.chunkSize = CHECKSUM_CHUNK;
+  trailer.tableOffset = offset;
+  out.open(tmpPath.c_str(), std::ios::out | std::ios::app | std::ofstream::binary);
+  out.write(reinterpret_cast<const char*>(&sections[0]), sections.size() * sizeof(SnapshotSection));
+  out.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+  out.close();
+  if(!out.good() || rename(tmpPath.c_str(), path.c_str()) != 0)
+  {
+    remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+void MappedIndex::unload()
+{
+  index = Ptr<flann::Index>();
+  segments.clear();
+  starts.clear();
+  descriptors = Mat();
+  checks = DEFAULT_CHECKS;
+  file.close();
+}
+
+// Map the snapshot at path, verify the checksums of its sections and load the index on top of
+// its descriptors. Fails, leaving nothing loaded, if it is missing, truncated or corrupt. Unless
+// verifyAll is set, only the small starts and params sections are hashed; the index and the
+// descriptors are checked against the sizes those give, without reading every page of them.
+bool MappedIndex::load(const std::string &path, bool verifyAll)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  unload();
+  if(!file.open(path)) return false;
+
+  // Read the section table from the end of the snapshot
+  const char* p = file.data();
+  size_t size = file.size();
+  SnapshotTrailer trailer;
+  bool valid = size >= sizeof(trailer);
+  if(valid)
+  {
+    memcpy(&trailer, p + size - sizeof(trailer), sizeof(trailer));
+    valid = memcmp(trailer.magic, "SVB1", 4) == 0 && trailer.sections > 0 && trailer.sections < 64 && trailer.chunkSize > 0
+      && trailer.tableOffset + trailer.sections * sizeof(SnapshotSection) + sizeof(trailer) == size;
+  }
+  std::vector<SnapshotSection> sections;
+  if(valid)
+  {
+    sections.resize(trailer.sections);
+    memcpy(&sections[0], p + trailer.tableOffset, sections.size() * sizeof(SnapshotSection));
+  }
+  std::map<std::string, SnapshotSection> byName;
+  for(int s = 0; valid && s < sections.size(); s++)
+  {
+    valid = sections.at(s).offset <= trailer.tableOffset && sections.at(s).size <= trailer.tableOffset - sections.at(s).offset;
+    byName[std::string(sections.at(s).name, strnlen(sections.at(s).name, sizeof(sections.at(s).name)))] = sections.at(s);
+  }
+  valid = valid && byName.count("index") && byName.count("descs") && byName.count("starts") && byName.count("params")
+    && byName["index"].offset == 0 && byName["descs"].offset % sizeof(float) == 0;
+  if(!valid)
+  {
+    printf("Ignoring snapshot '%s': it is truncated or not a snapshot\n", path.c_str());
+    unload();
+    return false;
+  }
+
+  std::vector<SnapshotSection> verified;
+  for(int s = 0; s < sections.size(); s++)
+  {
+    std::string name(sections.at(s).name, strnlen(sections.at(s).name, sizeof(sections.at(s).name)));
+    if(verifyAll || name == "starts" || name == "params") verified.push_back(sections.at(s));
+  }
+  std::vector<unsigned long long> checksums;
+  checksumSections(p, trailer.chunkSize, verified, checksums);
+  for(int s = 0; s < verified.size(); s++)
+  {
+    if(checksums.at(s) != verified.at(s).checksum)
+    {
+      printf("Ignoring snapshot '%s': section '%.8s' fails its checksum\n", path.c_str(), verified.at(s).name);
+      unload();
+      return false;
+    }
+  }
+
+  // Check the sections agree with each other
+  std::map<std::string, long long> params;
+  std::istringstream paramsText(std::string(p + byName["params"].offset, byName["params"].size));
+  std::string key;
+  long long value;
+  while(paramsText >> key >> value) params[key] = value;
+  long long rows = params["rows"], cols = params["cols"], numSegments = params["segments"];
+  valid = rows >= 0 && cols > 0 && numSegments >= 0 && byName["descs"].size == (unsigned long long)(rows * cols * sizeof(float))
+    && byName["starts"].size == (numSegments + 1) * sizeof(int);
+  if(valid)
+  {
+    starts.resize(numSegments + 1);
+    memcpy(&starts[0], p + byName["starts"].offset, starts.size() * sizeof(int));
+    valid = starts.front() == 0 && starts.back() == rows;
+    for(int i = 0; valid && i < numSegments; i++)
+    {
+      valid = starts.at(i) <= starts.at(i + 1);
+    }
+  }
+  if(!valid)
+  {
+    printf("Ignoring snapshot '%s': its sections are inconsistent\n", path.c_str());
+    unload();
+    return false;
+  }
+  if(params.count("checks") && params["checks"] > 0) checks = params["checks"];
+
+  // The mapping is read-only; nothing writes through these headers
+  descriptors = Mat(rows, cols, CV_32F, (void*)(p + byName["descs"].offset));
+  index = new flann::Index();
+  if(!index->load(descriptors, path.c_str()))
+  {
+    printf("Can't load the index of snapshot '%s'\n", path.c_str());
+    unload();
+    return false;
+  }
+  for(int i = 0; i < numSegments; i++)
+  {
+    segments.push_back(descriptors.rowRange(starts.at(i), starts.at(i + 1)));
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("Loaded snapshot '%s': %lld descriptors of %lld viewpoints (%.1fMB, %d sections verified) in %.2fs\n", path.c_str(),
+    rows, numSegments, size / (1024.0 * 1024.0), (int)verified.size(), seconds);
+  return true;
+}
+
+bool MappedIndex::isLoaded() const
+{
+  return !index.empty();
+}
+
+// Approximate memory the index occupies once its pages are resident: the descriptors plus
+// FLANN's default 4 kd-trees, each holding a node and an index entry per descriptor
+size_t MappedIndex::bytes() const
+{
+  if(index.empty()) return 0;
+  return descriptors.total() * descriptors.elemSize() + DEFAULT_TREES * (size_t)descriptors.rows * 48;
+}
+
+const std::vector<Mat>& MappedIndex::getSegments() const
+{
+  return segments;
+}
+
+// The k nearest descriptors of each query row, as FlannBasedMatcher::knnMatch would give them:
+// imgIdx is the viewpoint (segment), trainIdx the row within it, distance the L2 distance
+void MappedIndex::knnMatch(const Mat &queries, std::vector<std::vector<DMatch> > &matches, int k)
+{
+  matches.clear();
+  if(index.empty() || queries.rows == 0) return;
+  k = std::min(k, (int)descriptors.rows);
+  Mat indices(queries.rows, k, CV_32S);
+  Mat dists(queries.rows, k, CV_32F);
+  index->knnSearch(queries, indices, dists, k, flann::SearchParams(checks));
+
+  matches.resize(queries.rows);
+  for(int q = 0; q < queries.rows; q++)
+  {
+    for(int j = 0; j < k; j++)
+    {
+      int row = indices.at<int>(q, j);
+      if(row < 0 || row >= descriptors.rows) continue;
+      int segment = std::upper_bound(starts.begin(), starts.end(), row) - starts.begin() - 1;
+      matches.at(q).push_back(DMatch(q, row - starts.at(segment), segment, std::sqrt(dists.at<float>(q, j))));
+    }
+  }
+}
@@ -0,0 +1,58 @@
+/*  Bigmatcher index loaded from a single snapshot file, with its descriptors
+**  read straight from a memory mapping rather than copied into each process.
+**
+**  The descriptors of every viewpoint are stored as one contiguous block, the
+**  exact matrix the FLANN index was built over, so the index is loaded with
+**  flann::Index::load on top of the mapping. The mapping is shared by every
+**  process using the same file, and the index's own tree is shared too when
+**  the processes are forked after loading it (e.g. gunicorn --preload).
+**
+**  Snapshot layout (e.g. bigmatcher.snapshot):
+**    index:        exactly as flann::Index::save writes it, first so that
+**                  flann::Index::load reads it from the start of the snapshot
+**    descriptors:  #rows x #cols floats, page aligned
+**    starts:       #segments + 1 ints, the first row of each segment
+**    params:       "<key> <value>" lines: rows, cols, segments, trees, checks
+**    sections:     {name[8], offset, size, checksum} per section above
+**    trailer:      magic "SVB1", #sections, checksum chunk size, table offset
+**  Each checksum is the FNV-1a hash of the hashes of the section's chunks, so
+**  that every section is verified in parallel when the snapshot is loaded and
+**  a truncated or corrupt snapshot is refused rather than loaded. Snapshots
+**  loaded on demand while serving (regional indexes) can skip hashing the
+**  index and descriptors, which are then only checked by their sizes.
+*/
+#ifndef MAPPED_INDEX_HPP
+#define MAPPED_INDEX_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include "mapped_file.hpp"
+
+using namespace cv;
+
+class MappedIndex
+{
+public:
+  MappedIndex();
+
+  static bool store(const std::string &path, const Mat &descriptors, const std::vector<long> &starts, flann::Index &index);
+  bool load(const std::string &path, bool verifyAll = true);
+
+  bool isLoaded() const;
+  size_t bytes() const;
+  const std::vector<Mat>& getSegments() const;
+  void knnMatch(const Mat &queries, std::vector<std::vector<DMatch> > &matches, int k);
+
+protected:
+  void unload();
+
+  MappedFile file;
+  Mat descriptors;              // every segment's rows, inside the mapping
+  std::vector<Mat> segments;    // one view of descriptors per viewpoint
+  std::vector<int> starts;      // first row of each segment, plus the total
+  int checks;                   // FLANN search checks the index was stored with
+  Ptr<flann::Index> index;
+};
+
+#endif
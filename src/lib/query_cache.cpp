@@ -0,0 +1,166 @@
+#include <algorithm>
+#include "query_cache.hpp"
+
+// 64 bit DCT hash: the query is reduced to 32x32 greyscale, and each of the 8x8 lowest
+// frequencies of its DCT gives one bit, set if it is above the median of those frequencies
+unsigned long long perceptualHash(const Mat &image)
+{
+  Mat gray, small, pixels, freq;
+  if(image.channels() == 3)
+  {
+    cvtColor(image, gray, COLOR_BGR2GRAY);
+  }
+  else
+  {
+    gray = image;
+  }
+  resize(gray, small, Size(32, 32), 0, 0, INTER_AREA);
+  small.convertTo(pixels, CV_32F);
+  dct(pixels, freq);
+
+  std::vector<float> low;
+  for(int y = 0; y < 8; y++)
+  {
+    for(int x = 0; x < 8; x++) low.push_back(freq.at<float>(y, x));
+  }
+  // The DC term is just the mean brightness, so leave it out of the median
+  std::vector<float> ac(low.begin() + 1, low.end());
+  std::nth_element(ac.begin(), ac.begin() + ac.size() / 2, ac.end());
+  float median = ac.at(ac.size() / 2);
+
+  unsigned long long hash = 0;
+  for(int i = 0; i < low.size(); i++)
+  {
+    if(low.at(i) > median) hash |= 1ULL << i;
+  }
+  return hash;
+}
+
+int hammingDistance(unsigned long long a, unsigned long long b)
+{
+  return __builtin_popcountll(a ^ b);
+}
+
+QueryCache::QueryCache()
+{
+  clock = 0;
+  capacity = 0;
+  maxDistance = 0;
+  hits = 0;
+  hashHits = 0;
+  misses = 0;
+}
+
+// Hold up to capacity results (0 turns the cache off), hitting for hashes differing in at
+// most maxDistance bits. Resets the cache.
+void QueryCache::configure(int _capacity, int _maxDistance)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  capacity = std::max(0, _capacity);
+  maxDistance = std::max(0, std::min(_maxDistance, 64));
+  entries.clear();
+}
+
+bool QueryCache::enabled()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return capacity > 0;
+}
+
+// Find the cached location found with the same parameters whose hash is closest to hash, if
+// it is within maxDistance
+bool QueryCache::find(unsigned long long hash, unsigned long long paramsKey, CachedLocation &location)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  int best = -1;
+  int bestDistance = maxDistance + 1;
+  for(int i = 0; i < entries.size(); i++)
+  {
+    if(entries[i].paramsKey != paramsKey) continue;
+    int distance = hammingDistance(hash, entries[i].hash);
+    if(distance < bestDistance)
+    {
+      best = i;
+      bestDistance = distance;
+    }
+  }
+  if(best < 0)
+  {
+    misses++;
+    return false;
+  }
+  hashHits++;
+  entries[best].lastUsed = ++clock;
+  location = entries[best];
+  return true;
+}
+
+// Cache a location, replacing an entry for the same query or else the least recently used
+void QueryCache::insert(unsigned long long hash, unsigned long long paramsKey, double lat, double lng, const std::vector<std::string> &viewpoints)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if(capacity == 0) return;
+  int slot = -1;
+  for(int i = 0; slot < 0 && i < entries.size(); i++)
+  {
+    if(entries[i].paramsKey == paramsKey && hammingDistance(hash, entries[i].hash) <= maxDistance) slot = i;
+  }
+  if(slot < 0 && entries.size() < capacity)
+  {
+    entries.push_back(CachedLocation());
+    slot = entries.size() - 1;
+  }
+  if(slot < 0)
+  {
+    slot = 0;
+    for(int i = 1; i < entries.size(); i++)
+    {
+      if(entries[i].lastUsed < entries[slot].lastUsed) slot = i;
+    }
+  }
+  CachedLocation &entry = entries[slot];
+  entry.hash = hash;
+  entry.paramsKey = paramsKey;
+  entry.lat = lat;
+  entry.lng = lng;
+  entry.viewpoints = viewpoints;
+  entry.lastUsed = ++clock;
+}
+
+// Count a location found by find as a hit, once the query has been verified against it
+void QueryCache::confirmHit()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  hits++;
+}
+
+// Drop every cached location, e.g. once the index has changed
+void QueryCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+}
+
+long QueryCache::getHits()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return hits;
+}
+
+long QueryCache::getHashHits()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return hashHits;
+}
+
+long QueryCache::getMisses()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return misses;
+}
+
+int QueryCache::size()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return entries.size();
+}
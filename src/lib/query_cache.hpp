@@ -0,0 +1,65 @@
+/*  Cache of recent locate results keyed by a perceptual hash of the query.
+**
+**  The same landmark is photographed over and over and users retry uploads,
+**  so a query whose hash is within a few bits of a cached one, located with
+**  the same parameters, only has to be verified against the viewpoints the
+**  cached location came from instead of searching the bigmatcher. The hash is
+**  a 64 bit DCT hash of the downscaled greyscale query, which survives
+**  re-encoding, resizing and small changes of exposure.
+**
+**  Hashes within a Hamming distance cannot be looked up by key, so the
+**  cache is a small table scanned in full, evicting the least recently
+**  used entry when full.
+*/
+#ifndef QUERY_CACHE_HPP
+#define QUERY_CACHE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <mutex>
+
+using namespace cv;
+
+unsigned long long perceptualHash(const Mat &image);
+int hammingDistance(unsigned long long a, unsigned long long b);
+
+struct CachedLocation
+{
+  unsigned long long hash;
+  unsigned long long paramsKey;   // of the parameters the location was found with
+  double lat;
+  double lng;
+  std::vector<std::string> viewpoints;
+  unsigned long lastUsed;
+};
+
+class QueryCache
+{
+public:
+  QueryCache();
+
+  void configure(int capacity, int maxDistance);
+  bool enabled();
+  bool find(unsigned long long hash, unsigned long long paramsKey, CachedLocation &location);
+  void insert(unsigned long long hash, unsigned long long paramsKey, double lat, double lng, const std::vector<std::string> &viewpoints);
+  void clear();
+  void confirmHit();
+
+  long getHits();
+  long getHashHits();
+  long getMisses();
+  int size();
+
+protected:
+  std::mutex mutex;
+  std::vector<CachedLocation> entries;
+  unsigned long clock;    // use counter for the LRU order
+  int capacity;           // max entries (0 = cache off)
+  int maxDistance;        // max differing hash bits for a hit
+  long hits;              // hash hits whose location was verified
+  long hashHits;          // lookups finding a close enough hash
+  long misses;
+};
+
+#endif
@@ -1,21 +1,52 @@
 // header inclusion
 #include <stdio.h>
 #include <cstring>
+#include <sstream>
+#include <algorithm>
 #include "recogniser.hpp"
 
 using namespace cv;
 using namespace boost::python;
 
-Recogniser::Recogniser(const char* _filename, char* _featureType)
+Recogniser::Recogniser(const char* _filename, const char* featureType)
 {
   filename = _filename;
-  featureType = _featureType;
+  keypointsPerMegapixel = 0;
+  minKeypoints = 0;
+  maxKeypoints = 0;
+  loadAdaptive = false;
   printf("Creating detector...\n");
-  createDetector(detector, featureType);
+  pipeline = createFeaturePipeline(featureType);
+  if(pipeline.empty())
+  {
+    printf("Invalid detector type '%s', using SIFT\n", featureType);
+    pipeline = makePtr<SiftPipeline>();
+  }
   printf("Created\n");
-  matcher = new SaveableFlannBasedMatcher(filename);
+  matcher = new SaveableFlannBasedMatcher(filename, pipeline->descriptorType());
   printf("Loading matcher '%s'...\n", filename);
   matcher->load();
+
+  // Keypoints of each training image, saved alongside the matcher by train
+  std::string keypointsFilename(filename);
+  keypointsFilename += "-keypoints.yml.gz";
+  cv::FileStorage store(keypointsFilename, cv::FileStorage::READ);
+  if(store.isOpened())
+  {
+    int images = (int)store["images"];
+    for(int i = 0; i < images; i++)
+    {
+      std::stringstream name;
+      name << "image" << i;
+      std::vector<KeyPoint> keypoints;
+      read(store[name.str()], keypoints);
+      trainingKeypoints.push_back(keypoints);
+    }
+  }
+  else
+  {
+    printf("No training keypoints saved, so matches will not be verified\n");
+  }
   printf("Loaded!\n");
 }
 
@@ -27,30 +58,56 @@ long Recogniser::query(const char* imagepath)
   std::vector<std::vector<DMatch> > knn_matches;
   matches.clear();
 
-  //detect keypoints and compute descriptors of query image using the detector
+  //detect keypoints and compute (and post-process) descriptors of query image using the
+  //pipeline, keeping only the keypoint budget if one is set
+  int budget = keypointBudget(queryImage.size(), keypointsPerMegapixel, minKeypoints, maxKeypoints, loadAdaptive ? serverLoad() : 0.0);
   std::vector<KeyPoint> keypoints;
   Mat descriptors;
-  detector->detectAndCompute(queryImage, noArray(), keypoints, descriptors, false);
-
-  if(strcmp(featureType, "ROOTSIFT") == 0) rootSIFT(descriptors);
+  pipeline->extract(queryImage, keypoints, descriptors, budget);
 
   //KNN match the query images to the training set with N=2
   matcher->knnMatch(descriptors, knn_matches, 2);
 
   //Filter the matches according to a threshold
   loweFilter(knn_matches, matches);
+  long numMatches = matches.size();
+
+  //Verify the matches against every training image at once, counting the inliers of the
+  //training image the query agrees with best
+  if(!trainingKeypoints.empty())
+  {
+    std::vector<Mat> homographies;
+    std::vector<std::vector<DMatch> > imageMatches;
+    ransacFilter(matches, keypoints, trainingKeypoints, homographies, imageMatches);
+    numMatches = 0;
+    for(int i = 0; i < imageMatches.size(); i++)
+    {
+      numMatches = std::max(numMatches, (long)imageMatches.at(i).size());
+    }
+  }
 
   // Free memory
   descriptors.release();
   queryImage.release();
 
-  return matches.size();
+  return numMatches;
+}
+
+// Cap the query keypoints at _keypointsPerMegapixel, clamped to [_minKeypoints, _maxKeypoints],
+// keeping the strongest keypoints spread over the image (0 density = keep every keypoint)
+void Recogniser::setKeypointBudget(int _keypointsPerMegapixel, int _minKeypoints, int _maxKeypoints, bool _loadAdaptive)
+{
+  keypointsPerMegapixel = _keypointsPerMegapixel;
+  minKeypoints = _minKeypoints;
+  maxKeypoints = _maxKeypoints;
+  loadAdaptive = _loadAdaptive;
 }
 
 // Python Wrapper
 BOOST_PYTHON_MODULE(recogniser)
 {
-  class_<Recogniser>("Recogniser", init<const char*, char*>())
+  class_<Recogniser>("Recogniser", init<const char*, const char*>())
       .def("query", &Recogniser::query)
+      .def("setKeypointBudget", &Recogniser::setKeypointBudget)
   ;
 }
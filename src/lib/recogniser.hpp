@@ -5,6 +5,7 @@
 #include <opencv2/features2d.hpp>
 #include "saveable_matcher.hpp"
 #include "engine.hpp"
+#include "feature_pipeline.hpp"
 
 #include <boost/python.hpp>
 
@@ -15,13 +16,18 @@ using namespace boost::python;
 class Recogniser
 {
 public:
-  Recogniser(const char* _filename, char* featureType);
+  Recogniser(const char* _filename, const char* featureType);
 
   long query(const char* imagepath);
+  void setKeypointBudget(int _keypointsPerMegapixel, int _minKeypoints, int _maxKeypoints, bool _loadAdaptive);
 
 protected:
   const char* filename;
-  char* featureType;
+  int keypointsPerMegapixel;  // query keypoint budget density (0 = keep every keypoint)
+  int minKeypoints;
+  int maxKeypoints;
+  bool loadAdaptive;          // shrink the budget when the server is overloaded
   Ptr<SaveableFlannBasedMatcher> matcher;
-  Ptr<FeatureDetector> detector;
+  Ptr<FeaturePipeline> pipeline;    // chosen by featureType
+  std::vector<std::vector<KeyPoint> > trainingKeypoints;   // of each training image, if saved
 };
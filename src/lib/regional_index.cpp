@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <set>
+#include "regional_index.hpp"
+
+static const double METRES_PER_DEGREE = 111320.0;
+
+RegionStats::RegionStats()
+{
+  regions = 0;
+  resident = 0;
+  residentBytes = 0;
+  hits = 0;
+  loads = 0;
+  prefetches = 0;
+  evictions = 0;
+  failed = 0;
+}
+
+RegionalIndex::RegionalIndex() : prefetchQueue(64)
+{
+  regionSize = 0;
+  budget = 0;
+  clock = 0;
+  prefetcherPid = 0;
+}
+
+RegionalIndex::~RegionalIndex()
+{
+  prefetchQueue.close();
+  if(prefetcher && prefetcherPid == getpid()) prefetcher->join();
+  else prefetcher.release();   // started by a parent process, so there is no thread to join
+}
+
+// Files of a region's index, next to the manifest
+std::string RegionalIndex::regionPrefix(const std::string &folder, int latCell, int lngCell)
+{
+  std::stringstream ss;
+  ss << folder << "bigmatcher-region-" << latCell << "_" << lngCell;
+  return ss.str();
+}
+
+static std::string folderOf(const std::string &path)
+{
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+// Grid cell of regionSize degrees holding the viewpoint with the given <lat>,<lng>,... id
+std::pair<int, int> RegionalIndex::cellOf(const std::string &id, double regionSize)
+{
+  double lat = 0, lng = 0;
+  sscanf(id.c_str(), "%lf,%lf", &lat, &lng);
+  return std::make_pair((int)floor(lat / regionSize), (int)floor(lng / regionSize));
+}
+
+// Split the viewpoints (ids in bigmatcher order, descriptors laid out by offsets) into regions
+// of regionSize degrees, building and storing an index for each region not in reused, then
+// write the manifest with the descriptor rows of every viewpoint
+bool RegionalIndex::store(const std::string &manifestPath, double regionSize, const std::vector<std::string> &ids,
+  const Mat &descriptors, const std::vector<long> &offsets, const std::vector<int> &rows,
+  const std::set<std::pair<int, int> > &reused)
+{
+  std::map<std::pair<int, int>, std::vector<int> > members;
+  for(int v = 0; v < ids.size(); v++)
+  {
+    members[cellOf(ids.at(v), regionSize)].push_back(v);
+  }
+  std::vector<std::pair<int, int> > keys;
+  std::vector<std::vector<int> > groups;
+  for(std::map<std::pair<int, int>, std::vector<int> >::iterator it = members.begin(); it != members.end(); ++it)
+  {
+    keys.push_back(it->first);
+    groups.push_back(it->second);
+  }
+
+  std::string folder = folderOf(manifestPath);
+  bool failed = false;
+  #pragma omp parallel for schedule(dynamic) reduction(||:failed)
+  for(int r = 0; r < keys.size(); r++)
+  {
+    // Gather the region's descriptors into one contiguous buffer and index it
+    if(reused.count(keys.at(r))) continue;
+    const std::vector<int> &viewpoints = groups.at(r);
+    std::vector<long> regionOffsets(viewpoints.size() + 1, 0);
+    for(int i = 0; i < viewpoints.size(); i++)
+    {
+      int v = viewpoints.at(i);
+      regionOffsets.at(i + 1) = regionOffsets.at(i) + offsets.at(v + 1) - offsets.at(v);
+    }
+    if(regionOffsets.back() == 0) continue;
+    Mat buffer(regionOffsets.back(), descriptors.cols, descriptors.type());
+    for(int i = 0; i < viewpoints.size(); i++)
+    {
+      int v = viewpoints.at(i);
+      if(offsets.at(v + 1) == offsets.at(v)) continue;
+      Mat segment = buffer.rowRange(regionOffsets.at(i), regionOffsets.at(i + 1));
+      descriptors.rowRange(offsets.at(v), offsets.at(v + 1)).copyTo(segment);
+    }
+    flann::Index index(buffer, flann::KDTreeIndexParams());
+    std::string prefix = regionPrefix(folder, keys.at(r).first, keys.at(r).second);
+    if(!MappedIndex::store(prefix + ".snapshot", buffer, regionOffsets, index))
+    {
+      printf("Can't store region index '%s'\n", prefix.c_str());
+      failed = true;
+    }
+  }
+  if(failed) return false;
+
+  std::string tmpPath = manifestPath + ".tmp";
+  std::ofstream out(tmpPath.c_str(), std::ios::out | std::ofstream::trunc);
+  if(!out.is_open()) return false;
+  out << "SVR1 " << regionSize << " " << ids.size() << "\n";
+  out << "rows";
+  for(int v = 0; v < ids.size(); v++)
+  {
+    out << " " << rows.at(v);
+  }
+  out << "\n";
+  for(int r = 0; r < keys.size(); r++)
+  {
+    const std::vector<int> &viewpoints = groups.at(r);
+    long regionRows = 0;
+    for(int i = 0; i < viewpoints.size(); i++) regionRows += rows.at(viewpoints.at(i));
+    if(regionRows == 0) continue;   // nothing to index, so no files were stored
+    out << "region " << keys.at(r).first << " " << keys.at(r).second << " " << viewpoints.size();
+    for(int i = 0; i < viewpoints.size(); i++) out << " " << viewpoints.at(i);
+    out << "\n";
+  }
+  out.close();
+  if(!out.good() || rename(tmpPath.c_str(), manifestPath.c_str()) != 0)
+  {
+    remove(tmpPath.c_str());
+    return false;
+  }
+  printf("Stored %d regional indexes of %.4f degrees (%d unchanged)\n", (int)(keys.size() - reused.size()), regionSize, (int)reused.size());
+  return true;
+}
+
+// Read the manifest at manifestPath; no region is loaded until it is searched or prefetched
+bool RegionalIndex::load(const std::string &manifestPath)
+{
+  std::ifstream in(manifestPath.c_str());
+  if(!in.is_open()) return false;
+  std::string magic, word;
+  int numViewpoints = 0;
+  in >> magic >> regionSize >> numViewpoints >> word;
+  bool valid = in.good() && magic == "SVR1" && regionSize > 0 && numViewpoints >= 0 && word == "rows";
+  segmentRows.assign(valid ? numViewpoints : 0, 0);
+  for(int v = 0; valid && v < numViewpoints; v++)
+  {
+    valid = (in >> segmentRows.at(v)) && segmentRows.at(v) >= 0;
+  }
+  std::vector<char> assigned(segmentRows.size(), 0);
+  while(valid && in >> word)
+  {
+    Region region;
+    int count = 0;
+    valid = word == "region" && (in >> region.latCell >> region.lngCell >> count) && count >= 0;
+    for(int i = 0; valid && i < count; i++)
+    {
+      int v = -1;
+      valid = (in >> v) && v >= 0 && v < numViewpoints && !assigned.at(v);
+      if(valid)
+      {
+        assigned.at(v) = 1;
+        region.viewpoints.push_back(v);
+      }
+    }
+    region.bytes = 0;
+    region.lastUsed = 0;
+    region.failed = false;
+    if(valid)
+    {
+      cells[std::make_pair(region.latCell, region.lngCell)] = regions.size();
+      regions.push_back(region);
+    }
+  }
+  if(!valid)
+  {
+    printf("Ignoring regional bigmatcher '%s': the manifest is corrupt\n", manifestPath.c_str());
+    segmentRows.clear();
+    regions.clear();
+    cells.clear();
+    return false;
+  }
+  manifestFolder = folderOf(manifestPath);
+  stats.regions = regions.size();
+  printf("Serving %d viewpoints from %d regional indexes, loaded on demand\n", numViewpoints, (int)regions.size());
+  return true;
+}
+
+bool RegionalIndex::isLoaded() const
+{
+  return !regions.empty();
+}
+
+const std::vector<int>& RegionalIndex::getSegmentRows() const
+{
+  return segmentRows;
+}
+
+// Keep the resident regions within maxBytes, evicting as needed. The region most recently
+// searched is kept even if it alone exceeds the budget.
+void RegionalIndex::setBudget(size_t maxBytes)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  budget = maxBytes;
+  evict();
+}
+
+std::vector<int> RegionalIndex::allRegions() const
+{
+  std::vector<int> all(regions.size());
+  for(int r = 0; r < regions.size(); r++) all.at(r) = r;
+  return all;
+}
+
+// Bigmatcher index of each viewpoint in the region
+const std::vector<int>& RegionalIndex::regionViewpoints(int region) const
+{
+  return regions.at(region).viewpoints;
+}
+
+// The regions overlapping the circle of radiusMetres around lat-lng
+std::vector<int> RegionalIndex::regionsNear(double lat, double lng, double radiusMetres) const
+{
+  std::vector<int> near;
+  if(regions.empty()) return near;
+  double dLat = radiusMetres / METRES_PER_DEGREE;
+  double dLng = radiusMetres / (METRES_PER_DEGREE * std::max(0.01, cos(lat * M_PI / 180.0)));
+  int latBegin = (int)floor((lat - dLat) / regionSize), latEnd = (int)floor((lat + dLat) / regionSize);
+  int lngBegin = (int)floor((lng - dLng) / regionSize), lngEnd = (int)floor((lng + dLng) / regionSize);
+  for(int y = latBegin; y <= latEnd; y++)
+  {
+    for(int x = lngBegin; x <= lngEnd; x++)
+    {
+      std::map<std::pair<int, int>, int>::const_iterator it = cells.find(std::make_pair(y, x));
+      if(it != cells.end()) near.push_back(it->second);
+    }
+  }
+  return near;
+}
+
+// The regions bordering any of the given ones, excluding those given
+std::vector<int> RegionalIndex::neighboursOf(const std::vector<int> &given) const
+{
+  std::set<int> excluded(given.begin(), given.end());
+  std::set<int> neighbours;
+  for(int i = 0; i < given.size(); i++)
+  {
+    const Region &region = regions.at(given.at(i));
+    for(int y = region.latCell - 1; y <= region.latCell + 1; y++)
+    {
+      for(int x = region.lngCell - 1; x <= region.lngCell + 1; x++)
+      {
+        std::map<std::pair<int, int>, int>::const_iterator it = cells.find(std::make_pair(y, x));
+        if(it != cells.end() && !excluded.count(it->second)) neighbours.insert(it->second);
+      }
+    }
+  }
+  return std::vector<int>(neighbours.begin(), neighbours.end());
+}
+
+// Load the given regions on the background thread if they are not resident. Requests are
+// dropped rather than queued without limit when the prefetcher falls behind.
+void RegionalIndex::prefetch(const std::vector<int> &given)
+{
+  startPrefetcher();
+  for(int i = 0; i < given.size(); i++)
+  {
+    prefetchQueue.tryPush(given.at(i));
+  }
+}
+
+// Start the prefetch thread in this process unless it is already running. This is left to the
+// first prefetch rather than done by load, as threads do not survive fork: a pre-fork server
+// loads the manifest in its parent, and the thread must run in each worker that searches.
+void RegionalIndex::startPrefetcher()
+{
+  std::lock_guard<std::mutex> lock(prefetcherMutex);
+  if(prefetcher && prefetcherPid == getpid()) return;
+  prefetcher.release();   // a thread of the parent process, which does not exist in this one
+  prefetcherPid = getpid();
+  prefetcher.reset(new std::thread(&RegionalIndex::prefetchLoop, this));
+}
+
+void RegionalIndex::prefetchLoop()
+{
+  int region;
+  while(prefetchQueue.pop(region))
+  {
+    acquire(region, true);
+  }
+}
+
+// The index of a region, loading it if it is not resident. Returns null if it can't be loaded,
+// in which case the region is marked failed and skipped from then on rather than re-read by
+// every query near it.
+std::shared_ptr<MappedIndex> RegionalIndex::acquire(int r, bool prefetching)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(regions.at(r).failed) return std::shared_ptr<MappedIndex>();
+    if(regions.at(r).index)
+    {
+      regions.at(r).lastUsed = ++clock;
+      if(!prefetching) stats.hits++;
+      return regions.at(r).index;
+    }
+  }
+
+  // Load outside the residency lock, so that searches of resident regions carry on meanwhile
+  std::lock_guard<std::mutex> loading(loadMutex);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(regions.at(r).failed) return std::shared_ptr<MappedIndex>();
+    if(regions.at(r).index)   // loaded while this thread waited to load it
+    {
+      regions.at(r).lastUsed = ++clock;
+      if(!prefetching) stats.hits++;
+      return regions.at(r).index;
+    }
+  }
+  std::shared_ptr<MappedIndex> index = std::make_shared<MappedIndex>();
+  std::string prefix = regionPrefix(manifestFolder, regions.at(r).latCell, regions.at(r).lngCell);
+  // Hashing the whole region on the query path would cost more than the search; the snapshot was
+  // checksummed when it was stored, and its sizes and section table are still checked here
+  if(!index->load(prefix + ".snapshot", false))
+  {
+    printf("Can't load region index '%s', skipping it from now on\n", prefix.c_str());
+    std::lock_guard<std::mutex> lock(mutex);
+    regions.at(r).failed = true;
+    stats.failed++;
+    return std::shared_ptr<MappedIndex>();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  regions.at(r).index = index;
+  regions.at(r).bytes = index->bytes();
+  regions.at(r).lastUsed = ++clock;
+  stats.resident++;
+  stats.residentBytes += regions.at(r).bytes;
+  if(prefetching) stats.prefetches++;
+  else stats.loads++;
+  evict();
+  return index;
+}
+
+// Drop the least recently used regions until within the budget; the mutex must be held.
+// Searches still using an evicted region keep it alive until they finish.
+void RegionalIndex::evict()
+{
+  while(budget > 0 && stats.residentBytes > budget && stats.resident > 1)
+  {
+    int oldest = -1;
+    for(int r = 0; r < regions.size(); r++)
+    {
+      if(regions.at(r).index && (oldest < 0 || regions.at(r).lastUsed < regions.at(oldest).lastUsed)) oldest = r;
+    }
+    stats.residentBytes -= regions.at(oldest).bytes;
+    stats.resident--;
+    stats.evictions++;
+    regions.at(oldest).index.reset();
+    regions.at(oldest).bytes = 0;
+  }
+}
+
+// The k nearest descriptors of each query row over the given regions, as the global index
+// would give them: imgIdx is the bigmatcher viewpoint, trainIdx the row within it
+void RegionalIndex::knnMatch(const Mat &queries, const std::vector<int> &given, std::vector<std::vector<DMatch> > &matches, int k)
+{
+  matches.assign(queries.rows, std::vector<DMatch>());
+  for(int i = 0; i < given.size(); i++)
+  {
+    std::shared_ptr<MappedIndex> index = acquire(given.at(i), false);
+    if(!index) continue;
+    const std::vector<int> &viewpoints = regions.at(given.at(i)).viewpoints;
+    std::vector<std::vector<DMatch> > regionMatches;
+    index->knnMatch(queries, regionMatches, k);
+    for(int q = 0; q < regionMatches.size(); q++)
+    {
+      std::vector<DMatch> &best = matches.at(q);
+      for(int j = 0; j < regionMatches.at(q).size(); j++)
+      {
+        DMatch match = regionMatches.at(q).at(j);
+        match.imgIdx = viewpoints.at(match.imgIdx);
+        best.insert(std::upper_bound(best.begin(), best.end(), match), match);
+      }
+      if(best.size() > k) best.resize(k);
+    }
+  }
+}
+
+RegionStats RegionalIndex::getStats()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
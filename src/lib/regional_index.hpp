@@ -0,0 +1,118 @@
+/*  Bigmatcher split into regional indexes which are loaded on first use, so
+**  that an area far larger than fits in memory can be served.
+**
+**  Viewpoints are grouped into regions by a grid of regionSize degrees over
+**  their lat-lng, and each region is stored as its own MappedIndex. A region
+**  is loaded the first time a query is searched in it, and the least
+**  recently used regions are evicted to keep the resident ones within a
+**  memory budget. Regions next to the ones a query hinted at are loaded
+**  ahead of time on a background thread, started by the first prefetch in
+**  each process so that a pre-fork server's workers each get their own.
+**
+**  Matches give imgIdx as the viewpoint's index in the whole bigmatcher and
+**  trainIdx as the row within its descriptors, as the global index would.
+**
+**  Stored as the text manifest bigmatcher-regions.txt:
+**    SVR1 <region size> <#viewpoints>
+**    rows <descriptor rows of each viewpoint>...
+**    region <lat cell> <lng cell> <#viewpoints> <viewpoint index>...   (one per region)
+**  next to bigmatcher-region-<lat cell>_<lng cell>.snapshot. The regions
+**  listed in reused are not rebuilt: their stored snapshots are kept as they
+**  are, and their viewpoints have no rows in the descriptors passed to store.
+*/
+#ifndef REGIONAL_INDEX_HPP
+#define REGIONAL_INDEX_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include "mapped_index.hpp"
+#include "bounded_queue.hpp"
+
+using namespace cv;
+
+struct Region
+{
+  int latCell;
+  int lngCell;
+  std::vector<int> viewpoints;            // bigmatcher index of each of the region's segments
+  std::shared_ptr<MappedIndex> index;     // null unless resident
+  size_t bytes;
+  unsigned long lastUsed;
+  bool failed;                            // its index could not be loaded, so it is not tried again
+};
+
+struct RegionStats
+{
+  RegionStats();
+
+  int regions;
+  int resident;
+  size_t residentBytes;
+  long hits;          // searches of a region which was already resident
+  long loads;         // regions loaded on demand by a search
+  long prefetches;    // regions loaded ahead of time
+  long evictions;
+  int failed;         // regions whose index could not be loaded
+};
+
+class RegionalIndex
+{
+public:
+  RegionalIndex();
+  ~RegionalIndex();
+
+  static bool store(const std::string &manifestPath, double regionSize, const std::vector<std::string> &ids,
+    const Mat &descriptors, const std::vector<long> &offsets, const std::vector<int> &rows,
+    const std::set<std::pair<int, int> > &reused);
+  static std::pair<int, int> cellOf(const std::string &id, double regionSize);
+  static std::string regionPrefix(const std::string &folder, int latCell, int lngCell);
+  bool load(const std::string &manifestPath);
+
+  bool isLoaded() const;
+  const std::vector<int>& getSegmentRows() const;
+  void setBudget(size_t maxBytes);
+
+  std::vector<int> allRegions() const;
+  const std::vector<int>& regionViewpoints(int region) const;
+  std::vector<int> regionsNear(double lat, double lng, double radiusMetres) const;
+  std::vector<int> neighboursOf(const std::vector<int> &regions) const;
+  void prefetch(const std::vector<int> &regions);
+  void knnMatch(const Mat &queries, const std::vector<int> &regions, std::vector<std::vector<DMatch> > &matches, int k);
+  RegionStats getStats();
+
+protected:
+  std::shared_ptr<MappedIndex> acquire(int region, bool prefetching);
+  void evict();
+  void startPrefetcher();
+  void prefetchLoop();
+
+  std::string manifestFolder;
+  double regionSize;
+  std::vector<int> segmentRows;           // descriptor rows of each bigmatcher viewpoint
+  std::vector<Region> regions;
+  std::map<std::pair<int, int>, int> cells;
+
+  std::mutex mutex;                       // guards residency and the stats
+  std::mutex loadMutex;                   // one region loads at a time
+  size_t budget;
+  unsigned long clock;
+  RegionStats stats;
+
+  BoundedQueue<int> prefetchQueue;
+  std::unique_ptr<std::thread> prefetcher;
+  pid_t prefetcherPid;                    // process the prefetcher was started in
+  std::mutex prefetcherMutex;
+
+private:
+  RegionalIndex(const RegionalIndex&);
+  RegionalIndex& operator=(const RegionalIndex&);
+};
+
+#endif
@@ -4,10 +4,20 @@
 #include <iterator>
 #include <vector>
 #include <fstream>
+#include <cstring>
 
-SaveableFlannBasedMatcher::SaveableFlannBasedMatcher(const char* _filename)
+// Binary descriptors can't be put in a KD tree, so they are indexed by LSH
+static Ptr<flann::IndexParams> indexParamsFor(int descriptorType)
+{
+  if(descriptorType == CV_8U) return makePtr<flann::LshIndexParams>(12, 20, 2);
+  return makePtr<flann::KDTreeIndexParams>();
+}
+
+SaveableFlannBasedMatcher::SaveableFlannBasedMatcher(const char* _filename, int _descriptorType)
+  : FlannBasedMatcher(indexParamsFor(_descriptorType))
 {
   filename = _filename;
+  descriptorType = _descriptorType;
 }
 
 void SaveableFlannBasedMatcher::printParams()
@@ -62,7 +72,32 @@ void SaveableFlannBasedMatcher::store()
   std::vector<Mat> descs = getTrainDescriptors();
   std::string descriptorsFilename(filename);
   descriptorsFilename += "-descriptors.bin";
-  writeDescriptors(descs, descriptorsFilename.c_str());
+  if(descriptorType == CV_8U) writeDescriptors<uchar>(descs, descriptorsFilename.c_str());
+  else writeDescriptors<float>(descs, descriptorsFilename.c_str());
+}
+
+// Store an index which was built outside the matcher, over the descriptors of each
+// segment merged in order, in the same files as store() so that load() can read it back.
+// The segments are written in place, so they may be views into one large buffer.
+void SaveableFlannBasedMatcher::storePrebuilt(std::vector<Mat> &segments, flann::Index &index)
+{
+  // Save the matcher's IndexParams & SearchParams
+  std::string treeFilename(filename);
+  treeFilename += "-tree.xml.gz";
+  cv::FileStorage store(treeFilename.c_str(), cv::FileStorage::WRITE);
+  write(store);
+  store.release();
+
+  // Save the index
+  std::string indexFilename(filename);
+  indexFilename += ".flannindex";
+  index.save(indexFilename.c_str());
+
+  // Save the descriptors
+  std::string descriptorsFilename(filename);
+  descriptorsFilename += "-descriptors.bin";
+  if(descriptorType == CV_8U) writeDescriptors<uchar>(segments, descriptorsFilename.c_str());
+  else writeDescriptors<float>(segments, descriptorsFilename.c_str());
 }
 
 void SaveableFlannBasedMatcher::load()
@@ -77,7 +112,13 @@ void SaveableFlannBasedMatcher::load()
   file = fopen(descriptorsFilename.c_str(), "r");
   if(file == NULL) { return; }
   fclose(file);
-  readDescriptors(descsVec, descriptorsFilename.c_str());
+  bool loaded = descriptorType == CV_8U ? readDescriptors<uchar>(descsVec, descriptorsFilename.c_str())
+    : readDescriptors<float>(descsVec, descriptorsFilename.c_str());
+  if(!loaded)
+  {
+    printf("Can't load '%s': not descriptors of the matcher's type\n", descriptorsFilename.c_str());
+    return;
+  }
 
   // Add the descriptors to the matcher
   add(descsVec);
@@ -119,17 +160,23 @@ void SaveableFlannBasedMatcher::writeIndex(const char* name)
   flannIndex->save(name);
 }
 
-void SaveableFlannBasedMatcher::writeDescriptors(std::vector<Mat> descriptors, const char* name)
+// Descriptors of element type T (float or uchar)
+template<typename T>
+void SaveableFlannBasedMatcher::writeDescriptors(const std::vector<Mat> &descriptors, const char* name)
 {
   // Open the file
   std::ofstream outFILE(name, std::ios::out | std::ofstream::binary);
 
+  // Write the element type, so descriptors of another type are never read back as these
+  int type = DataType<T>::type;
+  outFILE.write("SVD1", 4);
+  outFILE.write(reinterpret_cast<char*>(&type), sizeof(int));
+
   // Write the number of descriptors so we can read back later
   int size = descriptors.size();
   outFILE.write(reinterpret_cast<char*>(&size), sizeof(int));
 
   // Write each of the descriptor matrices
-  std::vector<float> descsArray;
   for(int i = 0; i < size; i++)
   {
     int width = descriptors.at(i).size().width;
@@ -139,26 +186,43 @@ void SaveableFlannBasedMatcher::writeDescriptors(std::vector<Mat> descriptors, c
     outFILE.write(reinterpret_cast<char*>(&width), sizeof(int));
     outFILE.write(reinterpret_cast<char*>(&height), sizeof(int));
 
-    // Copy matrix into vector
-    descsArray.assign((float*)descriptors.at(i).datastart, (float*)descriptors.at(i).dataend);
-
-    // Finally, write actual matrix data
-    outFILE.write(reinterpret_cast<char*>(&descsArray[0]), descsArray.size() * sizeof(float));
+    // Finally, write actual matrix data row by row (the matrix may be a view into a larger one)
+    for(int row = 0; row < height; row++)
+    {
+      outFILE.write(reinterpret_cast<const char*>(descriptors.at(i).ptr<T>(row)), width * sizeof(T));
+    }
   }
   outFILE.close();
 }
 
-void SaveableFlannBasedMatcher::readDescriptors(std::vector<Mat> &descriptors, const char* name)
+// Returns false if the file holds descriptors of a type other than T
+template<typename T>
+bool SaveableFlannBasedMatcher::readDescriptors(std::vector<Mat> &descriptors, const char* name)
 {
   // Open the file
   std::ifstream inFILE(name, std::ios::in | std::ios::binary);
 
+  // Check the element type; a file without the magic starts with the number of descriptors
+  // and was written when descriptors were always float
+  char magic[4];
+  int type = CV_32F;
+  inFILE.read(magic, 4);
+  if(inFILE.good() && memcmp(magic, "SVD1", 4) == 0)
+  {
+    inFILE.read(reinterpret_cast<char*>(&type), sizeof(int));
+  }
+  else
+  {
+    inFILE.clear();
+    inFILE.seekg(0);
+  }
+  if(!inFILE.good() || type != DataType<T>::type) return false;
+
   // Read the number of descriptors in the file
   int size;
   inFILE.read(reinterpret_cast<char*>(&size), sizeof(int));
 
   // Read each of the descriptor matrices
-  std::vector<float> descsArray;
   for(int i = 0; i < size; i++)
   {
     int width, height;
@@ -166,19 +230,14 @@ void SaveableFlannBasedMatcher::readDescriptors(std::vector<Mat> &descriptors, c
     inFILE.read(reinterpret_cast<char*>(&width), sizeof(int));
     inFILE.read(reinterpret_cast<char*>(&height), sizeof(int));
 
-    // Size the descsArray to hold the data we will read
-    descsArray.resize(width*height);
-
-    // Read the data into the descsArray
-    inFILE.read(reinterpret_cast<char*>(&descsArray[0]), width * height * sizeof(float));
-
-    // Create a matrix of the correct dimensions
+    // Create a matrix of the correct dimensions and read the data straight into it
     Mat descsMat;
-    descsMat.create(height, width, CV_32FC1);
-    memcpy(descsMat.data, descsArray.data(), descsArray.size() * sizeof(float));
+    descsMat.create(height, width, DataType<T>::type);
+    inFILE.read(reinterpret_cast<char*>(descsMat.data), width * height * sizeof(T));
 
     // Push matrix to output descriptors vector
     descriptors.push_back(descsMat);
   }
   inFILE.close();
+  return true;
 }
@@ -6,6 +6,13 @@
 **    - Save the IndexParams and SearchParams using FlannBasedMatcher::read and write
 **    - Save the flannIndex which is a protected member of FlannBasedMatcher, and
 **      hence why a derived class is required to access this protected member.
+**
+**  Descriptors are float (SIFT, SURF) unless the matcher is created for CV_8U
+**  binary descriptors (e.g. ORB), which are indexed by LSH and matched by
+**  Hamming distance instead of a KD tree. The descriptors file starts with
+**  magic "SVD1" and the descriptor Mat type, and a matcher refuses to load
+**  descriptors of another type; files without the magic predate it and hold
+**  float descriptors.
 */
 #include <opencv2/opencv.hpp>
 
@@ -14,17 +21,19 @@ class SaveableFlannBasedMatcher : public cv::FlannBasedMatcher
 {
 public:
 
-  SaveableFlannBasedMatcher(const char* _filename);
+  SaveableFlannBasedMatcher(const char* _filename, int _descriptorType = CV_32F);
   virtual ~SaveableFlannBasedMatcher(){};
 
   void printParams();
   virtual void store();
   virtual void load();
+  void storePrebuilt(std::vector<Mat> &segments, flann::Index &index);
 
 protected:
   const char* filename;
+  int descriptorType;     // CV_32F or CV_8U
   void readIndex(const char* name);
   void writeIndex(const char* name);
-  void writeDescriptors(std::vector<Mat> descriptors, const char* name);
-  void readDescriptors(std::vector<Mat> &descriptors, const char* name);
+  template<typename T> void writeDescriptors(const std::vector<Mat> &descriptors, const char* name);
+  template<typename T> bool readDescriptors(std::vector<Mat> &descriptors, const char* name);
 };
@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <cstring>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "shard_set.hpp"
+#include "bounded_queue.hpp"
+
+static const char REQUEST_MAGIC[4] = { 'S', 'V', 'H', 'Q' };
+static const char RESPONSE_MAGIC[4] = { 'S', 'V', 'H', 'R' };
+static const uint32_t PROTOCOL_VERSION = 1;
+static const uint32_t MAX_MESSAGE_BYTES = 64 * 1024 * 1024;
+static const int MAX_DESCRIPTOR_COLS = 4096;
+static const int MAX_VIEWPOINTS = 1 << 26;
+static const int RETRY_FAILED_MS = 1000;
+static const int WORKERS_PER_SHARD = 4;
+static const int CALLS_QUEUED_PER_SHARD = 64;
+
+ShardStats::ShardStats()
+{
+  requests = 0;
+  failures = 0;
+  stragglers = 0;
+  skipped = 0;
+  totalMs = 0;
+  maxMs = 0;
+}
+
+// Send or receive exactly size bytes, returning false on EOF, error or timeout
+static bool sendFully(int fd, const void* data, size_t size)
+{
+  const char* p = (const char*)data;
+  while(size > 0)
+  {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool receiveFully(int fd, void* data, size_t size)
+{
+  char* p = (char*)data;
+  while(size > 0)
+  {
+    ssize_t n = recv(fd, p, size, 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Read whatever is available of the size bytes at data + got from a non-blocking socket, adding
+// it to got. Returns false on EOF or error; true with got < size means the rest has yet to arrive.
+bool readAvailable(int fd, void* data, size_t size, size_t &got)
+{
+  char* p = (char*)data;
+  while(got < size)
+  {
+    ssize_t n = recv(fd, p + got, size - got, 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if(n <= 0) return false;
+    got += n;
+  }
+  return true;
+}
+
+// Whether header starts a request (or a response) this version of the protocol can read
+bool isShardHeader(const ShardMessageHeader &header, bool request)
+{
+  return memcmp(header.magic, request ? REQUEST_MAGIC : RESPONSE_MAGIC, 4) == 0
+    && header.version == PROTOCOL_VERSION && header.length <= MAX_MESSAGE_BYTES;
+}
+
+bool writeShardMessage(int fd, bool request, int code, const std::vector<uchar> &payload)
+{
+  ShardMessageHeader header;
+  memcpy(header.magic, request ? REQUEST_MAGIC : RESPONSE_MAGIC, 4);
+  header.version = PROTOCOL_VERSION;
+  header.code = code;
+  header.length = payload.size();
+  return sendFully(fd, &header, sizeof(header)) && (payload.empty() || sendFully(fd, &payload[0], payload.size()));
+}
+
+bool readShardMessage(int fd, bool request, int &code, std::vector<uchar> &payload)
+{
+  ShardMessageHeader header;
+  if(!receiveFully(fd, &header, sizeof(header)) || !isShardHeader(header, request))
+  {
+    return false;
+  }
+  code = header.code;
+  payload.resize(header.length);
+  return payload.empty() || receiveFully(fd, &payload[0], payload.size());
+}
+
+template<typename T>
+static void append(std::vector<uchar> &payload, const T* data, size_t count)
+{
+  const uchar* p = reinterpret_cast<const uchar*>(data);
+  payload.insert(payload.end(), p, p + count * sizeof(T));
+}
+
+// Copy the next size bytes of payload, if there are that many left
+static bool take(const std::vector<uchar> &payload, size_t &offset, void* data, size_t size)
+{
+  if(size > payload.size() - offset) return false;
+  if(size > 0) memcpy(data, &payload[offset], size);
+  offset += size;
+  return true;
+}
+
+static void appendDescriptors(std::vector<uchar> &payload, const Mat &descriptors)
+{
+  int32_t shape[2] = { descriptors.rows, descriptors.cols };
+  append(payload, shape, 2);
+  for(int row = 0; row < descriptors.rows; row++)
+  {
+    append(payload, descriptors.ptr<float>(row), descriptors.cols);
+  }
+}
+
+static bool takeDescriptors(const std::vector<uchar> &payload, size_t &offset, int rows, int cols, Mat &descriptors)
+{
+  if(rows < 0 || cols < 0 || cols > MAX_DESCRIPTOR_COLS || (rows > 0 && cols == 0)) return false;
+  if((size_t)rows * cols * sizeof(float) > payload.size() - offset) return false;
+  descriptors = rows > 0 ? Mat(rows, cols, CV_32F) : Mat();
+  return take(payload, offset, descriptors.data, (size_t)rows * cols * sizeof(float));
+}
+
+void encodeShardSearch(const Mat &descriptors, int k, std::vector<uchar> &payload)
+{
+  payload.clear();
+  int32_t k32 = k;
+  append(payload, &k32, 1);
+  appendDescriptors(payload, descriptors);
+}
+
+bool decodeShardSearch(const std::vector<uchar> &payload, Mat &descriptors, int &k)
+{
+  size_t offset = 0;
+  int32_t header[3];
+  if(!take(payload, offset, header, sizeof(header)) || header[0] <= 0
+    || !takeDescriptors(payload, offset, header[1], header[2], descriptors) || offset != payload.size())
+  {
+    return false;
+  }
+  k = header[0];
+  return true;
+}
+
+// The features of a viewpoint, sent with its image as it was encoded rather than encoding it again
+void encodeShardFeatures(const ViewpointFeatures &features, const std::vector<uchar> &encodedImage, std::vector<uchar> &payload)
+{
+  payload.clear();
+  int32_t numKeypoints = features.keypoints.size();
+  append(payload, &numKeypoints, 1);
+  int32_t shape[2] = { features.descriptors.rows, features.descriptors.cols };
+  append(payload, shape, 2);
+  for(int i = 0; i < features.keypoints.size(); i++)
+  {
+    const KeyPoint &kp = features.keypoints.at(i);
+    ShardKeypoint packed = { kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response, kp.octave, kp.class_id };
+    append(payload, &packed, 1);
+  }
+  for(int row = 0; row < features.descriptors.rows; row++)
+  {
+    append(payload, features.descriptors.ptr<float>(row), features.descriptors.cols);
+  }
+  payload.insert(payload.end(), encodedImage.begin(), encodedImage.end());
+}
+
+bool decodeShardFeatures(const std::vector<uchar> &payload, ViewpointFeatures &features)
+{
+  size_t offset = 0;
+  int32_t header[3];
+  if(!take(payload, offset, header, sizeof(header)) || header[0] < 0
+    || (size_t)header[0] * sizeof(ShardKeypoint) > payload.size() - offset)
+  {
+    return false;
+  }
+  features.keypoints.resize(header[0]);
+  for(int i = 0; i < header[0]; i++)
+  {
+    ShardKeypoint packed;
+    take(payload, offset, &packed, sizeof(packed));
+    features.keypoints.at(i) = KeyPoint(Point2f(packed.x, packed.y), packed.size, packed.angle, packed.response, packed.octave, packed.classId);
+  }
+  if(!takeDescriptors(payload, offset, header[1], header[2], features.descriptors)) return false;
+  if(offset == payload.size()) return false;
+  std::vector<uchar> encodedImage(payload.begin() + offset, payload.end());
+  features.image = imdecode(encodedImage, IMREAD_COLOR);
+  return features.image.data != NULL;
+}
+
+// One request to the shard listening at path, both ways within timeoutMs per send or receive
+static bool callShard(const std::string &path, int type, const std::vector<uchar> &request, int timeoutMs,
+  int &status, std::vector<uchar> &response)
+{
+  struct sockaddr_un addr;
+  if(path.size() >= sizeof(addr.sun_path)) return false;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0) return false;
+  struct timeval timeout;
+  timeout.tv_sec = timeoutMs / 1000;
+  timeout.tv_usec = (timeoutMs % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  bool ok = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && writeShardMessage(fd, true, type, request)
+    && readShardMessage(fd, false, status, response);
+  close(fd);
+  return ok;
+}
+
+// Replies gathered from the shards of one scatter. Shared with the threads calling the shards,
+// so a straggler can still finish its call after the scatter has stopped waiting for it.
+struct ShardGather
+{
+  std::mutex mutex;
+  std::condition_variable cv;
+  int pending;
+  std::vector<char> done;
+  std::vector<char> connected;      // the shard was reached and replied
+  std::vector<int> status;
+  std::vector<double> ms;
+  std::vector<std::vector<uchar> > responses;
+};
+
+// A request waiting for one of its shard's workers
+struct ShardCall
+{
+  std::shared_ptr<ShardGather> gather;
+  std::shared_ptr<const std::vector<uchar> > request;
+  int type;
+  int slot;                                     // of the shard's reply in the gather
+  std::chrono::steady_clock::time_point start;  // of the scatter
+  std::chrono::steady_clock::time_point end;    // when the scatter stops waiting
+};
+
+// The threads calling one shard and the queue feeding them
+struct ShardWorkers
+{
+  ShardWorkers() : calls(CALLS_QUEUED_PER_SHARD) {}
+
+  BoundedQueue<ShardCall> calls;
+  std::vector<std::thread> threads;
+};
+
+// Make each call queued for the shard at path, for as long as the scatter it belongs to waits
+static void callShardLoop(std::string path, ShardWorkers* workers)
+{
+  ShardCall call;
+  while(workers->calls.pop(call))
+  {
+    // The scatter has already given up on a call which waited out its time in the queue
+    int remainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(call.end - std::chrono::steady_clock::now()).count();
+    if(remainingMs <= 0) continue;
+    int status = SHARD_OK;
+    std::vector<uchar> response;
+    bool connected = callShard(path, call.type, *call.request, remainingMs, status, response);
+    std::lock_guard<std::mutex> lock(call.gather->mutex);
+    call.gather->done.at(call.slot) = 1;
+    call.gather->connected.at(call.slot) = connected;
+    call.gather->status.at(call.slot) = status;
+    call.gather->ms.at(call.slot) = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - call.start).count();
+    call.gather->responses.at(call.slot).swap(response);
+    call.gather->pending--;
+    call.gather->cv.notify_all();
+  }
+}
+
+ShardSet::ShardSet()
+{
+  timeoutMs = 1000;
+  topK = 200;
+  workersPid = 0;
+}
+
+ShardSet::~ShardSet()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  stopWorkers();
+}
+
+// Start the threads calling each shard unless they are already running in this process. A
+// forked process starts its own, as the threads of its parent do not exist in it. The mutex
+// must be held.
+void ShardSet::startWorkers()
+{
+  if(workersPid == getpid() && workers.size() == paths.size()) return;
+  stopWorkers();
+  workersPid = getpid();
+  for(int s = 0; s < paths.size(); s++)
+  {
+    workers.push_back(std::unique_ptr<ShardWorkers>(new ShardWorkers()));
+    for(int t = 0; t < WORKERS_PER_SHARD; t++)
+    {
+      workers.back()->threads.push_back(std::thread(callShardLoop, paths.at(s), workers.back().get()));
+    }
+  }
+}
+
+// Stop the threads calling the shards once they finish the calls they are making; the mutex
+// must be held
+void ShardSet::stopWorkers()
+{
+  for(int s = 0; s < workers.size(); s++)
+  {
+    if(workersPid != getpid())
+    {
+      workers.at(s).release();   // started by a parent process, so there is nothing to stop
+      continue;
+    }
+    workers.at(s)->calls.close();
+    for(int t = 0; t < workers.at(s)->threads.size(); t++) workers.at(s)->threads.at(t).join();
+  }
+  workers.clear();
+}
+
+// Scatter searches over the shards listening at paths, waiting at most timeoutMs for each
+// request and taking the topK most voted viewpoints of each search. No paths turns it off.
+void ShardSet::configure(const std::vector<std::string> &_paths, int _timeoutMs, int _topK)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopWorkers();
+    paths = _paths;
+    stats.assign(paths.size(), ShardStats());
+    for(int s = 0; s < paths.size(); s++) stats.at(s).path = paths.at(s);
+    retryAfter.assign(paths.size(), TimePoint());
+    described.assign(paths.size(), 0);
+    owners.clear();
+    timeoutMs = std::max(1, _timeoutMs);
+    topK = std::max(1, _topK);
+  }
+  refreshOwners(0);
+}
+
+bool ShardSet::isEnabled()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return !paths.empty();
+}
+
+int ShardSet::size()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return paths.size();
+}
+
+// Send request to each of the given shards in parallel and wait for their responses, for at
+// most waitMs. answered is set for each shard which replied SHARD_OK in time, and the
+// per shard counters are updated; shards which failed or straggled recently are not sent the
+// request, and a shard whose workers already have a full queue is counted as overloaded.
+void ShardSet::scatter(const std::vector<int> &shards, int type, const std::vector<uchar> &request, int waitMs,
+  std::vector<char> &answered, std::vector<std::vector<uchar> > &responses)
+{
+  TimePoint start = std::chrono::steady_clock::now();
+  std::vector<int> sent;
+  std::shared_ptr<ShardGather> gather = std::make_shared<ShardGather>();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    answered.assign(paths.size(), 0);
+    responses.assign(paths.size(), std::vector<uchar>());
+    for(int i = 0; i < shards.size(); i++)
+    {
+      int s = shards.at(i);
+      if(start < retryAfter.at(s))
+      {
+        stats.at(s).skipped++;
+        continue;
+      }
+      sent.push_back(s);
+    }
+    if(sent.empty()) return;
+
+    gather->pending = sent.size();
+    gather->done.assign(sent.size(), 0);
+    gather->connected.assign(sent.size(), 0);
+    gather->status.assign(sent.size(), SHARD_OK);
+    gather->ms.assign(sent.size(), 0);
+    gather->responses.resize(sent.size());
+    startWorkers();
+    ShardCall call;
+    call.gather = gather;
+    call.request = std::make_shared<const std::vector<uchar> >(request);
+    call.type = type;
+    call.start = start;
+    call.end = start + std::chrono::milliseconds(waitMs);
+    for(int i = 0; i < sent.size(); i++)
+    {
+      call.slot = i;
+      if(!workers.at(sent.at(i))->calls.tryPush(call))
+      {
+        std::lock_guard<std::mutex> gathering(gather->mutex);
+        gather->done.at(i) = 1;
+        gather->connected.at(i) = 1;
+        gather->status.at(i) = SHARD_OVERLOADED;
+        gather->pending--;
+      }
+    }
+  }
+
+  // Wait for every shard or the timeout, whichever is first; stragglers are left to finish alone
+  std::unique_lock<std::mutex> gathered(gather->mutex);
+  gather->cv.wait_until(gathered, start + std::chrono::milliseconds(waitMs), [&]() { return gather->pending == 0; });
+  std::lock_guard<std::mutex> lock(mutex);
+  for(int i = 0; i < sent.size(); i++)
+  {
+    ShardStats &shard = stats.at(sent.at(i));
+    shard.requests++;
+    if(!gather->done.at(i))
+    {
+      // Likely hung, so don't make the next requests wait it out too
+      shard.stragglers++;
+      retryAfter.at(sent.at(i)) = std::chrono::steady_clock::now() + std::chrono::milliseconds(RETRY_FAILED_MS);
+    }
+    else if(!gather->connected.at(i))
+    {
+      shard.failures++;
+      retryAfter.at(sent.at(i)) = std::chrono::steady_clock::now() + std::chrono::milliseconds(RETRY_FAILED_MS);
+    }
+    else if(gather->status.at(i) != SHARD_OK)
+    {
+      shard.failures++;
+    }
+    else
+    {
+      shard.totalMs += gather->ms.at(i);
+      shard.maxMs = std::max(shard.maxMs, gather->ms.at(i));
+      answered.at(sent.at(i)) = 1;
+      responses.at(sent.at(i)).swap(gather->responses.at(i));
+    }
+  }
+}
+
+// Ask each shard whose viewpoints are not known yet which ones it owns, within budgetMs (0 =
+// the shard timeout)
+void ShardSet::refreshOwners(int budgetMs)
+{
+  std::vector<int> shards;
+  int waitMs;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(int s = 0; s < paths.size(); s++)
+    {
+      if(!described.at(s)) shards.push_back(s);
+    }
+    waitMs = budgetMs > 0 ? std::min(budgetMs, timeoutMs) : timeoutMs;
+  }
+  if(shards.empty()) return;
+
+  std::vector<char> answered;
+  std::vector<std::vector<uchar> > responses;
+  scatter(shards, SHARD_INFO, std::vector<uchar>(), waitMs, answered, responses);
+  std::lock_guard<std::mutex> lock(mutex);
+  for(int s = 0; s < paths.size(); s++)
+  {
+    if(!answered.at(s) || responses.at(s).size() % sizeof(int32_t) != 0) continue;
+    const int32_t* viewpoints = reinterpret_cast<const int32_t*>(responses.at(s).data());
+    for(size_t i = 0; i < responses.at(s).size() / sizeof(int32_t); i++)
+    {
+      owners[viewpoints[i]] = s;
+    }
+    described.at(s) = 1;
+    printf("Shard '%s' owns %d viewpoints\n", paths.at(s).c_str(), (int)(responses.at(s).size() / sizeof(int32_t)));
+  }
+}
+
+// Search every shard for the query descriptors within budgetMs (0 = the shard timeout), summing
+// the votes each gives its viewpoints into votes, indexed by bigmatcher index and sized to the
+// highest voted. Returns how many shards answered in time; the votes of the others are missing.
+int ShardSet::search(const Mat &descriptors, int budgetMs, std::vector<int> &votes)
+{
+  votes.clear();
+  TimePoint start = std::chrono::steady_clock::now();
+  refreshOwners(budgetMs);
+  if(budgetMs > 0)
+  {
+    // Search within what is left of the budget after asking for owners
+    budgetMs -= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if(budgetMs <= 0) return 0;
+  }
+  std::vector<int> shards;
+  int k, waitMs;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(int s = 0; s < paths.size(); s++) shards.push_back(s);
+    k = topK;
+    waitMs = budgetMs > 0 ? std::min(budgetMs, timeoutMs) : timeoutMs;
+  }
+  std::vector<uchar> request;
+  encodeShardSearch(descriptors, k, request);
+  std::vector<char> answered;
+  std::vector<std::vector<uchar> > responses;
+  scatter(shards, SHARD_SEARCH, request, waitMs, answered, responses);
+
+  int numAnswered = 0;
+  for(int s = 0; s < answered.size(); s++)
+  {
+    if(!answered.at(s)) continue;
+    numAnswered++;
+    const std::vector<uchar> &response = responses.at(s);
+    for(size_t offset = 0; offset + sizeof(ShardVote) <= response.size(); offset += sizeof(ShardVote))
+    {
+      ShardVote vote;
+      memcpy(&vote, &response[offset], sizeof(vote));
+      if(vote.viewpoint < 0 || vote.viewpoint >= MAX_VIEWPOINTS) continue;
+      if(vote.viewpoint >= votes.size()) votes.resize(vote.viewpoint + 1, 0);
+      votes.at(vote.viewpoint) += vote.votes;
+    }
+  }
+  return numAnswered;
+}
+
+// Whether a shard is known to own the viewpoint with this bigmatcher index
+bool ShardSet::owns(int viewpoint)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return owners.count(viewpoint) > 0;
+}
+
+// The rerank features of a viewpoint, fetched from the shard owning it within budgetMs (0 = the
+// shard timeout). Null if no shard owns it or the shard failed to answer in time.
+std::shared_ptr<ViewpointFeatures> ShardSet::fetchFeatures(int viewpoint, const std::string &id, int budgetMs)
+{
+  std::vector<int> shards;
+  int waitMs;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<int, int>::const_iterator owner = owners.find(viewpoint);
+    if(owner == owners.end()) return std::shared_ptr<ViewpointFeatures>();
+    shards.push_back(owner->second);
+    waitMs = budgetMs > 0 ? std::min(budgetMs, timeoutMs) : timeoutMs;
+  }
+  std::vector<uchar> request;
+  int32_t index = viewpoint;
+  append(request, &index, 1);
+  append(request, id.data(), id.size());
+  std::vector<char> answered;
+  std::vector<std::vector<uchar> > responses;
+  scatter(shards, SHARD_FEATURES, request, waitMs, answered, responses);
+
+  std::shared_ptr<ViewpointFeatures> features = std::make_shared<ViewpointFeatures>();
+  if(!answered.at(shards.at(0)) || !decodeShardFeatures(responses.at(shards.at(0)), *features))
+  {
+    return std::shared_ptr<ViewpointFeatures>();
+  }
+  return features;
+}
+
+std::vector<ShardStats> ShardSet::getStats()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
@@ -0,0 +1,152 @@
+/*  Bigmatcher search scattered over shard processes, each holding the indexes
+**  of a subset of the viewpoints (see src/locateshard), for a bigmatcher too
+**  large for one host.
+**
+**  The coordinating Locator sends the query descriptors to every shard, which
+**  searches its own regions and answers with the viewpoints it found the most
+**  votes for; the coordinator sums these into one vote per viewpoint. The
+**  rerank then fetches each shortlisted viewpoint's keypoints, descriptors
+**  and image from the shard owning it, rather than reading the SV image.
+**
+**  Shards are reached over Unix domain sockets, so shard processes on the same
+**  host stand in for remote ones. Each shard is called by its own fixed set of
+**  threads, fed through a bounded queue and started in the process which first
+**  scatters a request (threads do not survive a pre-fork server's fork). A
+**  shard which has not answered by the timeout is a straggler: the search goes
+**  ahead without its votes. A straggler, or a shard which fails outright, is
+**  skipped for a second before being tried again, and one whose queue is full
+**  is refused.
+**
+**  Each connection carries one request and its response, both a
+**  ShardMessageHeader followed by `length` bytes of payload:
+**    SHARD_INFO      -> int32 bigmatcher index of each viewpoint the shard owns
+**    SHARD_SEARCH    int32 k, rows, cols, rows x cols float descriptors
+**                    -> up to k ShardVotes, most votes first
+**    SHARD_FEATURES  int32 viewpoint, then its id
+**                    -> int32 #keypoints, rows, cols, the ShardKeypoints,
+**                       rows x cols float descriptors, then the encoded image
+*/
+#ifndef SHARD_SET_HPP
+#define SHARD_SET_HPP
+
+#include <opencv2/opencv.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <unistd.h>
+#include "viewpoint_cache.hpp"
+
+using namespace cv;
+
+enum ShardRequestType
+{
+  SHARD_INFO,
+  SHARD_SEARCH,
+  SHARD_FEATURES
+};
+
+enum ShardStatus
+{
+  SHARD_OK,
+  SHARD_BAD_REQUEST,    // malformed request, or a viewpoint the shard does not own
+  SHARD_UNREADABLE,     // the viewpoint's SV image could not be read
+  SHARD_OVERLOADED      // refused by the shard's admission control
+};
+
+// Little-endian, packed
+#pragma pack(push, 1)
+struct ShardMessageHeader
+{
+  char magic[4];        // "SVHQ" for requests, "SVHR" for responses
+  uint32_t version;
+  int32_t code;         // ShardRequestType of a request, ShardStatus of a response
+  uint32_t length;      // bytes of payload which follow
+};
+
+struct ShardVote
+{
+  int32_t viewpoint;    // bigmatcher index
+  int32_t votes;
+};
+
+struct ShardKeypoint
+{
+  float x;
+  float y;
+  float size;
+  float angle;
+  float response;
+  int32_t octave;
+  int32_t classId;
+};
+#pragma pack(pop)
+
+bool readAvailable(int fd, void* data, size_t size, size_t &got);
+bool isShardHeader(const ShardMessageHeader &header, bool request);
+bool writeShardMessage(int fd, bool request, int code, const std::vector<uchar> &payload);
+bool readShardMessage(int fd, bool request, int &code, std::vector<uchar> &payload);
+
+void encodeShardSearch(const Mat &descriptors, int k, std::vector<uchar> &payload);
+bool decodeShardSearch(const std::vector<uchar> &payload, Mat &descriptors, int &k);
+void encodeShardFeatures(const ViewpointFeatures &features, const std::vector<uchar> &encodedImage, std::vector<uchar> &payload);
+bool decodeShardFeatures(const std::vector<uchar> &payload, ViewpointFeatures &features);
+
+struct ShardStats
+{
+  ShardStats();
+
+  std::string path;
+  long requests;
+  long failures;        // requests which failed or were refused
+  long stragglers;      // requests abandoned at the timeout
+  long skipped;         // requests not sent because the shard failed recently
+  double totalMs;       // time spent on requests which were answered
+  double maxMs;
+};
+
+struct ShardWorkers;
+
+class ShardSet
+{
+public:
+  ShardSet();
+  ~ShardSet();
+
+  void configure(const std::vector<std::string> &paths, int timeoutMs, int topK);
+  bool isEnabled();
+  int size();
+  int search(const Mat &descriptors, int budgetMs, std::vector<int> &votes);
+  bool owns(int viewpoint);
+  std::shared_ptr<ViewpointFeatures> fetchFeatures(int viewpoint, const std::string &id, int budgetMs);
+  std::vector<ShardStats> getStats();
+
+protected:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  void scatter(const std::vector<int> &shards, int type, const std::vector<uchar> &request, int timeoutMs,
+    std::vector<char> &answered, std::vector<std::vector<uchar> > &responses);
+  void refreshOwners(int budgetMs);
+  void startWorkers();
+  void stopWorkers();
+
+  std::mutex mutex;
+  std::vector<std::string> paths;
+  std::vector<ShardStats> stats;
+  std::vector<TimePoint> retryAfter;    // a failed shard is skipped until then
+  std::vector<char> described;          // the shard's viewpoints are in owners
+  std::map<int, int> owners;            // bigmatcher index of a viewpoint -> its shard
+  int timeoutMs;                        // longest a request waits for a shard
+  int topK;                             // viewpoints each shard votes for
+  std::vector<std::unique_ptr<ShardWorkers> > workers;   // the threads calling each shard
+  pid_t workersPid;                     // process the workers were started in
+
+private:
+  ShardSet(const ShardSet&);
+  ShardSet& operator=(const ShardSet&);
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include <algorithm>
+#include "viewpoint_cache.hpp"
+
+ViewpointCache::ViewpointCache()
+{
+  maxBytes = 0;
+  maxEntries = 0;
+  totalBytes = 0;
+  hits = 0;
+  misses = 0;
+}
+
+// Approximate memory held by a viewpoint's rerank data; the FLANN index is estimated from
+// its default 4 kd-trees, each holding a node and an index entry per descriptor
+size_t viewpointFeaturesBytes(const ViewpointFeatures &features)
+{
+  size_t bytes = features.image.total() * features.image.elemSize();
+  bytes += features.descriptors.total() * features.descriptors.elemSize();
+  bytes += features.keypoints.size() * sizeof(KeyPoint);
+  if(!features.index.empty()) bytes += 4 * features.descriptors.rows * 48;
+  return bytes;
+}
+
+// Hold at most maxBytes of viewpoint data in at most maxEntries viewpoints (either 0 turns
+// the cache off). Evicts as needed to fit the new limits.
+void ViewpointCache::configure(size_t _maxBytes, int _maxEntries)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  maxBytes = _maxEntries > 0 ? _maxBytes : 0;
+  maxEntries = std::max(0, _maxEntries);
+  evict();
+}
+
+// The cached data of viewpoint id, or null if it is not cached
+std::shared_ptr<const ViewpointFeatures> ViewpointCache::find(const std::string &id)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<std::string, std::list<Entry>::iterator>::iterator it = entries.find(id);
+  if(it == entries.end())
+  {
+    if(maxBytes > 0) misses++;
+    return std::shared_ptr<const ViewpointFeatures>();
+  }
+  hits++;
+  lru.splice(lru.begin(), lru, it->second);
+  return it->second->second;
+}
+
+// Cache the data of viewpoint id, replacing any already cached for it
+void ViewpointCache::insert(const std::string &id, const std::shared_ptr<const ViewpointFeatures> &features)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if(maxBytes == 0 || features->bytes > maxBytes) return;
+  std::map<std::string, std::list<Entry>::iterator>::iterator it = entries.find(id);
+  if(it != entries.end())
+  {
+    totalBytes -= it->second->second->bytes;
+    lru.erase(it->second);
+    entries.erase(it);
+  }
+  lru.push_front(Entry(id, features));
+  entries[id] = lru.begin();
+  totalBytes += features->bytes;
+  evict();
+}
+
+// Drop the least recently used viewpoints until within the limits; the mutex must be held
+void ViewpointCache::evict()
+{
+  while(!lru.empty() && (totalBytes > maxBytes || lru.size() > maxEntries))
+  {
+    totalBytes -= lru.back().second->bytes;
+    entries.erase(lru.back().first);
+    lru.pop_back();
+  }
+}
+
+// Drop every cached viewpoint, e.g. once the SV images have changed
+void ViewpointCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.clear();
+  entries.clear();
+  totalBytes = 0;
+}
+
+long ViewpointCache::getHits()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return hits;
+}
+
+long ViewpointCache::getMisses()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return misses;
+}
+
+int ViewpointCache::size()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return lru.size();
+}
+
+size_t ViewpointCache::bytes()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return totalBytes;
+}
@@ -0,0 +1,66 @@
+/*  Cache of the rerank data of recently verified SV viewpoints.
+**
+**  Queries of the same landmark shortlist many of the same viewpoints, each
+**  of which the rerank would otherwise read, extract and index again. The
+**  cache keeps each viewpoint's image, rootSIFT keypoints and descriptors and
+**  a FLANN index over the descriptors, ready to match, evicting the least
+**  recently used viewpoints to stay within a memory and an entry limit.
+**
+**  Entries are immutable once inserted and shared with the requests using
+**  them, so an evicted entry stays valid until those requests finish.
+*/
+#ifndef VIEWPOINT_CACHE_HPP
+#define VIEWPOINT_CACHE_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace cv;
+
+struct ViewpointFeatures
+{
+  Mat image;
+  std::vector<KeyPoint> keypoints;
+  Mat descriptors;
+  Ptr<flann::Index> index;    // over descriptors, see buildMatchIndex
+  size_t bytes;               // approximate memory held
+};
+
+class ViewpointCache
+{
+public:
+  ViewpointCache();
+
+  void configure(size_t maxBytes, int maxEntries);
+  std::shared_ptr<const ViewpointFeatures> find(const std::string &id);
+  void insert(const std::string &id, const std::shared_ptr<const ViewpointFeatures> &features);
+  void clear();
+
+  long getHits();
+  long getMisses();
+  int size();
+  size_t bytes();
+
+protected:
+  typedef std::pair<std::string, std::shared_ptr<const ViewpointFeatures> > Entry;
+
+  void evict();
+
+  std::mutex mutex;
+  std::list<Entry> lru;                                       // most recently used first
+  std::map<std::string, std::list<Entry>::iterator> entries;
+  size_t maxBytes;        // 0 = cache off
+  int maxEntries;
+  size_t totalBytes;
+  long hits;
+  long misses;
+};
+
+size_t viewpointFeaturesBytes(const ViewpointFeatures &features);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include "viewpoint_clusters.hpp"
+
+// The location part (<lat>,<lng>) of a viewpoint id <lat>,<lng>,<heading>,<pitch>
+std::string locationOf(const std::string &id)
+{
+  size_t secondComma = id.find(',', id.find(',') + 1);
+  return id.substr(0, secondComma);
+}
+
+ViewpointClusters::ViewpointClusters()
+{
+  count = 0;
+}
+
+// Assign the viewpoints (in bigmatcher order) to clusters by location
+void ViewpointClusters::build(const std::vector<std::string> &ids)
+{
+  std::map<std::string, int> locations;
+  clusters.resize(ids.size());
+  for(int i = 0; i < ids.size(); i++)
+  {
+    std::map<std::string, int>::iterator it = locations.find(locationOf(ids.at(i)));
+    if(it == locations.end())
+    {
+      it = locations.insert(std::make_pair(locationOf(ids.at(i)), (int)locations.size())).first;
+    }
+    clusters.at(i) = it->second;
+  }
+  count = locations.size();
+}
+
+// Read the clusters at path, checking they cover numViewpoints viewpoints
+bool ViewpointClusters::load(const std::string &path, int numViewpoints)
+{
+  clusters.clear();
+  count = 0;
+  std::ifstream in(path.c_str(), std::ios::in | std::ifstream::binary);
+  if(!in.is_open()) return false;
+
+  char magic[4];
+  int header[2];
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(header), sizeof(header));
+  if(!in.good() || memcmp(magic, "SVC1", 4) != 0 || header[0] != numViewpoints || header[1] < 0)
+  {
+    printf("Ignoring viewpoint clusters '%s': it was built for another bigmatcher\n", path.c_str());
+    return false;
+  }
+  clusters.resize(header[0]);
+  if(clusters.size() > 0) in.read(reinterpret_cast<char*>(&clusters[0]), clusters.size() * sizeof(int));
+  bool valid = in.good();
+  for(int i = 0; valid && i < clusters.size(); i++)
+  {
+    valid = clusters.at(i) >= 0 && clusters.at(i) < header[1];
+  }
+  if(!valid)
+  {
+    printf("Ignoring viewpoint clusters '%s': it is corrupt\n", path.c_str());
+    clusters.clear();
+    return false;
+  }
+  count = header[1];
+  return true;
+}
+
+bool ViewpointClusters::store(const std::string &path) const
+{
+  std::ofstream out(path.c_str(), std::ios::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!out.is_open()) return false;
+  int header[2] = { (int)clusters.size(), count };
+  out.write("SVC1", 4);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  if(clusters.size() > 0) out.write(reinterpret_cast<const char*>(&clusters[0]), clusters.size() * sizeof(int));
+  return out.good();
+}
+
+bool ViewpointClusters::empty() const
+{
+  return clusters.empty();
+}
+
+int ViewpointClusters::size() const
+{
+  return clusters.size();
+}
+
+int ViewpointClusters::numClusters() const
+{
+  return count;
+}
+
+int ViewpointClusters::clusterOf(int viewpoint) const
+{
+  return clusters.at(viewpoint);
+}
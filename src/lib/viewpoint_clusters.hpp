@@ -0,0 +1,35 @@
+/*  Location cluster of each bigmatcher viewpoint: the viewpoints fetched
+**  from the same lat-lng (every heading and pitch) share a cluster.
+**
+**  Stored as bigmatcher-clusters.bin:
+**    header:   magic "SVC1", #viewpoints, #clusters (ints)
+**    clusters: #viewpoints ints, the cluster of each viewpoint in bigmatcher order
+*/
+#ifndef VIEWPOINT_CLUSTERS_HPP
+#define VIEWPOINT_CLUSTERS_HPP
+
+#include <string>
+#include <vector>
+
+std::string locationOf(const std::string &id);
+
+class ViewpointClusters
+{
+public:
+  ViewpointClusters();
+
+  void build(const std::vector<std::string> &ids);
+  bool load(const std::string &path, int numViewpoints);
+  bool store(const std::string &path) const;
+
+  bool empty() const;
+  int size() const;
+  int numClusters() const;
+  int clusterOf(int viewpoint) const;
+
+protected:
+  std::vector<int> clusters;
+  int count;
+};
+
+#endif
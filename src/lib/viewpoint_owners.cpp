@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <cstring>
+#include <fstream>
+#include "viewpoint_owners.hpp"
+
+ViewpointOwners::ViewpointOwners(){}
+
+// Read the table at path, checking it describes the given bigmatcher segments.
+// A missing or mismatched table leaves every descriptor owned by its segment alone.
+bool ViewpointOwners::load(const std::string &path, const std::vector<Mat> &segments)
+{
+  std::vector<int> segmentRows(segments.size());
+  for(int i = 0; i < segments.size(); i++)
+  {
+    segmentRows.at(i) = segments.at(i).rows;
+  }
+  return load(path, segmentRows);
+}
+
+// As above, given the number of rows in each segment
+bool ViewpointOwners::load(const std::string &path, const std::vector<int> &segmentRows)
+{
+  clear();
+  std::ifstream in(path.c_str(), std::ios::in | std::ifstream::binary);
+  if(!in.is_open()) return false;
+
+  char magic[4];
+  int header[3];
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(header), sizeof(header));
+  if(!in.good() || memcmp(magic, "SVO1", 4) != 0 || header[0] != segmentRows.size() || header[1] < 0 || header[2] < 0)
+  {
+    printf("Ignoring viewpoint owners '%s': it was built for another bigmatcher\n", path.c_str());
+    return false;
+  }
+  starts.resize(header[0] + 1);
+  offsets.resize(header[1] + 1);
+  owners.resize(header[2]);
+  in.read(reinterpret_cast<char*>(&starts[0]), starts.size() * sizeof(int));
+  in.read(reinterpret_cast<char*>(&offsets[0]), offsets.size() * sizeof(int));
+  if(owners.size() > 0) in.read(reinterpret_cast<char*>(&owners[0]), owners.size() * sizeof(int));
+
+  bool valid = in.good() && starts.back() == header[1] && offsets.back() == header[2];
+  for(int i = 0; valid && i < segmentRows.size(); i++)
+  {
+    valid = starts.at(i + 1) - starts.at(i) == segmentRows.at(i);
+  }
+  for(int i = 0; valid && i < owners.size(); i++)
+  {
+    valid = owners.at(i) >= 0 && owners.at(i) < segmentRows.size();
+  }
+  if(!valid)
+  {
+    printf("Ignoring viewpoint owners '%s': it was built for another bigmatcher\n", path.c_str());
+    clear();
+    return false;
+  }
+  return true;
+}
+
+bool ViewpointOwners::store(const std::string &path) const
+{
+  std::ofstream out(path.c_str(), std::ios::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!out.is_open()) return false;
+  int header[3] = { (int)starts.size() - 1, (int)offsets.size() - 1, (int)owners.size() };
+  out.write("SVO1", 4);
+  out.write(reinterpret_cast<const char*>(header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(&starts[0]), starts.size() * sizeof(int));
+  out.write(reinterpret_cast<const char*>(&offsets[0]), offsets.size() * sizeof(int));
+  if(owners.size() > 0) out.write(reinterpret_cast<const char*>(&owners[0]), owners.size() * sizeof(int));
+  return out.good();
+}
+
+void ViewpointOwners::clear()
+{
+  starts.clear();
+  offsets.clear();
+  owners.clear();
+}
+
+bool ViewpointOwners::empty() const
+{
+  return owners.empty();
+}
+
+// The viewpoints other than its own segment owning a bigmatcher descriptor; returns how many
+int ViewpointOwners::extraOwners(int imgIdx, int trainIdx, const int* &extra) const
+{
+  if(owners.empty() || imgIdx < 0 || imgIdx + 1 >= starts.size()) return 0;
+  int row = starts[imgIdx] + trainIdx;
+  if(trainIdx < 0 || row >= starts[imgIdx + 1]) return 0;
+  extra = &owners[0] + offsets[row];
+  return offsets[row + 1] - offsets[row];
+}
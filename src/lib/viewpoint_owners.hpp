@@ -0,0 +1,41 @@
+/*  Extra viewpoints owning the descriptors of a deduplicated bigmatcher.
+**
+**  When near-identical descriptors from overlapping views of the same
+**  location are merged into one, the survivor stays in its own viewpoint's
+**  segment and the viewpoints of the descriptors merged into it are listed
+**  here, so a match against it can vote for all of them.
+**
+**  Stored as bigmatcher-owners.bin:
+**    header:   magic "SVO1", #segments, #descriptor rows, #owners (ints)
+**    starts:   #segments + 1 ints, the first row of each segment
+**    offsets:  #rows + 1 ints, the first owner of each row
+**    owners:   #owners ints, viewpoint (segment) indices
+*/
+#ifndef VIEWPOINT_OWNERS_HPP
+#define VIEWPOINT_OWNERS_HPP
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+class ViewpointOwners
+{
+public:
+  ViewpointOwners();
+
+  bool load(const std::string &path, const std::vector<Mat> &segments);
+  bool load(const std::string &path, const std::vector<int> &segmentRows);
+  bool store(const std::string &path) const;
+  void clear();
+
+  bool empty() const;
+  int extraOwners(int imgIdx, int trainIdx, const int* &owners) const;
+
+  std::vector<int> starts;   // first row of each segment, plus the total
+  std::vector<int> offsets;  // first owner of each row, plus the total
+  std::vector<int> owners;
+};
+
+#endif
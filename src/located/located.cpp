@@ -0,0 +1,343 @@
+/*
+** Locate daemon: loads the bigmatcher once and serves locate requests over a
+** Unix domain socket, so that the web server only has to forward the query
+** image rather than hold the index in its own process.
+**
+** Each connection carries one request: a LocateRequestHeader followed by
+** `length` bytes of encoded image, answered by a LocateResponse (see
+** bin/locate_client.py for the client side). Requests are read by a single
+** poll loop, which reads each connection's bytes as they arrive so that a slow
+** client cannot hold up the others, and drops a connection whose request is
+** not complete within READ_TIMEOUT_MS of being accepted. Complete requests are
+** handed to a fixed pool of workers through a bounded queue. A request
+** arriving while the queue is full is refused immediately with
+** LOCATE_OVERLOADED, and one which waited in the queue for longer than its
+** latency budget is answered with LOCATE_TIMEOUT without being located;
+** otherwise the worker locates it within what is left of its budget.
+**
+** Must be run from the folder containing the stored bigmatcher. SV images are
+** read from <sv-folder>/images.sva when it exists. SIGINT/SIGTERM remove the
+** socket and print the request counters before exiting.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <omp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "/root/server/src/lib/locator.hpp"
+#include "/root/server/src/lib/bounded_queue.hpp"
+
+using namespace cv;
+
+static const char REQUEST_MAGIC[4] = { 'S', 'V', 'L', 'Q' };
+static const char RESPONSE_MAGIC[4] = { 'S', 'V', 'L', 'R' };
+static const uint32_t PROTOCOL_VERSION = 2;
+static const uint32_t MAX_REQUEST_BYTES = 32 * 1024 * 1024;
+static const int READ_TIMEOUT_MS = 2000;
+static const int MAX_PENDING_READS = 128;
+
+// Little-endian, packed; mirrored by struct.Struct('<4sIiIddd') in bin/locate_client.py
+#pragma pack(push, 1)
+struct LocateRequestHeader
+{
+  char magic[4];
+  uint32_t version;
+  int32_t budgetMs;     // latency budget including time spent queued (0 = unlimited)
+  uint32_t length;      // bytes of encoded image which follow
+  double hintLat;       // approximate location of the query, see LocateParams
+  double hintLng;
+  double hintRadius;    // metres around the hint to search (0 = no hint)
+};
+
+// Mirrored by struct.Struct('<4siiiddd') in bin/locate_client.py
+struct LocateResponse
+{
+  char magic[4];
+  int32_t status;       // LocateStatus
+  int32_t located;
+  int32_t degraded;
+  double lat;
+  double lng;
+  double elapsedMs;     // time from the request being read to the response being sent
+};
+#pragma pack(pop)
+
+struct LocateJob
+{
+  int fd;
+  int budgetMs;
+  double hintLat;
+  double hintLng;
+  double hintRadius;
+  std::vector<uchar> encoded;
+  std::chrono::steady_clock::time_point received;
+};
+
+// A connection whose request is still being read by the poll loop
+struct PendingRead
+{
+  int fd;
+  std::chrono::steady_clock::time_point received;
+  LocateRequestHeader header;
+  size_t headerBytes;   // of the header read so far
+  LocateJob* job;       // created once the header is complete
+  size_t bodyBytes;     // of the encoded image read so far
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+void onSignal(int)
+{
+  stopping = 1;
+}
+
+void DIE(const char* message)
+{
+  printf("%s\n", message);
+  exit(1);
+}
+
+bool writeFully(int fd, const void* data, size_t size)
+{
+  const char* p = (const char*)data;
+  while(size > 0)
+  {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Send the response for a request and close its connection
+void respond(int fd, LocateStatus status, bool located, const LocateResult* result, std::chrono::steady_clock::time_point received)
+{
+  LocateResponse response;
+  memcpy(response.magic, RESPONSE_MAGIC, 4);
+  response.status = status;
+  response.located = located ? 1 : 0;
+  response.degraded = (result != NULL && result->degraded) ? 1 : 0;
+  response.lat = result != NULL ? result->lat : 0;
+  response.lng = result != NULL ? result->lng : 0;
+  response.elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - received).count();
+  writeFully(fd, &response, sizeof(response));
+  close(fd);
+}
+
+int listenOn(const char* path)
+{
+  struct sockaddr_un addr;
+  if(strlen(path) >= sizeof(addr.sun_path))
+  {
+    DIE("Socket path is too long");
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0)
+  {
+    DIE("Can't create socket");
+  }
+  unlink(path);   // stale socket left by a previous run
+  if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0)
+  {
+    printf("Can't listen on '%s': %s\n", path, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+int main( int argc, char** argv )
+{
+  if(argc < 4)
+  {
+    DIE("Missing arguments! Usage:\n\t./located <socket-path> <sv-folder> <filenames-file> [<workers> [<queue-size> [<coalesce-ms>]]]");
+  }
+  const char* socketPath = argv[1];
+  std::string svFolder(argv[2]);
+  svFolder += "/";
+  std::string filenamesFile(argv[3]);
+  int workers = argc > 4 ? atoi(argv[4]) : (int)std::thread::hardware_concurrency();
+  int queueSize = argc > 5 ? atoi(argv[5]) : 2 * workers;
+  double coalesceMs = argc > 6 ? atof(argv[6]) : 0;
+  if(workers < 1) workers = 1;
+  if(queueSize < 1) queueSize = 1;
+
+  // Load the index once for every worker
+  Locator locator;
+  locator.openArchive((svFolder + "images.sva").c_str());
+  if(coalesceMs > 0)
+  {
+    locator.setCoalescing(coalesceMs, workers);
+  }
+  // Workers locate in parallel, so each rerank runs on a share of the threads
+  omp_set_num_threads(std::max(1, (int)std::thread::hardware_concurrency() / workers));
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onSignal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listenFd = listenOn(socketPath);
+  printf("Listening on %s with %d workers, queue of %d\n", socketPath, workers, queueSize);
+
+  BoundedQueue<LocateJob*> queue(queueSize);
+  std::atomic<long> accepted(0), refused(0), expired(0), malformed(0);
+
+  std::vector<std::thread> pool;
+  for(int w = 0; w < workers; w++)
+  {
+    pool.push_back(std::thread([&]() {
+      LocateJob* job;
+      while(queue.pop(job))
+      {
+        double waitedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job->received).count();
+        if(job->budgetMs > 0 && waitedMs >= job->budgetMs)
+        {
+          // No point starting: the client has stopped waiting for this one
+          expired++;
+          respond(job->fd, LOCATE_TIMEOUT, false, NULL, job->received);
+        }
+        else
+        {
+          LocateParams params;
+          params.budgetMs = job->budgetMs > 0 ? std::max(1, job->budgetMs - (int)waitedMs) : 0;
+          params.hintLat = job->hintLat;
+          params.hintLng = job->hintLng;
+          params.hintRadius = job->hintRadius;
+          LocateResult result;
+          bool located = locator.locate(job->encoded, svFolder.c_str(), filenamesFile.c_str(), params, result);
+          respond(job->fd, result.status, located, &result, job->received);
+        }
+        delete job;
+      }
+    }));
+  }
+
+  // Accept connections and read their requests until signalled, polling so the stop flag is noticed
+  std::vector<PendingRead> pending;
+  while(!stopping)
+  {
+    std::vector<struct pollfd> pfds;
+    struct pollfd listenPfd = { listenFd, (short)(pending.size() < MAX_PENDING_READS ? POLLIN : 0), 0 };
+    pfds.push_back(listenPfd);
+    for(int i = 0; i < pending.size(); i++)
+    {
+      struct pollfd pfd = { pending.at(i).fd, POLLIN, 0 };
+      pfds.push_back(pfd);
+    }
+    if(poll(pfds.data(), pfds.size(), pending.empty() ? 500 : 50) < 0) continue;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    // Read what has arrived on each connection, handing over the complete requests
+    std::vector<PendingRead> stillPending;
+    for(int i = 0; i < pending.size(); i++)
+    {
+      PendingRead &read = pending.at(i);
+      bool ok = true;
+      if(pfds.at(i + 1).revents != 0)
+      {
+        ok = readAvailable(read.fd, &read.header, sizeof(read.header), read.headerBytes);
+        if(ok && read.job == NULL && read.headerBytes == sizeof(read.header))
+        {
+          ok = memcmp(read.header.magic, REQUEST_MAGIC, 4) == 0 && read.header.version == PROTOCOL_VERSION
+            && read.header.length > 0 && read.header.length <= MAX_REQUEST_BYTES;
+          if(ok)
+          {
+            read.job = new LocateJob();
+            read.job->fd = read.fd;
+            read.job->budgetMs = read.header.budgetMs;
+            read.job->hintLat = read.header.hintLat;
+            read.job->hintLng = read.header.hintLng;
+            read.job->hintRadius = read.header.hintRadius;
+            read.job->received = read.received;
+            read.job->encoded.resize(read.header.length);
+          }
+        }
+        if(ok && read.job != NULL)
+        {
+          ok = readAvailable(read.fd, read.job->encoded.data(), read.job->encoded.size(), read.bodyBytes);
+        }
+      }
+      bool complete = ok && read.job != NULL && read.bodyBytes == read.job->encoded.size();
+      if(!complete && ok && now - read.received < std::chrono::milliseconds(READ_TIMEOUT_MS))
+      {
+        stillPending.push_back(read);
+        continue;
+      }
+      if(!complete)
+      {
+        malformed++;
+        respond(read.fd, LOCATE_UNREADABLE, false, NULL, read.received);
+        delete read.job;
+        continue;
+      }
+
+      // The worker answers with blocking writes
+      fcntl(read.fd, F_SETFL, fcntl(read.fd, F_GETFL) & ~O_NONBLOCK);
+      if(!queue.tryPush(read.job))
+      {
+        refused++;
+        respond(read.fd, LOCATE_OVERLOADED, false, NULL, read.received);
+        delete read.job;
+        continue;
+      }
+      accepted++;
+    }
+    pending.swap(stillPending);
+
+    if(pfds.at(0).revents & POLLIN)
+    {
+      int fd = accept(listenFd, NULL, NULL);
+      if(fd < 0) continue;
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      PendingRead read;
+      read.fd = fd;
+      read.received = std::chrono::steady_clock::now();
+      read.headerBytes = 0;
+      read.job = NULL;
+      read.bodyBytes = 0;
+      pending.push_back(read);
+    }
+  }
+  for(int i = 0; i < pending.size(); i++)
+  {
+    close(pending.at(i).fd);
+    delete pending.at(i).job;
+  }
+
+  // Stop accepting, then let the workers drain what was already admitted
+  close(listenFd);
+  unlink(socketPath);
+  queue.close();
+  for(int w = 0; w < workers; w++)
+  {
+    pool.at(w).join();
+  }
+
+  LocatorStats stats = locator.getCounters();
+  printf("Accepted %ld, refused (overloaded) %ld, expired in queue %ld, malformed %ld\n",
+    accepted.load(), refused.load(), expired.load(), malformed.load());
+  printf("Located %ld of %ld (%ld degraded)\n", stats.located, stats.requests, stats.degraded);
+  return 0;
+}
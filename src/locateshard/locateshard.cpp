@@ -0,0 +1,424 @@
+/*
+** Locate shard: holds the bigmatcher indexes of a share of the viewpoints and
+** serves a coordinating Locator over a Unix domain socket (see
+** src/lib/shard_set.hpp for the protocol and Locator::setShards).
+**
+** Shard <shard> of <shards> owns every region of a regional bigmatcher whose
+** position in bigmatcher-regions.txt is <shard> modulo <shards>, so each host
+** only needs the snapshots of its own regions. A single shard may instead
+** serve a global bigmatcher.snapshot. A search answers with the viewpoints
+** given the most votes among the shard's own descriptors; a features request
+** answers with a viewpoint's rootSIFT keypoints and descriptors and its image,
+** read from <sv-folder>/images.sva when it exists.
+**
+** As in src/located, a single poll loop reads each connection's request as
+** its bytes arrive, dropping one not complete within READ_TIMEOUT_MS, and
+** hands complete requests to a pool of workers through a bounded queue,
+** refusing them with SHARD_OVERLOADED while it is full. Must be run from the folder containing
+** the stored bigmatcher. SIGINT/SIGTERM remove the socket and exit.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <omp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <chrono>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "/root/server/src/lib/engine.hpp"
+#include "/root/server/src/lib/regional_index.hpp"
+#include "/root/server/src/lib/mapped_index.hpp"
+#include "/root/server/src/lib/viewpoint_owners.hpp"
+#include "/root/server/src/lib/image_archive.hpp"
+#include "/root/server/src/lib/shard_set.hpp"
+#include "/root/server/src/lib/bounded_queue.hpp"
+
+using namespace cv;
+
+static const int READ_TIMEOUT_MS = 2000;
+static const int MAX_PENDING_READS = 128;
+
+struct ShardJob
+{
+  int fd;
+  int type;
+  std::vector<uchar> payload;
+};
+
+// A connection whose request is still being read by the poll loop
+struct PendingRead
+{
+  int fd;
+  std::chrono::steady_clock::time_point received;
+  ShardMessageHeader header;
+  size_t headerBytes;   // of the header read so far
+  ShardJob* job;        // created once the header is complete
+  size_t bodyBytes;     // of the payload read so far
+};
+
+// What this shard holds
+struct Shard
+{
+  RegionalIndex regionalIndex;
+  MappedIndex mappedIndex;          // used instead if the bigmatcher is global
+  std::vector<int> regions;         // of regionalIndex, owned by this shard
+  std::vector<int> viewpoints;      // bigmatcher index of each viewpoint owned
+  std::vector<char> owned;          // by bigmatcher index
+  ViewpointOwners owners;
+  ImageArchive archive;
+  std::string svFolder;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+void onSignal(int)
+{
+  stopping = 1;
+}
+
+void DIE(const char* message)
+{
+  printf("%s\n", message);
+  exit(1);
+}
+
+// Search the shard's descriptors, voting for each viewpoint a match falls in as the Locator
+// does, and keep the k viewpoints with the most votes
+void search(Shard &shard, const Mat &descriptors, int k, std::vector<uchar> &response)
+{
+  std::vector<std::vector<DMatch> > knn_matches;
+  if(shard.regionalIndex.isLoaded())
+  {
+    shard.regionalIndex.knnMatch(descriptors, shard.regions, knn_matches, 2);
+  }
+  else
+  {
+    shard.mappedIndex.knnMatch(descriptors, knn_matches, 2);
+  }
+  std::vector<DMatch> matches;
+  loweFilter(knn_matches, matches);
+
+  std::vector<int> votes(shard.owned.size(), 0);
+  for(int i = 0; i < matches.size(); i++)
+  {
+    int index = matches.at(i).imgIdx;
+    if(index >= 0 && index < votes.size()) votes.at(index)++;
+    const int* extra;
+    int numExtra = shard.owners.extraOwners(index, matches.at(i).trainIdx, extra);
+    for(int j = 0; j < numExtra; j++)
+    {
+      if(extra[j] < votes.size()) votes.at(extra[j])++;
+    }
+  }
+  std::vector<ShardVote> voted;
+  for(int v = 0; v < votes.size(); v++)
+  {
+    if(votes.at(v) == 0) continue;
+    ShardVote vote = { v, votes.at(v) };
+    voted.push_back(vote);
+  }
+  int keep = std::min(k, (int)voted.size());
+  std::partial_sort(voted.begin(), voted.begin() + keep, voted.end(), [](const ShardVote &a, const ShardVote &b) {
+    return a.votes > b.votes;
+  });
+  voted.resize(keep);
+  response.resize(voted.size() * sizeof(ShardVote));
+  if(!voted.empty()) memcpy(&response[0], &voted[0], response.size());
+}
+
+// Read the viewpoint's image as it was encoded, from the archive if it holds it
+bool readEncoded(Shard &shard, const std::string &id, std::vector<uchar> &encoded)
+{
+  const uchar* data;
+  size_t size;
+  if(shard.archive.getEncoded(id, data, size))
+  {
+    encoded.assign(data, data + size);
+    return true;
+  }
+  std::ifstream in((shard.svFolder + id + ".jpg").c_str(), std::ifstream::binary);
+  if(!in.is_open()) return false;
+  encoded.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  return !encoded.empty();
+}
+
+ShardStatus features(Shard &shard, const std::vector<uchar> &request, Ptr<FeatureDetector> &detector, std::vector<uchar> &response)
+{
+  int32_t viewpoint;
+  if(request.size() <= sizeof(viewpoint)) return SHARD_BAD_REQUEST;
+  memcpy(&viewpoint, &request[0], sizeof(viewpoint));
+  std::string id(request.begin() + sizeof(viewpoint), request.end());
+  if(viewpoint < 0 || viewpoint >= shard.owned.size() || !shard.owned.at(viewpoint)) return SHARD_BAD_REQUEST;
+
+  std::vector<uchar> encoded;
+  ViewpointFeatures extracted;
+  if(readEncoded(shard, id, encoded)) extracted.image = imdecode(encoded, IMREAD_COLOR);
+  if(extracted.image.data == NULL)
+  {
+    printf("Unable to load SV image '%s'\n", id.c_str());
+    return SHARD_UNREADABLE;
+  }
+  getKeypointsAndDescriptors(extracted.image, extracted.keypoints, extracted.descriptors, detector);
+  rootSIFT(extracted.descriptors);
+  encodeShardFeatures(extracted, encoded, response);
+  return SHARD_OK;
+}
+
+void respond(int fd, int status, const std::vector<uchar> &payload)
+{
+  writeShardMessage(fd, false, status, payload);
+  close(fd);
+}
+
+int listenOn(const char* path)
+{
+  struct sockaddr_un addr;
+  if(strlen(path) >= sizeof(addr.sun_path))
+  {
+    DIE("Socket path is too long");
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0)
+  {
+    DIE("Can't create socket");
+  }
+  unlink(path);   // stale socket left by a previous run
+  if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0)
+  {
+    printf("Can't listen on '%s': %s\n", path, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+int main( int argc, char** argv )
+{
+  if(argc < 5)
+  {
+    DIE("Missing arguments! Usage:\n\t./locateshard <socket-path> <sv-folder> <shard> <shards> [<workers> [<queue-size>]]");
+  }
+  const char* socketPath = argv[1];
+  int shardNumber = atoi(argv[3]);
+  int numShards = atoi(argv[4]);
+  int workers = argc > 5 ? atoi(argv[5]) : (int)std::thread::hardware_concurrency();
+  int queueSize = argc > 6 ? atoi(argv[6]) : 2 * workers;
+  if(numShards < 1 || shardNumber < 0 || shardNumber >= numShards)
+  {
+    DIE("The shard must be one of 0 to <shards> - 1");
+  }
+  if(workers < 1) workers = 1;
+  if(queueSize < 1) queueSize = 1;
+
+  // Load this shard's share of the bigmatcher, keeping every one of its regions resident
+  Shard shard;
+  shard.svFolder = std::string(argv[2]) + "/";
+  std::vector<int> segmentRows;
+  if(shard.regionalIndex.load("bigmatcher-regions.txt"))
+  {
+    shard.regionalIndex.setBudget(0);
+    segmentRows = shard.regionalIndex.getSegmentRows();
+    std::vector<int> regions = shard.regionalIndex.allRegions();
+    for(int r = 0; r < regions.size(); r++)
+    {
+      if(r % numShards != shardNumber) continue;
+      shard.regions.push_back(r);
+      const std::vector<int> &viewpoints = shard.regionalIndex.regionViewpoints(r);
+      shard.viewpoints.insert(shard.viewpoints.end(), viewpoints.begin(), viewpoints.end());
+    }
+    shard.regionalIndex.prefetch(shard.regions);
+  }
+  else if(numShards == 1 && shard.mappedIndex.load("bigmatcher.snapshot"))
+  {
+    const std::vector<Mat> &segments = shard.mappedIndex.getSegments();
+    for(int i = 0; i < segments.size(); i++)
+    {
+      segmentRows.push_back(segments.at(i).rows);
+      shard.viewpoints.push_back(i);
+    }
+  }
+  else
+  {
+    DIE("A shard needs a regional bigmatcher, or a bigmatcher snapshot if it is the only shard");
+  }
+  shard.owned.assign(segmentRows.size(), 0);
+  for(int i = 0; i < shard.viewpoints.size(); i++)
+  {
+    shard.owned.at(shard.viewpoints.at(i)) = 1;
+  }
+  shard.owners.load("bigmatcher-owners.bin", segmentRows);
+  shard.archive.open(shard.svFolder + "images.sva");
+  printf("Shard %d of %d: %d regions, %d viewpoints\n", shardNumber, numShards, (int)shard.regions.size(), (int)shard.viewpoints.size());
+
+  // Workers serve requests in parallel, so each runs on a share of the threads
+  omp_set_num_threads(std::max(1, (int)std::thread::hardware_concurrency() / workers));
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onSignal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listenFd = listenOn(socketPath);
+  printf("Listening on %s with %d workers, queue of %d\n", socketPath, workers, queueSize);
+
+  BoundedQueue<ShardJob*> queue(queueSize);
+  std::atomic<long> searches(0), fetches(0), refused(0), malformed(0);
+
+  std::vector<std::thread> pool;
+  for(int w = 0; w < workers; w++)
+  {
+    pool.push_back(std::thread([&]() {
+      Ptr<FeatureDetector> detector;
+      createDetector(detector, "SIFT");
+      ShardJob* job;
+      while(queue.pop(job))
+      {
+        std::vector<uchar> response;
+        int status = SHARD_OK;
+        if(job->type == SHARD_INFO)
+        {
+          response.resize(shard.viewpoints.size() * sizeof(int32_t));
+          if(!response.empty()) memcpy(&response[0], &shard.viewpoints[0], response.size());
+        }
+        else if(job->type == SHARD_SEARCH)
+        {
+          Mat descriptors;
+          int k;
+          if(decodeShardSearch(job->payload, descriptors, k))
+          {
+            searches++;
+            search(shard, descriptors, k, response);
+          }
+          else
+          {
+            status = SHARD_BAD_REQUEST;
+          }
+        }
+        else if(job->type == SHARD_FEATURES)
+        {
+          fetches++;
+          status = features(shard, job->payload, detector, response);
+        }
+        else
+        {
+          status = SHARD_BAD_REQUEST;
+        }
+        if(status == SHARD_BAD_REQUEST) malformed++;
+        respond(job->fd, status, status == SHARD_OK ? response : std::vector<uchar>());
+        delete job;
+      }
+    }));
+  }
+
+  // Accept connections and read their requests until signalled, polling so the stop flag is noticed
+  std::vector<PendingRead> pending;
+  while(!stopping)
+  {
+    std::vector<struct pollfd> pfds;
+    struct pollfd listenPfd = { listenFd, (short)(pending.size() < MAX_PENDING_READS ? POLLIN : 0), 0 };
+    pfds.push_back(listenPfd);
+    for(int i = 0; i < pending.size(); i++)
+    {
+      struct pollfd pfd = { pending.at(i).fd, POLLIN, 0 };
+      pfds.push_back(pfd);
+    }
+    if(poll(pfds.data(), pfds.size(), pending.empty() ? 500 : 50) < 0) continue;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    // Read what has arrived on each connection, handing over the complete requests
+    std::vector<PendingRead> stillPending;
+    for(int i = 0; i < pending.size(); i++)
+    {
+      PendingRead &read = pending.at(i);
+      bool ok = true;
+      if(pfds.at(i + 1).revents != 0)
+      {
+        ok = readAvailable(read.fd, &read.header, sizeof(read.header), read.headerBytes);
+        if(ok && read.job == NULL && read.headerBytes == sizeof(read.header))
+        {
+          ok = isShardHeader(read.header, true);
+          if(ok)
+          {
+            read.job = new ShardJob();
+            read.job->fd = read.fd;
+            read.job->type = read.header.code;
+            read.job->payload.resize(read.header.length);
+          }
+        }
+        if(ok && read.job != NULL)
+        {
+          ok = readAvailable(read.fd, read.job->payload.data(), read.job->payload.size(), read.bodyBytes);
+        }
+      }
+      bool complete = ok && read.job != NULL && read.bodyBytes == read.job->payload.size();
+      if(!complete && ok && now - read.received < std::chrono::milliseconds(READ_TIMEOUT_MS))
+      {
+        stillPending.push_back(read);
+        continue;
+      }
+      // The answers are blocking writes
+      fcntl(read.fd, F_SETFL, fcntl(read.fd, F_GETFL) & ~O_NONBLOCK);
+      if(!complete)
+      {
+        malformed++;
+        respond(read.fd, SHARD_BAD_REQUEST, std::vector<uchar>());
+        delete read.job;
+        continue;
+      }
+      if(!queue.tryPush(read.job))
+      {
+        refused++;
+        respond(read.fd, SHARD_OVERLOADED, std::vector<uchar>());
+        delete read.job;
+      }
+    }
+    pending.swap(stillPending);
+
+    if(pfds.at(0).revents & POLLIN)
+    {
+      int fd = accept(listenFd, NULL, NULL);
+      if(fd < 0) continue;
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      PendingRead read;
+      read.fd = fd;
+      read.received = std::chrono::steady_clock::now();
+      read.headerBytes = 0;
+      read.job = NULL;
+      read.bodyBytes = 0;
+      pending.push_back(read);
+    }
+  }
+  for(int i = 0; i < pending.size(); i++)
+  {
+    close(pending.at(i).fd);
+    delete pending.at(i).job;
+  }
+
+  // Stop accepting, then let the workers drain what was already admitted
+  close(listenFd);
+  unlink(socketPath);
+  queue.close();
+  for(int w = 0; w < workers; w++)
+  {
+    pool.at(w).join();
+  }
+  printf("Searches %ld, feature fetches %ld, refused (overloaded) %ld, malformed %ld\n",
+    searches.load(), fetches.load(), refused.load(), malformed.load());
+  return 0;
+}